@@ -9,14 +9,598 @@
 #include <iomanip> // Required for std::get_time for parsing dates
 #include <stdexcept>
 #include <utility> // Required for std::pair
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include <deque>
+#include <map>
+#include <thread>
+#include <memory>
+#include <functional>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <optional>
+#include <random>
+#include <cmath>
+#ifdef CANVASUPDATER_WITH_ZLIB
+#include <zlib.h> // Only for comparing against zlib in bench-deflate
+#endif
+#ifndef _WIN32
+#include <csignal>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <dlfcn.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
+#if defined(__linux__) && defined(__cpp_impl_coroutine)
+#define CANVASUPDATER_ASYNC 1 // C++20 builds rewrite archives on the coroutine engine
+#include <coroutine>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+// --- Run statistics ---
+// Counters are atomic so any part of the pipeline can bump them without locking.
+enum class Phase { Startup, Unzip, Process, Rezip, Done, Count };
+
+// Counters that are also kept for each archive job, so a batch run can be broken out by course.
+enum CourseCounter {
+    kArchivesProcessed,
+    kEntriesScanned,
+    kEntriesRewritten,
+    kEntriesPatched,
+    kDirectivesRendered,
+    kStageEdits,
+    kPngBytesSaved,
+    kBytesIn,
+    kBytesOut,
+    kCourseCounterCount
+};
+
+/**
+ * @brief One archive job's share of the course counters.
+ */
+struct CourseStats {
+    std::string input; // The job's input archive
+    std::string label; // Value of the "course" metrics label
+    std::atomic<unsigned long long> counts[kCourseCounterCount] = {};
+    std::atomic<bool> failed{false};
+};
+
+// The course the calling thread is working for; null outside an archive job.
+thread_local CourseStats* t_course = nullptr;
+
+/**
+ * @brief Makes a course current on this thread for the lifetime of the scope.
+ */
+class CourseScope {
+public:
+    explicit CourseScope(CourseStats* course) : previous_(t_course) { t_course = course; }
+    ~CourseScope() { t_course = previous_; }
+    CourseScope(const CourseScope&) = delete;
+    CourseScope& operator=(const CourseScope&) = delete;
+
+private:
+    CourseStats* previous_;
+};
+
+/**
+ * @brief Run-wide counter that also counts towards the calling thread's course.
+ */
+class CourseCount {
+public:
+    explicit CourseCount(CourseCounter index) : index_(index) {}
+    void operator++(int) { *this += 1; }
+    void operator+=(unsigned long long n) {
+        total_ += n;
+        if (t_course) t_course->counts[index_] += n;
+    }
+    operator unsigned long long() const { return total_; }
+
+private:
+    CourseCounter index_;
+    std::atomic<unsigned long long> total_{0};
+};
+
+struct RunStats {
+    CourseCount archivesProcessed{kArchivesProcessed};
+    CourseCount entriesScanned{kEntriesScanned};
+    CourseCount entriesRewritten{kEntriesRewritten};
+    CourseCount entriesPatched{kEntriesPatched}; // Rewritten in place, only the changed bytes
+    CourseCount directivesRendered{kDirectivesRendered};
+    CourseCount bytesIn{kBytesIn};
+    CourseCount bytesOut{kBytesOut};
+    std::atomic<unsigned long long> renderCacheHits{0};
+    std::atomic<unsigned long long> renderCacheMisses{0};
+    std::atomic<unsigned long long> partialCacheHits{0};
+    std::atomic<unsigned long long> partialCacheMisses{0};
+    CourseCount stageEdits{kStageEdits}; // Edits made by transformation stages
+    CourseCount pngBytesSaved{kPngBytesSaved};
+    double phaseSeconds[static_cast<int>(Phase::Count)] = {};
+    unsigned computeThreads = 0; // Pool sizes the run used
+    unsigned ioThreads = 0;
+};
+
+RunStats g_stats;
+std::deque<CourseStats> g_courses; // One per archive job, registered by main; deque keeps addresses stable
+
+/**
+ * @brief Returns the counters of the job reading an input, or null if none was registered.
+ *
+ * A run with a single course (one input, or several under one -course label)
+ * counts every job towards it.
+ */
+CourseStats* courseFor(const std::string& input) {
+    if (g_courses.size() == 1) return &g_courses.front();
+    for (auto& course : g_courses) {
+        if (course.input == input) return &course;
+    }
+    return nullptr;
+}
+
+// --- Live progress ---
+// Published by the workers and read by the SIGUSR1 reporter. Workers only touch
+// their own slot, so updating it never contends with the other workers.
+struct WorkerSlot {
+    std::string name;
+    std::mutex mutex;
+    std::string task; // Empty while idle
+    std::chrono::steady_clock::time_point since;
+    std::atomic<long long> busyNs{0}; // Total time spent on tasks
+};
+
+struct Progress {
+    std::atomic<int> phase{static_cast<int>(Phase::Startup)};
+    std::atomic<long long> phaseSinceNs{0};
+    std::chrono::steady_clock::time_point runStart = std::chrono::steady_clock::now();
+    std::mutex boardMutex;                              // Guards the two containers below
+    std::deque<WorkerSlot> workers;                     // deque keeps slot addresses stable
+    std::map<std::string, std::atomic<long long>> queues;
+};
+
+Progress g_progress;
+
+/**
+ * @brief Returns the progress slot for a named worker, creating it on first use.
+ */
+WorkerSlot& workerSlot(const std::string& name) {
+    std::lock_guard<std::mutex> lock(g_progress.boardMutex);
+    for (auto& slot : g_progress.workers) {
+        if (slot.name == name) return slot;
+    }
+    g_progress.workers.emplace_back();
+    g_progress.workers.back().name = name;
+    return g_progress.workers.back();
+}
+
+/**
+ * @brief Forgets every worker slot. Only call while no worker threads are running.
+ */
+void resetWorkerBoard() {
+    std::lock_guard<std::mutex> lock(g_progress.boardMutex);
+    g_progress.workers.clear();
+}
+
+/**
+ * @brief Returns the depth counter of a named queue, creating it on first use.
+ */
+std::atomic<long long>& queueDepth(const std::string& name) {
+    std::lock_guard<std::mutex> lock(g_progress.boardMutex);
+    return g_progress.queues[name];
+}
+
+/**
+ * @brief Marks a worker busy with a task for the lifetime of the object.
+ */
+class WorkerActivity {
+public:
+    WorkerActivity(WorkerSlot& slot, std::string task) : slot_(slot) {
+        std::lock_guard<std::mutex> lock(slot_.mutex);
+        slot_.task = std::move(task);
+        slot_.since = std::chrono::steady_clock::now();
+    }
+    ~WorkerActivity() {
+        std::lock_guard<std::mutex> lock(slot_.mutex);
+        auto now = std::chrono::steady_clock::now();
+        slot_.busyNs += std::chrono::duration_cast<std::chrono::nanoseconds>(now - slot_.since).count();
+        slot_.task.clear();
+        slot_.since = now;
+    }
+private:
+    WorkerSlot& slot_;
+};
+
+/**
+ * @brief Adds the wall time of a scope to one phase of the run statistics.
+ */
+class PhaseTimer {
+public:
+    explicit PhaseTimer(Phase phase) : phase_(phase), start_(std::chrono::steady_clock::now()) {
+        g_progress.phase = static_cast<int>(phase_);
+        g_progress.phaseSinceNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            start_.time_since_epoch()).count();
+    }
+    ~PhaseTimer() {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_;
+        g_stats.phaseSeconds[static_cast<int>(phase_)] += elapsed.count();
+    }
+private:
+    Phase phase_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// --- Archive reading ---
+// Entries are read straight out of the archive (memory-mapped where possible)
+// instead of being extracted to disk first.
+struct ZipEntry {
+    std::string name;
+    uint16_t versionMadeBy = 0;
+    uint16_t flags = 0;
+    uint16_t method = 0;        // 0 = stored, 8 = deflate
+    uint16_t modTime = 0;
+    uint16_t modDate = 0;
+    uint32_t crc32 = 0;
+    uint64_t compressedSize = 0;
+    uint64_t uncompressedSize = 0;
+    uint64_t localHeaderOffset = 0;
+    uint32_t externalAttributes = 0;
+};
+
+/**
+ * @brief Read-only view of a whole file, memory-mapped on POSIX systems.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::filesystem::path& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    std::string_view view() const { return std::string_view(data_, size_); }
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    std::string fallback_; // Used when the file cannot be mapped
+};
+
+/**
+ * @brief A zip archive whose central directory has been parsed.
+ *
+ * Throws std::runtime_error for archives it cannot read.
+ */
+class ZipArchive {
+public:
+    explicit ZipArchive(const std::filesystem::path& path);
+    static ZipArchive fromTail(const std::function<std::string(uint64_t offset, size_t size)>& readAt,
+                               uint64_t archiveSize);
+    const std::vector<ZipEntry>& entries() const { return entries_; }
+    std::string_view data() const { return data_; }
+    uint64_t size() const { return baseOffset_ + data_.size(); }
+    uint64_t centralDirectoryOffset() const { return centralDirectoryOffset_; }
+    std::string_view compressedData(const ZipEntry& entry) const;
+    std::string extract(const ZipEntry& entry) const;
+private:
+    ZipArchive() = default;
+    bool parseCentralDirectory(uint64_t& neededStart);
+    std::unique_ptr<MappedFile> file_;
+    std::string buffer_;        // Owns the bytes when only the tail of the archive was read
+    uint64_t baseOffset_ = 0;   // Archive offset of data_[0]
+    uint64_t centralDirectoryOffset_ = 0;
+    std::string_view data_;
+    std::vector<ZipEntry> entries_;
+};
+
+// A rewritten entry: its updated metadata and the bytes to store for it.
+struct PackedEntry {
+    ZipEntry entry;
+    std::string data;
+};
+
+// --- Rewrite settings ---
+struct StagePipeline;
+
+// Replaces [begin, end) of the scanned buffer; begin == end inserts.
+struct StageEdit {
+    size_t begin = 0;
+    size_t end = 0;
+    std::string text;
+};
+
+struct RewriteOptions {
+    std::tm startDate = {};
+    int startIndex = 0;     // Day number that maps to the start date
+    int level = 6;          // Deflate level for rewritten entries
+    unsigned threads = 1;   // Worker threads for scanning and compression
+    unsigned ioThreads = 2; // Threads for blocking file I/O (coroutine engine only)
+    std::filesystem::path partialsDir; // Shared partials for Include markers; empty leaves them alone
+    std::shared_ptr<const StagePipeline> stages; // Transformation stages run with the directive scan
+    bool recompressPng = false;        // Losslessly shrink .png entries
+    std::filesystem::path pngCacheDir; // Results of earlier PNG recompressions; empty keeps them in memory only
+};
+
+struct ArchiveJob {
+    std::filesystem::path input;   // Local path, or s3://bucket/key
+    std::filesystem::path output;  // Likewise
+};
+
+const size_t kUploadPartSize = 8 << 20; // Multipart upload part size for s3:// outputs
+
+/**
+ * @brief Writes a zip archive entry by entry to a stream.
+ *
+ * Entries can be copied in their compressed form (e.g. from a ZipArchive) or
+ * added from uncompressed content. Zip64 records are used only when needed.
+ */
+class ZipWriter {
+public:
+    explicit ZipWriter(std::ostream& out) : out_(out) {}
+    void addRaw(const ZipEntry& entry, std::string_view compressed);
+    void addStored(ZipEntry entry, std::string_view content);
+    void finish();
+    uint64_t bytesWritten() const { return offset_; }
+    static std::string localHeader(ZipEntry& entry, uint64_t offset, uint64_t compressedSize);
+    static std::string centralDirectory(const std::vector<ZipEntry>& entries, uint64_t cdOffset);
+private:
+    void write(const std::string& bytes);
+    std::ostream& out_;
+    uint64_t offset_ = 0;
+    std::vector<ZipEntry> written_;
+};
+
+// --- Content-addressed blob store ---
+// Compressed entry payloads are kept once, under the SHA-256 of their bytes,
+// and archives are described by thin manifests that reference them.
+struct ManifestEntry {
+    ZipEntry entry;
+    std::string hash;
+};
+
+/**
+ * @brief Directory of blobs laid out as <root>/<first two hex digits>/<hash>.
+ */
+class BlobStore {
+public:
+    explicit BlobStore(std::filesystem::path root) : root_(std::move(root)) {}
+    std::filesystem::path pathFor(const std::string& hash) const;
+    bool put(std::string_view data, std::string& hash) const;
+    std::unique_ptr<MappedFile> get(const std::string& hash) const;
+private:
+    std::filesystem::path root_;
+};
+
+// --- S3-compatible object storage ---
+// Requests go through the curl command-line tool (7.75 or later, for
+// --aws-sigv4), the same way the legacy path relies on unzip and zip.
+struct HttpResponse {
+    int status = 0;
+    std::string headers;  // Final header block, including the status line
+    std::string body;
+    std::string header(const std::string& name) const;
+};
+
+/**
+ * @brief An object addressed as s3://bucket/key.
+ *
+ * The endpoint comes from S3_ENDPOINT (path-style, e.g. http://localhost:9000)
+ * and the credentials from AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY and
+ * optionally AWS_SESSION_TOKEN and AWS_REGION.
+ */
+struct S3Location {
+    std::string endpoint;
+    std::string region;
+    std::string bucket;
+    std::string key;
+    std::string encodedKey() const;
+    std::string url(const std::string& query = "") const;
+    std::string display() const { return "s3://" + bucket + "/" + key; }
+};
+
+/**
+ * @brief Output stream buffer that uploads what is written as an S3 multipart upload.
+ *
+ * Full parts are handed to a few uploader threads while writing continues; the
+ * writer blocks once maxInFlight parts are waiting, so memory stays bounded at
+ * roughly (maxInFlight + 1) * partSize. complete() must be called once
+ * everything is written; an upload that is never completed is aborted.
+ */
+class S3Upload : public std::streambuf {
+public:
+    S3Upload(S3Location location, size_t partSize, unsigned maxInFlight);
+    ~S3Upload() override;
+    S3Upload(const S3Upload&) = delete;
+    S3Upload& operator=(const S3Upload&) = delete;
+    void complete();
+    void copyFrom(const S3Location& source, uint64_t offset, uint64_t size,
+                  const std::function<std::string(uint64_t offset, size_t size)>& readAt);
+    uint64_t bytesWritten() const { return bytes_; }
+protected:
+    int_type overflow(int_type ch) override;
+    std::streamsize xsputn(const char* data, std::streamsize size) override;
+private:
+    struct Part {
+        int number = 0;
+        std::string data;
+        std::string copySource;  // Set for parts copied server-side from another object
+        uint64_t copyOffset = 0;
+        uint64_t copySize = 0;
+    };
+    void queuePart(Part part);
+    void submitPart();
+    void uploadLoop();
+    void abort();
+
+    S3Location location_;
+    std::string uploadId_;
+    size_t partSize_;
+    unsigned maxInFlight_;
+    std::string current_;
+    uint64_t bytes_ = 0;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<Part> queued_;
+    std::map<int, std::string> etags_;
+    unsigned inFlight_ = 0;
+    int nextPart_ = 1;
+    bool closing_ = false;
+    bool finished_ = false;
+    std::string error_;
+    std::vector<std::thread> uploaders_;
+};
+
+// --- Directive scanning ---
+struct Directive {
+    size_t markerPos = 0;   // Offset of "DateReplace(" in the content
+    size_t textBegin = 0;   // First byte of the date text that gets replaced
+    size_t textEnd = 0;     // One past its last byte
+    std::string args;       // Everything between the parentheses
+    std::string rawFormat;  // Format as written, e.g. "_M D_"
+    std::string format;     // Trimmed format passed to formatDate()
+    bool hasDayOffset = false;
+    int dayOffset = 0;      // Day number as written in the directive
+    int width = 0;          // Optional third argument: pad the rendered date to this many characters
+    bool escaped = false;   // Markup is entity-escaped (&lt;span ...&gt;), as in Canvas XML bodies
+};
+
+// --- Schedule output ---
+// With -schedule, every rendered date that names a day is recorded with a
+// label taken from its surroundings, and written out as .ics and .json.
+struct ScheduleEntry {
+    std::string source;    // File or archive entry, as in warnings
+    size_t position = 0;   // Offset of the directive in it
+    std::string label;     // Text of the table row or heading around the date
+    std::string rendered;  // The date as it now appears
+    std::tm date = {};
+};
+
+struct Schedule {
+    bool enabled = false;  // Set once, before any rendering starts
+    std::mutex mutex;
+    std::vector<ScheduleEntry> entries;
+};
+
+Schedule g_schedule;
+
+/**
+ * @brief What recordDate() has seen of one text so far.
+ *
+ * The directives of a text are recorded in order, so the markup before each
+ * one is looked at only once, keeping -schedule linear on pages with
+ * thousands of dates.
+ */
+struct LabelScan {
+    size_t scanned = 0;                        // Markup before this offset has been looked at
+    size_t rowBegin = std::string::npos;       // Latest "<tr" before it
+    size_t lastRowEnd = std::string::npos;     // Latest "</tr" before it
+    size_t nextRowEnd = 0;                     // First "</tr" after the last directive, npos if none
+    size_t headingEnd = 0;                     // First "</h" after the latest heading, npos if none
+    std::string heading;                       // Label of the latest heading that has one
+    size_t labelledRow = std::string::npos;    // Row whose label is in rowLabel
+    std::string rowLabel;
+};
 
 // Forward declarations for helper functions
 bool parseStartDate(const std::string& dateStr, std::tm& startDate);
 std::tm addDays(std::tm baseDate, int days);
 std::string formatDate(const std::tm& date, std::string format);
-void processFile(const std::filesystem::path& filePath, const std::tm& startDate, int startIndex);
-void processDirectory(const std::filesystem::path& dirPath, const std::tm& startDate, int startIndex);
-void rezipDirectory(const std::string& sourceDir, const std::filesystem::path& archivePath);
+void processFile(const std::filesystem::path& filePath, const std::tm& startDate, int startIndex,
+                 const std::filesystem::path& partialsDir);
+bool hasTextExtension(const std::string& name);
+std::vector<Directive> findDirectives(std::string_view content, const std::string& where, unsigned threads = 1,
+                                      const StagePipeline* stages = nullptr, std::vector<StageEdit>* edits = nullptr);
+void matchStageMarkers(std::string_view content, size_t from, size_t until, const StagePipeline& pipeline,
+                       const std::string& where, std::vector<StageEdit>& edits);
+std::string applyDirectives(std::string_view content, const std::vector<Directive>& directives,
+                            const std::tm& startDate, int startIndex, const std::string& where,
+                            bool recordSchedule = true);
+void recordDate(std::string_view content, const std::vector<Directive>& directives, size_t index,
+                const std::string& rendered, const std::string& where, const std::tm& startDate, int startIndex,
+                LabelScan& labels);
+bool writeSchedule(const std::filesystem::path& basePath);
+void reportPngSavings();
+std::string renderDirective(const Directive& directive, const std::tm& startDate, int startIndex);
+std::string applyTemplate(std::string_view content, const std::string& where, const std::tm& startDate,
+                          int startIndex, const std::filesystem::path& partialsDir);
+std::string inflateRaw(const uint8_t* data, size_t size, size_t expectedSize);
+uint32_t crc32Update(uint32_t crc, const void* data, size_t size);
+size_t localHeaderSize(std::string_view fixedPart);
+std::string decompressEntry(const ZipEntry& entry, std::string_view raw);
+std::string deflateRaw(std::string_view data, int level);
+ZipEntry packEntry(ZipEntry entry, std::string_view content, int level, std::string& compressed);
+int benchDeflateCommand(int argc, char* argv[]);
+int benchScalingCommand(int argc, char* argv[]);
+int benchIoCommand(int argc, char* argv[]);
+int compareEnginesCommand(int argc, char* argv[]);
+int queueCommand(int argc, char* argv[]);
+void parallelFor(size_t count, unsigned threads, const std::string& poolName,
+                 const std::function<void(size_t index, WorkerSlot& slot)>& work);
+// What the process may actually run on, which in a container is usually far
+// less than the host's core count.
+struct CpuBudget {
+    unsigned hardware = 1;        // std::thread::hardware_concurrency()
+    unsigned affinity = 0;        // CPUs in the sched_getaffinity mask, 0 if unknown
+    double quota = 0;             // cgroup CPU quota in CPUs, 0 if unlimited
+    unsigned cpus = 1;            // The smallest of the three
+    unsigned computeThreads = 1;  // Default scan and compression workers
+    unsigned ioThreads = 2;       // Default blocking I/O workers
+};
+
+const CpuBudget& cpuBudget();
+double cgroupCpuQuota(const std::filesystem::path& procCgroup, const std::filesystem::path& cgroupRoot);
+unsigned defaultThreadCount();
+int indexCommand(int argc, char* argv[]);
+int queryCommand(int argc, char* argv[]);
+int diffCommand(int argc, char* argv[]);
+int storeCommand(int argc, char* argv[]);
+int rebuildCommand(int argc, char* argv[]);
+std::string sha256Hex(std::string_view data);
+std::vector<ManifestEntry> readManifest(const std::filesystem::path& manifestPath);
+bool writeManifest(const std::filesystem::path& manifestPath, const std::vector<ManifestEntry>& entries);
+bool rewriteManifest(const std::filesystem::path& manifestIn, const std::filesystem::path& manifestOut,
+                     const BlobStore& blobs, const RewriteOptions& options);
+std::unique_ptr<PackedEntry> rewriteEntry(const ZipEntry& entry, const std::string& content,
+                                          const std::string& where, const RewriteOptions& options);
+std::shared_ptr<const StagePipeline> loadStages(const std::vector<std::string>& specs);
+bool rewriteArchive(const ArchiveJob& job, const RewriteOptions& options);
+bool rewriteRemoteArchive(const ArchiveJob& job, const RewriteOptions& options);
+bool rewriteArchives(const std::vector<ArchiveJob>& jobs, const RewriteOptions& options);
+void processDirectory(const std::filesystem::path& dirPath, const std::tm& startDate, int startIndex,
+                      const std::filesystem::path& partialsDir);
+bool rezipDirectory(const std::string& sourceDir, const std::filesystem::path& archivePath);
+bool isS3Path(const std::string& path);
+bool isCanvasPath(const std::string& path);
+bool rewriteCanvasExport(const ArchiveJob& job, const RewriteOptions& options);
+std::filesystem::path defaultOutputPath(const std::string& input);
+std::string renderDate(const std::tm& startDate, const std::string& format, int dayOffset);
+const char* phaseName(Phase phase);
+bool writeMetricsFile(const std::filesystem::path& metricsPath, const std::deque<CourseStats>& courses, bool success);
+std::string progressSnapshot();
+HttpResponse runCurl(const std::vector<std::string>& args, std::string_view body, const std::string& config);
+void streamCurl(const std::vector<std::string>& args, const std::string& config,
+                const std::function<void(std::string_view)>& sink);
+S3Location parseS3Path(const std::string& path);
+HttpResponse s3Request(const S3Location& location, const std::string& method, const std::string& query,
+                       std::string_view body, const std::vector<std::string>& extraArgs = {});
+void startSnapshotReporter();
+void stopSnapshotReporter();
+
+// Runs the SIGUSR1 reporter for as long as it is in scope.
+struct SnapshotReporterScope {
+    SnapshotReporterScope() { startSnapshotReporter(); }
+    ~SnapshotReporterScope() { stopSnapshotReporter(); }
+    SnapshotReporterScope(const SnapshotReporterScope&) = delete;
+    SnapshotReporterScope& operator=(const SnapshotReporterScope&) = delete;
+};
 
 /**
  * @brief Main entry point of the program.
@@ -25,10 +609,42 @@ void rezipDirectory(const std::string& sourceDir, const std::filesystem::path& a
  * @return 0 on success, 1 on error.
  */
 int main(int argc, char* argv[]) {
+    // Reporter prints a progress snapshot to stderr on SIGUSR1, for subcommands
+    // too. It starts before any other thread so all of them inherit the blocked
+    // signal; the scope stops it on every return path, finish() earlier.
+    SnapshotReporterScope reporter;
+
+    // --- 0. Subcommands ---
+    if (argc > 1) {
+        std::string command = argv[1];
+        if (command == "index") return indexCommand(argc - 2, argv + 2);
+        if (command == "query") return queryCommand(argc - 2, argv + 2);
+        if (command == "diff") return diffCommand(argc - 2, argv + 2);
+        if (command == "store") return storeCommand(argc - 2, argv + 2);
+        if (command == "rebuild") return rebuildCommand(argc - 2, argv + 2);
+        if (command == "bench-deflate") return benchDeflateCommand(argc - 2, argv + 2);
+        if (command == "bench-scaling") return benchScalingCommand(argc - 2, argv + 2);
+        if (command == "bench-io") return benchIoCommand(argc - 2, argv + 2);
+        if (command == "compare-engines") return compareEnginesCommand(argc - 2, argv + 2);
+        if (command == "queue") return queueCommand(argc - 2, argv + 2);
+    }
+
     // --- 1. Argument Parsing ---
     std::string startDateStr;
-    std::string archivePathStr;
+    std::vector<std::string> archivePathStrs;
     std::string outputArchivePathStr;
+    std::string metricsPathStr;
+    std::string courseLabel;
+    std::string blobDirStr;
+    std::string partialsDirStr;
+    std::string schedulePathStr;
+    std::vector<std::string> stageSpecs;
+    bool recompressPng = false;
+    std::string pngCacheDirStr;
+    bool useLegacyTools = false;
+    unsigned threads = defaultThreadCount();
+    unsigned ioThreads = cpuBudget().ioThreads;
+    int compressionLevel = 6;
     int startIndex = 0; // Default to 0-indexed
 
     // A more flexible argument parsing loop
@@ -38,6 +654,51 @@ int main(int argc, char* argv[]) {
             startDateStr = argv[++i]; // Consume next argument
         } else if (arg == "-o" && i + 1 < argc) {
             outputArchivePathStr = argv[++i]; // Consume next argument
+        } else if (arg == "-metrics" && i + 1 < argc) {
+            metricsPathStr = argv[++i]; // OpenMetrics textfile written at the end of the run
+        } else if (arg == "-blobs" && i + 1 < argc) {
+            blobDirStr = argv[++i]; // Input and output are manifests over this blob store
+        } else if (arg == "-partials" && i + 1 < argc) {
+            partialsDirStr = argv[++i]; // Directory of shared partials for Include markers
+        } else if (arg == "-schedule" && i + 1 < argc) {
+            schedulePathStr = argv[++i]; // Base path of the .ics and .json schedule of rendered dates
+        } else if (arg == "-stage" && i + 1 < argc) {
+            stageSpecs.push_back(argv[++i]); // Built-in stage name or shared object, may repeat
+        } else if (arg == "-png") {
+            recompressPng = true; // Losslessly recompress .png entries
+        } else if (arg == "-png-cache" && i + 1 < argc) {
+            pngCacheDirStr = argv[++i]; // Keep PNG results across runs
+            recompressPng = true;
+        } else if (arg == "-links" && i + 1 < argc) {
+            stageSpecs.push_back(std::string("links=") + argv[++i]); // Old to new course, file and assignment IDs
+        } else if (arg == "-legacy") {
+            useLegacyTools = true; // Extract and re-zip with the external unzip/zip tools
+        } else if (arg == "-j" && i + 1 < argc) {
+            try {
+                threads = static_cast<unsigned>(std::max(1, std::stoi(argv[++i])));
+            } catch (const std::exception& e) {
+                std::cerr << "Error: Invalid number for -j argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "-io" && i + 1 < argc) {
+            try {
+                ioThreads = static_cast<unsigned>(std::max(1, std::stoi(argv[++i]))); // Blocking file I/O threads
+            } catch (const std::exception& e) {
+                std::cerr << "Error: Invalid number for -io argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "-level" && i + 1 < argc) {
+            try {
+                compressionLevel = std::stoi(argv[++i]); // Deflate level for rewritten entries, 0-9
+            } catch (const std::exception& e) {
+                compressionLevel = -1;
+            }
+            if (compressionLevel < 0 || compressionLevel > 9) {
+                std::cerr << "Error: -level must be a number from 0 (store) to 9 (best)." << std::endl;
+                return 1;
+            }
+        } else if (arg == "-course" && i + 1 < argc) {
+            courseLabel = argv[++i]; // One metrics label for the run; defaults to each archive's name
         } else if (arg == "-i" && i + 1 < argc) {
             try {
                 startIndex = std::stoi(argv[++i]); // Consume and parse index
@@ -46,35 +707,165 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
         } else {
-            // Assume any other argument is the input file
-            archivePathStr = arg;
+            // Assume any other argument is an input file
+            archivePathStrs.push_back(arg);
         }
     }
 
-    if (startDateStr.empty() || archivePathStr.empty()) {
-        std::cerr << "Usage: " << argv[0] << " -start MM/DD/YYYY <input_archive.imscc> [-o <output_archive.imscc>] [-i <start_index>]" << std::endl;
+    bool singleInputOnly = useLegacyTools || !blobDirStr.empty() || !outputArchivePathStr.empty();
+    if (startDateStr.empty() || archivePathStrs.empty() || (singleInputOnly && archivePathStrs.size() > 1)) {
+        std::cerr << "Usage: " << argv[0] << " -start MM/DD/YYYY <input_archive.imscc>... [-o <output_archive.imscc>] [-i <start_index>]"
+                  << " [-j <threads>] [-io <threads>] [-level <0-9>] [-partials <dir>] [-legacy] [-metrics <file.prom>]"
+                  << " [-course <label>] [-schedule <file>] [-links <mapping>] [-stage <name|lib.so>]... [-png] [-png-cache <dir>]\n"
+                  << "       (several input archives are rewritten concurrently; -o and -legacy take a single one)\n"
+                  << "       (inputs and -o may be s3://bucket/key; set S3_ENDPOINT, AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY)\n"
+                  << "       (an input may be canvas://<course id> to export the course first; set CANVAS_URL and CANVAS_TOKEN)\n"
+                  << "       " << argv[0] << " -start MM/DD/YYYY -blobs <dir> <input.manifest> [-o <output.manifest>] [-i <start_index>]\n"
+                  << "       " << argv[0] << " index -o <catalog> [-j <threads>] <archive.imscc|directory>...\n"
+                  << "       " << argv[0] << " query <catalog> [-offset N] [-format F] [-archive S] [-entry S] [-text S]"
+                  << " [-archives] [-count]\n"
+                  << "       " << argv[0] << " diff <old.imscc> <new.imscc>\n"
+                  << "       " << argv[0] << " store -blobs <dir> [-o <manifest>] <archive.imscc>...\n"
+                  << "       " << argv[0] << " rebuild -blobs <dir> <manifest> -o <archive.imscc>\n"
+                  << "       " << argv[0] << " bench-deflate [-level <0-9>] [-iterations N] <archive.imscc|file>...\n"
+                  << "       " << argv[0] << " bench-scaling [-threads 1,2,4] [-profile pages|xml|media]... [-mb N]"
+                  << " [-iterations N] [archive.imscc...]\n"
+                  << "       " << argv[0] << " bench-io [-j <threads>] [-iterations N] <archive.imscc>...\n"
+                  << "       " << argv[0] << " compare-engines [-start MM/DD/YYYY] [-i <start_index>] [-j <threads>]"
+                  << " [-templates <dir>] [-copies N] [-iterations N] [archive.imscc...]\n"
+                  << "       " << argv[0] << " queue init <queue-dir> -start MM/DD/YYYY [-i <start_index>] [-level <0-9>]"
+                  << " [-partials <dir>] <jobs.txt>\n"
+                  << "       " << argv[0] << " queue work <queue-dir> [-j <threads>] [-lease <seconds>] [-worker <name>]\n"
+                  << "       " << argv[0] << " queue status <queue-dir> [-wait] [-lease <seconds>]" << std::endl;
         return 1;
     }
 
-    // --- 1a. Generate default output path if not provided ---
-    if (outputArchivePathStr.empty()) {
-        std::filesystem::path inputPath(archivePathStr);
-        std::string newFilename = inputPath.stem().string() + "_updated" + inputPath.extension().string();
-        outputArchivePathStr = inputPath.replace_filename(newFilename).string();
+    // --- 1a. Generate default output paths if not provided ---
+    std::vector<ArchiveJob> jobs;
+    for (const auto& input : archivePathStrs) {
+        jobs.push_back(ArchiveJob{input, outputArchivePathStr.empty() ? defaultOutputPath(input)
+                                                                       : std::filesystem::path(outputArchivePathStr)});
     }
+    outputArchivePathStr = jobs[0].output.string();
 
-
-    std::filesystem::path archivePath(archivePathStr);
+    std::filesystem::path archivePath(archivePathStrs[0]);
     std::tm startDate = {};
+    // Each archive is its own course in the metrics unless -course names the whole run.
+    if (!courseLabel.empty() || jobs.size() == 1) {
+        g_courses.emplace_back();
+        g_courses.back().label = courseLabel.empty() ? archivePath.stem().string() : courseLabel;
+    } else {
+        std::map<std::string, int> seen;
+        for (const auto& job : jobs) {
+            std::string stem = job.input.stem().string();
+            int n = ++seen[stem];
+            g_courses.emplace_back();
+            g_courses.back().input = job.input.string();
+            g_courses.back().label = n == 1 ? stem : stem + "-" + std::to_string(n); // Same stem in two folders
+        }
+    }
+    CourseScope mainCourse(g_courses.size() == 1 ? &g_courses.front() : nullptr); // Single-course paths count here
+
+    // Writes the metrics file (when requested) and passes the exit code through.
+    auto finish = [&](int exitCode) {
+        g_progress.phase = static_cast<int>(Phase::Done);
+        stopSnapshotReporter();
+        if (exitCode == 0) reportPngSavings();
+        if (exitCode == 0 && !schedulePathStr.empty()) {
+            if (writeSchedule(schedulePathStr)) {
+                std::cout << "Wrote " << g_schedule.entries.size() << " dates to the schedule at '"
+                          << schedulePathStr << "'" << std::endl;
+            } else {
+                std::cerr << "Error: Could not write the schedule to '" << schedulePathStr << "'." << std::endl;
+                exitCode = 1;
+            }
+        }
+        if (!metricsPathStr.empty() && !writeMetricsFile(metricsPathStr, g_courses, exitCode == 0)) {
+            std::cerr << "Warning: Could not write metrics file '" << metricsPathStr << "'." << std::endl;
+        }
+        return exitCode;
+    };
 
     if (!parseStartDate(startDateStr, startDate)) {
         std::cerr << "Error: Invalid start date format. Please use MM/DD/YYYY." << std::endl;
         return 1;
     }
 
-    if (!std::filesystem::exists(archivePath)) {
-        std::cerr << "Error: Archive file not found at '" << archivePath << "'" << std::endl;
-        return 1;
+    for (const auto& job : jobs) {
+        bool remote = isS3Path(job.input.string()) || isCanvasPath(job.input.string());
+        if (!remote && !std::filesystem::exists(job.input)) {
+            std::cerr << "Error: Archive file not found at '" << job.input << "'" << std::endl;
+            return 1;
+        }
+        if (remote && (useLegacyTools || !blobDirStr.empty())) {
+            std::cerr << "Error: s3:// and canvas:// inputs are only read by the in-process rewrite." << std::endl;
+            return 1;
+        }
+    }
+
+    g_schedule.enabled = !schedulePathStr.empty();
+
+    RewriteOptions options;
+    options.startDate = startDate;
+    options.startIndex = startIndex;
+    options.level = compressionLevel;
+    options.threads = threads;
+    options.ioThreads = ioThreads;
+    if (!partialsDirStr.empty()) {
+        if (!std::filesystem::is_directory(partialsDirStr)) {
+            std::cerr << "Error: Partials directory not found at '" << partialsDirStr << "'" << std::endl;
+            return 1;
+        }
+        options.partialsDir = std::filesystem::absolute(partialsDirStr);
+    }
+    if (!stageSpecs.empty()) {
+        if (useLegacyTools) {
+            std::cerr << "Error: -stage is only applied by the in-process rewrite." << std::endl;
+            return 1;
+        }
+        options.stages = loadStages(stageSpecs);
+        if (!options.stages) return 1;
+    }
+    if (recompressPng) {
+        if (useLegacyTools) {
+            std::cerr << "Error: -png is only applied by the in-process rewrite." << std::endl;
+            return 1;
+        }
+        options.recompressPng = true;
+        options.pngCacheDir = pngCacheDirStr;
+    }
+
+    WorkerSlot& mainSlot = workerSlot("main");
+
+    // --- 1b. Manifest mode: only text blobs are read, unchanged entries stay shared ---
+    if (!blobDirStr.empty()) {
+        std::cout << "Rewriting manifest against blob store '" << blobDirStr << "'..." << std::endl;
+        WorkerActivity activity(mainSlot, "rewrite " + archivePath.string());
+        bool rewritten;
+        {
+            PhaseTimer timer(Phase::Process);
+            rewritten = rewriteManifest(archivePath, outputArchivePathStr, BlobStore(blobDirStr), options);
+        }
+        if (!rewritten) {
+            return finish(1);
+        }
+        g_stats.archivesProcessed++;
+        std::cout << "Successfully created new manifest at '" << outputArchivePathStr << "'" << std::endl;
+        return finish(0);
+    }
+
+    // --- 1c. In-process rewrite; -legacy falls through to the unzip/zip tools below ---
+    if (!useLegacyTools) {
+        const CpuBudget& budget = cpuBudget();
+        std::ostringstream quota;
+        quota << budget.quota;
+        std::cout << "Rewriting " << (jobs.size() == 1 ? "archive" : std::to_string(jobs.size()) + " archives")
+                  << " in-process with " << threads << " compute and " << ioThreads << " I/O threads ("
+                  << budget.cpus << " usable CPUs: " << budget.hardware << " online, "
+                  << (budget.affinity ? std::to_string(budget.affinity) : "unknown") << " in affinity mask, "
+                  << (budget.quota > 0 ? "cgroup quota " + quota.str() : "no cgroup quota")
+                  << ")..." << std::endl;
+        return finish(rewriteArchives(jobs, options) ? 0 : 1);
     }
 
     // --- 2. Unzip the Archive ---
@@ -83,30 +874,65 @@ int main(int argc, char* argv[]) {
     std::string command = "unzip -o \"" + archivePath.string() + "\" -d \"" + outputDir + "\"";
 
     std::cout << "Unzipping archive..." << std::endl;
-    int result = std::system(command.c_str());
+    g_stats.bytesIn += std::filesystem::file_size(archivePath);
+    int result;
+    {
+        PhaseTimer timer(Phase::Unzip);
+        WorkerActivity activity(mainSlot, "unzip " + archivePath.string());
+        result = std::system(command.c_str());
+    }
 
     if (result != 0) {
         std::cerr << "Error: Failed to unzip the archive. Make sure the 'unzip' command is installed and in your system's PATH." << std::endl;
-        return 1;
+        return finish(1);
     }
     std::cout << "Archive successfully unzipped to '" << outputDir << "' directory." << std::endl;
 
     // --- 3. Process Files ---
     std::cout << "Processing files for date replacement..." << std::endl;
     try {
-        processDirectory(outputDir, startDate, startIndex);
+        PhaseTimer timer(Phase::Process);
+        processDirectory(outputDir, startDate, startIndex, options.partialsDir);
     } catch (const std::exception& e) {
         std::cerr << "An error occurred during file processing: " << e.what() << std::endl;
-        return 1;
+        return finish(1);
     }
 
     std::cout << "Date replacement complete." << std::endl;
 
     // --- 4. Re-zip the directory ---
     std::cout << "Re-zipping the archive..." << std::endl;
-    rezipDirectory(outputDir, outputArchivePathStr);
+    bool zipped;
+    {
+        PhaseTimer timer(Phase::Rezip);
+        WorkerActivity activity(mainSlot, "zip " + outputArchivePathStr);
+        zipped = rezipDirectory(outputDir, outputArchivePathStr);
+    }
+    if (!zipped) {
+        return finish(1);
+    }
+    g_stats.archivesProcessed++;
+    if (!isS3Path(outputArchivePathStr)) {
+        g_stats.bytesOut += std::filesystem::file_size(outputArchivePathStr); // Uploads count their own bytes
+    }
 
-    return 0;
+    return finish(0);
+}
+
+/**
+ * @brief Names the output of an input given without -o: <name>_updated<ext> next to it.
+ * @param input A local path, s3://bucket/key or canvas://<course id>.
+ * @return The output path; course_<id>_updated.imscc in the current directory for Canvas courses.
+ */
+std::filesystem::path defaultOutputPath(const std::string& input) {
+    if (isCanvasPath(input)) {
+        std::string id = input.substr(std::strlen("canvas://"));
+        std::replace(id.begin(), id.end(), ':', '_');
+        return "course_" + id + "_updated.imscc";
+    }
+    std::filesystem::path inputPath(input);
+    std::string newFilename = inputPath.stem().string() + "_updated" + inputPath.extension().string();
+    return inputPath.replace_filename(newFilename);
 }
 
 /**
@@ -188,160 +1014,7312 @@ std::string formatDate(const std::tm& date, std::string format) {
 
 
 /**
- * @brief Scans and processes a single file for DateReplace directives.
- * @param filePath The path to the file to process.
+ * @brief Renders a date directive, reusing this thread's earlier results for the same date, format and offset.
  * @param startDate The school year's start date.
- * @param startIndex The starting index for day numbers (e.g., 0 or 1).
+ * @param format The directive's format string.
+ * @param dayOffset Days after the start date (already adjusted by the start index).
+ * @return The formatted date string.
+ */
+std::string renderDate(const std::tm& startDate, const std::string& format, int dayOffset) {
+    // Each worker keeps its own memo, so rendering never contends on a lock. The start date is
+    // part of the key because one process may rewrite for more than one start date.
+    static thread_local std::unordered_map<std::string, std::string> cache;
+    std::string key = std::to_string(startDate.tm_year) + '-' + std::to_string(startDate.tm_mon) + '-' +
+                      std::to_string(startDate.tm_mday) + '|' + std::to_string(dayOffset) + '|' + format;
+
+    auto it = cache.find(key);
+    if (it != cache.end()) {
+        g_stats.renderCacheHits++;
+        return it->second;
+    }
+    g_stats.renderCacheMisses++;
+    std::string rendered = formatDate(addDays(startDate, dayOffset), format);
+    cache.emplace(std::move(key), rendered);
+    return rendered;
+}
+
+/**
+ * @brief Checks whether a file or entry name has one of the text extensions we rewrite.
+ * @param name The file path or archive entry name.
+ * @return True for .html, .htm, .xml and .txt names.
  */
-void processFile(const std::filesystem::path& filePath, const std::tm& startDate, int startIndex) {
+bool hasTextExtension(const std::string& name) {
     // Only process certain file types to avoid corrupting binary files
     const std::vector<std::string> validExtensions = {".html", ".htm", ".xml", ".txt"};
-    std::string extension = filePath.extension().string();
-    bool isValid = false;
-    for(const auto& ext : validExtensions){
-        if(extension == ext){
-            isValid = true;
-            break;
+    std::string extension = std::filesystem::path(name).extension().string();
+    for (const auto& ext : validExtensions) {
+        if (extension == ext) {
+            return true;
         }
     }
-    if(!isValid) return;
-
+    return false;
+}
 
-    std::ifstream fileIn(filePath);
-    if (!fileIn) {
-        std::cerr << "Warning: Could not open file " << filePath << ". Skipping." << std::endl;
-        return;
-    }
+namespace {
 
-    std::stringstream buffer;
-    buffer << fileIn.rdbuf();
-    std::string content = buffer.str();
-    fileIn.close();
+const std::string_view kDirectiveMarker = "DateReplace(";
+const size_t kTagWindow = 1024; // How far back from a marker the opening of its tag is looked for
+const int kMaxDirectiveWidth = 64; // Widths pad a date to line up columns; more is a typo
+const size_t kParallelScanMin = 4 << 20;   // Smaller buffers are scanned on the calling thread
+const size_t kParallelScanChunk = 1 << 20; // Smallest stretch of markers handed to one worker
+std::atomic<unsigned> g_parallelScans{0};  // Large buffers being scanned right now
 
-    bool modified = false;
-    size_t searchPos = 0;
-    const std::string startMarker = "DateReplace("; // FIX: Define the search marker
+/**
+ * @brief Scans the markers that start in [from, until) for directives.
+ *
+ * A directive's arguments and date text may run past `until`; only where
+ * its marker starts matters.
+ *
+ * Canvas keeps many page bodies inside XML as entity-escaped HTML, e.g.
+ * &lt;span class=&quot;DateReplace(_M D_, 5)&quot;&gt;Aug 26&lt;/span&gt;.
+ * When the tag holding a directive was opened with "&lt;" rather than "<",
+ * its date text is delimited by "&gt;" and "&lt;" instead. CDATA sections
+ * hold literal markup and need nothing special.
+ * @param content The whole buffer.
+ * @param where Name of the file or entry, used in warnings.
+ * @param from Where to start looking for markers.
+ * @param until Markers at or after this offset are left alone.
+ * @param directives Receives the directives found, in order.
+ * @param maxMarkers Stop after looking at this many markers.
+ * @param stages If set, every stage marker starting in [from, until) is handed to its
+ *        stage as the scan passes it, including those inside directives.
+ * @param edits Receives the stages' edits.
+ * @return The offset the scan would continue from.
+ */
+size_t scanDirectives(std::string_view content, const std::string& where, size_t from, size_t until,
+                      std::vector<Directive>& directives, size_t maxMarkers = SIZE_MAX,
+                      const StagePipeline* stages = nullptr, std::vector<StageEdit>* edits = nullptr) {
+    size_t searchPos = from;
+    size_t stagesUpTo = from; // Stage markers before this offset have been dispatched
+    const std::string_view startMarker = kDirectiveMarker;
+    auto dispatchStages = [&](size_t limit) {
+        limit = std::min(limit, until);
+        if (stages && limit > stagesUpTo) matchStageMarkers(content, stagesUpTo, limit, *stages, where, *edits);
+        stagesUpTo = std::max(stagesUpTo, limit);
+    };
 
-    while ((searchPos = content.find(startMarker, searchPos)) != std::string::npos) {
-        modified = true;
+    for (size_t markers = 0; markers < maxMarkers; ++markers) {
+        searchPos = content.find(startMarker, searchPos);
+        dispatchStages(searchPos == std::string_view::npos ? content.size() : searchPos);
+        if (searchPos == std::string_view::npos) return content.size();
+        if (searchPos >= until) return searchPos;
+        Directive directive;
+        directive.markerPos = searchPos;
         size_t openParenPos = searchPos + startMarker.length();
-        size_t closeParenPos = content.find(")", openParenPos);
-        if (closeParenPos == std::string::npos) continue; // Malformed, skip
-
-        // --- FIX: Define the boundaries for the text to be replaced ---
-        // It's located between the `>` after the directive and the very next `<`.
-        size_t replaceStartPos = content.find(">", closeParenPos);
-        if (replaceStartPos == std::string::npos) continue; // Malformed HTML, skip.
-        replaceStartPos += 1; // The replacement starts *after* the '>'.
-
-        size_t replaceEndPos = content.find("<", replaceStartPos);
-        if (replaceEndPos == std::string::npos) continue; // Malformed HTML, skip.
-
-        // --- 2. Parse the arguments from inside the parentheses ---
-        std::string argsStr = content.substr(openParenPos, closeParenPos - openParenPos);
-        size_t commaPos = argsStr.rfind(',');
-
-        std::string formatStr;
-        int dayOffset = 0;
-
-        if (commaPos == std::string::npos) {
-            // Case 1: No comma found. Treat the whole string as the format.
-            // Default to the startIndex, which will result in a final offset of 0 days.
-            formatStr = argsStr;
-            dayOffset = startIndex;
+        searchPos += 1; // Malformed directives are skipped from here
+
+        size_t closeParenPos = content.find(')', openParenPos);
+        if (closeParenPos == std::string_view::npos) continue; // Malformed, skip
+
+        // Whichever tag opener is nearer before the marker tells plain
+        // markup from escaped markup. Only a fixed window is searched, so
+        // the cost per directive does not grow with the buffer, and a chunk
+        // of a parallel scan sees the same bytes as the serial scan.
+        size_t windowBegin = directive.markerPos > kTagWindow ? directive.markerPos - kTagWindow : 0;
+        std::string_view window = content.substr(windowBegin, directive.markerPos - windowBegin);
+        size_t tagPos = window.rfind('<');
+        size_t escapedTagPos = window.rfind("&lt;");
+        directive.escaped = escapedTagPos != std::string_view::npos &&
+                            (tagPos == std::string_view::npos || escapedTagPos > tagPos);
+        const std::string_view tagEnd = directive.escaped ? "&gt;" : ">";
+        const std::string_view tagStart = directive.escaped ? "&lt;" : "<";
+
+        // The text to be replaced is located between the `>` after the
+        // directive and the very next `<`.
+        size_t replaceStartPos = content.find(tagEnd, closeParenPos);
+        if (replaceStartPos == std::string_view::npos) continue; // Malformed HTML, skip.
+        replaceStartPos += tagEnd.size(); // The replacement starts *after* the '>'.
+
+        size_t replaceEndPos = content.find(tagStart, replaceStartPos);
+        if (replaceEndPos == std::string_view::npos) continue; // Malformed HTML, skip.
+
+        // --- Parse the arguments from inside the parentheses ---
+        directive.args = std::string(content.substr(openParenPos, closeParenPos - openParenPos));
+        size_t commaPos = directive.args.rfind(',');
+
+        // "Format, day, width": a width is only recognised when the two last
+        // arguments are both plain numbers, so formats like "M D, Y" keep working.
+        auto isNumber = [](std::string text) {
+            text.erase(0, text.find_first_not_of(" \t\n\r"));
+            text.erase(text.find_last_not_of(" \t\n\r") + 1);
+            if (!text.empty() && text[0] == '-') text.erase(0, 1);
+            return !text.empty() && text.size() < 10 && text.find_first_not_of("0123456789") == std::string::npos;
+        };
+        size_t dayCommaPos = commaPos == std::string::npos || commaPos == 0 ? std::string::npos
+                                                                            : directive.args.rfind(',', commaPos - 1);
+        if (dayCommaPos != std::string::npos && isNumber(directive.args.substr(commaPos + 1)) &&
+            isNumber(directive.args.substr(dayCommaPos + 1, commaPos - dayCommaPos - 1))) {
+            directive.width = std::max(0, std::stoi(directive.args.substr(commaPos + 1)));
+            if (directive.width > kMaxDirectiveWidth) {
+                std::cerr << "Warning: Width " << directive.width << " in \"" << where << "\" is larger than "
+                          << kMaxDirectiveWidth << ". Skipping this instance." << std::endl;
+                searchPos = closeParenPos;
+                continue;
+            }
+            commaPos = dayCommaPos;
+            directive.dayOffset = std::stoi(directive.args.substr(commaPos + 1));
+            directive.hasDayOffset = true;
+            directive.rawFormat = directive.args.substr(0, commaPos);
+        } else if (commaPos == std::string::npos) {
+            // No comma found. Treat the whole string as the format.
+            directive.rawFormat = directive.args;
         } else {
-            // Case 2: Comma found. Parse as usual.
-            formatStr = argsStr.substr(0, commaPos);
-            std::string dayOffsetStr = argsStr.substr(commaPos + 1);
-
-            // --- DEBUGGING OUTPUT ---
-            std::cout << "[DEBUG] In file: " << filePath.filename().string() << "\n"
-                      << "        Full directive args: \"" << argsStr << "\"\n"
-                      << "        Attempting to parse day number from: \"" << dayOffsetStr << "\"" << std::endl;
-            // --- END DEBUGGING OUTPUT ---
-            
+            directive.rawFormat = directive.args.substr(0, commaPos);
             try {
-                dayOffset = std::stoi(dayOffsetStr);
+                directive.dayOffset = std::stoi(directive.args.substr(commaPos + 1));
+                directive.hasDayOffset = true;
             } catch (const std::exception& e) {
-                std::cerr << "Warning: Invalid day number in \"" << filePath.string() << "\". Skipping this instance." << std::endl;
+                std::cerr << "Warning: Invalid day number in \"" << where << "\". Skipping this instance." << std::endl;
                 searchPos = closeParenPos; // Advance search position to avoid infinite loop
                 continue;
             }
         }
 
         // Trim quotes, underscores, parentheses, and whitespace
-        formatStr.erase(0, formatStr.find_first_not_of(" \t\n\r\"_()"));
-        formatStr.erase(formatStr.find_last_not_of(" \t\n\r\"_()") + 1);
+        directive.format = directive.rawFormat;
+        if (directive.escaped) {
+            // The format is written escaped too; decode it, &amp; last so "&amp;lt;" stays "&lt;".
+            static const std::pair<std::string_view, std::string_view> entities[] = {
+                {"&quot;", "\""}, {"&#39;", "'"}, {"&lt;", "<"}, {"&gt;", ">"}, {"&amp;", "&"}};
+            for (const auto& [entity, text] : entities) {
+                for (size_t at = 0; (at = directive.format.find(entity, at)) != std::string::npos; at += text.size()) {
+                    directive.format.replace(at, entity.size(), text);
+                }
+            }
+        }
+        directive.format.erase(0, directive.format.find_first_not_of(" \t\n\r\"_()"));
+        directive.format.erase(directive.format.find_last_not_of(" \t\n\r\"_()") + 1);
 
-        // --- 3. Calculate and format the new date ---
-        // The day number from the file is adjusted by the start index to get the final offset.
-        int finalDayOffset = dayOffset - startIndex;
+        directive.textBegin = replaceStartPos;
+        directive.textEnd = replaceEndPos;
+        searchPos = replaceEndPos; // Continue after the replaced section
+        directives.push_back(std::move(directive));
+    }
+    dispatchStages(searchPos);
+    return searchPos;
+}
 
-        std::tm targetDate = addDays(startDate, finalDayOffset);
-        std::string newDateStr = formatDate(targetDate, formatStr);
+} // namespace
 
-        // --- 4. Replace the content ---
-        content.replace(replaceStartPos, replaceEndPos - replaceStartPos, newDateStr);
+/**
+ * @brief Finds every well-formed DateReplace directive in a buffer.
+ *
+ * Buffers of several megabytes are split into chunks that are scanned
+ * concurrently, each for the markers that start inside it. Where the
+ * serial scan would resume past the start of a chunk, because a directive
+ * straddles the split, the merge rescans serially from that point until it
+ * reaches a directive the chunk also found; from there on both agree.
+ * Stage markers do not depend on where the directives are, so each chunk
+ * hands its own markers to the stages and the edits are simply joined.
+ * @param content The text to scan.
+ * @param where Name of the file or entry, used in warnings.
+ * @param threads Workers to use for large buffers.
+ * @param stages Stages to run in the same pass, or null.
+ * @param edits Receives the stages' edits, in buffer order.
+ * @return The directives in the order they appear.
+ */
+std::vector<Directive> findDirectives(std::string_view content, const std::string& where, unsigned threads,
+                                      const StagePipeline* stages, std::vector<StageEdit>* edits) {
+    std::vector<Directive> directives;
+    // Buffers scanned together share the workers rather than each taking all of them.
+    unsigned active = ++g_parallelScans;
+    threads = std::max(1u, threads / active);
+    size_t chunks = std::min<size_t>(content.size() / kParallelScanChunk, static_cast<size_t>(threads) * 4);
+    if (content.size() < kParallelScanMin || threads < 2 || chunks < 2) {
+        g_parallelScans--;
+        scanDirectives(content, where, 0, content.size(), directives, SIZE_MAX, stages, edits);
+        return directives;
+    }
 
-        // --- 5. Update search position to continue after the modified section ---
-        searchPos = replaceStartPos + newDateStr.length();
+    struct Chunk {
+        size_t begin = 0, end = 0;
+        std::vector<Directive> directives;
+        std::vector<StageEdit> edits;
+        size_t resume = 0; // Where the scan stopped
+    };
+    std::vector<Chunk> parts(chunks);
+    for (size_t i = 0; i < chunks; ++i) {
+        parts[i].begin = content.size() * i / chunks;
+        parts[i].end = content.size() * (i + 1) / chunks;
     }
+    try {
+        parallelFor(chunks, threads, "scan", [&](size_t i, WorkerSlot& slot) {
+            WorkerActivity activity(slot, where);
+            parts[i].resume = scanDirectives(content, where, parts[i].begin, parts[i].end, parts[i].directives,
+                                             SIZE_MAX, stages, &parts[i].edits);
+        });
+    } catch (...) {
+        g_parallelScans--;
+        throw;
+    }
+    g_parallelScans--;
 
-    if (modified) {
-        std::ofstream fileOut(filePath, std::ios::trunc);
-        if (!fileOut) {
-            std::cerr << "Warning: Could not write to file " << filePath << ". Skipping." << std::endl;
-            return;
+    size_t resume = 0;
+    for (auto& part : parts) {
+        if (stages) {
+            edits->insert(edits->end(), std::make_move_iterator(part.edits.begin()),
+                          std::make_move_iterator(part.edits.end()));
+        }
+        // Step serially until the next marker is one the chunk's own scan also reached.
+        while (resume > part.begin) {
+            size_t next = content.find(kDirectiveMarker, resume);
+            if (next == std::string_view::npos || next >= part.end) break;
+            auto match = std::lower_bound(part.directives.begin(), part.directives.end(), next,
+                                          [](const Directive& d, size_t pos) { return d.markerPos < pos; });
+            if (match != part.directives.end() && match->markerPos == next) {
+                part.directives.erase(part.directives.begin(), match);
+                resume = part.begin;
+                break;
+            }
+            resume = scanDirectives(content, where, resume, part.end, directives, 1);
+        }
+        if (resume <= part.begin) {
+            directives.insert(directives.end(), std::make_move_iterator(part.directives.begin()),
+                              std::make_move_iterator(part.directives.end()));
+            resume = part.resume;
         }
-        fileOut << content;
-        fileOut.close();
     }
+    return directives;
 }
 
 /**
- * @brief Recursively iterates through a directory and processes each file.
- * @param dirPath The directory to process.
+ * @brief Renders one directive, padded with trailing spaces to its width if it has one.
+ * @param directive A directive found by findDirectives().
  * @param startDate The school year's start date.
- * @param startIndex The starting index for day numbers.
+ * @param startIndex The starting index for day numbers (e.g., 0 or 1).
+ * @return The text that replaces the directive's date.
  */
-void processDirectory(const std::filesystem::path& dirPath, const std::tm& startDate, int startIndex) {
-    for (const auto& entry : std::filesystem::recursive_directory_iterator(dirPath)) {
-        if (entry.is_regular_file()) {
-            processFile(entry.path(), startDate, startIndex);
+std::string renderDirective(const Directive& directive, const std::tm& startDate, int startIndex) {
+    // The day number from the file is adjusted by the start index to get the final offset.
+    // Directives without a day number refer to the start date itself.
+    int finalDayOffset = directive.hasDayOffset ? directive.dayOffset - startIndex : 0;
+    std::string rendered = renderDate(startDate, directive.format, finalDayOffset);
+    if (directive.escaped && rendered.find_first_of("&<>\"") != std::string::npos) {
+        // Literal text in the format must stay escaped inside escaped markup.
+        std::string escaped;
+        for (char c : rendered) {
+            if (c == '&') escaped += "&amp;";
+            else if (c == '<') escaped += "&lt;";
+            else if (c == '>') escaped += "&gt;";
+            else if (c == '"') escaped += "&quot;";
+            else escaped += c;
         }
+        rendered = std::move(escaped);
     }
+    if (rendered.size() < static_cast<size_t>(directive.width)) {
+        rendered.append(directive.width - rendered.size(), ' ');
+    }
+    return rendered;
 }
 
 /**
- * @brief Zips the contents of a directory into a new archive file.
- * @param sourceDir The directory whose contents should be zipped.
- * @param archivePath The path for the output archive file.
+ * @brief Renders each directive and splices the results into a copy of the content.
+ * @param content The original text.
+ * @param directives Directives found in that text, in order.
+ * @param startDate The school year's start date.
+ * @param startIndex The starting index for day numbers (e.g., 0 or 1).
+ * @param where Name of the file or entry, recorded in the schedule.
+ * @param recordSchedule False when the caller records the dates itself.
+ * @return The rewritten text.
  */
-void rezipDirectory(const std::string& sourceDir, const std::filesystem::path& archivePath) {
-    // To create a zip with the correct internal structure, we must run the zip
-    // command from *inside* the source directory.
-    // We use absolute paths to ensure correctness regardless of execution location.
-    std::filesystem::path absoluteArchivePath = std::filesystem::absolute(archivePath);
+std::string applyDirectives(std::string_view content, const std::vector<Directive>& directives,
+                            const std::tm& startDate, int startIndex, const std::string& where, bool recordSchedule) {
+    std::string output;
+    output.reserve(content.size() + 64);
+    size_t copiedUpTo = 0;
+    LabelScan labels;
+    for (size_t i = 0; i < directives.size(); ++i) {
+        const Directive& directive = directives[i];
+        output.append(content, copiedUpTo, directive.textBegin - copiedUpTo);
+        std::string rendered = renderDirective(directive, startDate, startIndex);
+        if (g_schedule.enabled && recordSchedule) {
+            recordDate(content, directives, i, rendered, where, startDate, startIndex, labels);
+        }
+        output += rendered;
+        copiedUpTo = directive.textEnd;
+        g_stats.directivesRendered++;
+    }
+    output.append(content, copiedUpTo, std::string_view::npos);
+    return output;
+}
 
-    // The command changes into the source directory, then creates a zip file
-    // containing all of its contents ('.'). The '-r' flag makes it recursive.
-    std::string command = "cd " + sourceDir + " && zip -r \"" + absoluteArchivePath.string() + "\" .";
+// --- Shared partials ---
+// A template pulls in shared markup with
+//     <!--Include(header.html)--> ... <!--/Include-->
+// and the text between the two markers is replaced by the partial of that
+// name from the -partials directory, with its DateReplace directives
+// rendered. The markers stay, so a rewritten course can be rewritten again.
 
-    int result = std::system(command.c_str());
+const std::string_view kIncludeOpen = "<!--Include(";
+const std::string_view kIncludeClose = ")-->";
+const std::string_view kIncludeEnd = "<!--/Include-->";
 
-    if (result != 0) {
-        std::cerr << "Error: Failed to re-zip the directory. Make sure the 'zip' command is installed and in your system's PATH." << std::endl;
+/**
+ * @brief Reads a partial and renders its directives.
+ * @param name The partial's file name, relative to the partials directory.
+ * @param partialsDir The -partials directory.
+ * @param startDate The school year's start date.
+ * @param startIndex The starting index for day numbers.
+ * @return The rendered partial, or null if it could not be read.
+ */
+std::shared_ptr<const std::string> loadPartial(const std::string& name, const std::filesystem::path& partialsDir,
+                                               const std::tm& startDate, int startIndex) {
+    std::shared_ptr<const std::string> rendered;
+    std::filesystem::path relative(name);
+    bool confined = !name.empty() && relative.is_relative() &&
+                    std::find(relative.begin(), relative.end(), "..") == relative.end();
+    std::ifstream in(partialsDir / relative, std::ios::binary);
+    if (!confined || !in) {
+        std::cerr << "Warning: Could not read partial '" << name << "' from '" << partialsDir.string()
+                  << "'. Leaving its includes unchanged." << std::endl;
     } else {
-        std::cout << "Successfully created new archive at '" << absoluteArchivePath.string() << "'" << std::endl;
+        std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        std::vector<Directive> directives = findDirectives(content, "partial " + name);
+        rendered = std::make_shared<const std::string>(
+            directives.empty() ? std::move(content)
+                               : applyDirectives(content, directives, startDate, startIndex, "partial " + name));
     }
+    return rendered;
 }
 
+/**
+ * @brief Returns a partial with its directives rendered, reading and rendering it once per run.
+ * @param name The partial's file name, relative to the partials directory.
+ * @param partialsDir The -partials directory.
+ * @param startDate The school year's start date.
+ * @param startIndex The starting index for day numbers.
+ * @return The rendered partial, or null if it could not be read.
+ */
+std::shared_ptr<const std::string> renderPartial(const std::string& name, const std::filesystem::path& partialsDir,
+                                                 const std::tm& startDate, int startIndex) {
+    // The map lock only guards the lookup; the file is read and rendered under the slot's
+    // once_flag, so workers wanting other partials are not held up by the I/O.
+    struct Slot {
+        std::once_flag once;
+        std::shared_ptr<const std::string> rendered;
+    };
+    static std::mutex cacheMutex;
+    static std::unordered_map<std::string, std::shared_ptr<Slot>> cache;
+    char date[16];
+    std::strftime(date, sizeof(date), "%Y-%m-%d", &startDate);
+    std::string key = partialsDir.string() + '|' + date + '|' + std::to_string(startIndex) + '|' + name;
 
+    std::shared_ptr<Slot> slot;
+    {
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        std::shared_ptr<Slot>& entry = cache[key];
+        if (entry) {
+            g_stats.partialCacheHits++;
+        } else {
+            g_stats.partialCacheMisses++;
+            entry = std::make_shared<Slot>();
+        }
+        slot = entry;
+    }
+    std::call_once(slot->once, [&] { slot->rendered = loadPartial(name, partialsDir, startDate, startIndex); });
+    return slot->rendered;
+}
 
+/**
+ * @brief Renders a file's directives and fills its Include markers with the cached partials.
+ * @param content The original text.
+ * @param where Name of the file or entry, used in warnings.
+ * @param startDate The school year's start date.
+ * @param startIndex The starting index for day numbers.
+ * @param partialsDir The -partials directory; if empty, Include markers are left alone.
+ * @return The rewritten text.
+ */
+std::string applyTemplate(std::string_view content, const std::string& where, const std::tm& startDate,
+                          int startIndex, const std::filesystem::path& partialsDir) {
+    std::string output;
+    output.reserve(content.size() + 64);
+    // Directives are found piece by piece, so the old text inside includes is never scanned.
+    // The schedule is recorded afterwards against the whole file, so its offsets and row or
+    // heading labels do not stop at an Include.
+    std::vector<Directive> scheduled;
+    size_t copiedUpTo = 0;
+    auto renderPiece = [&](std::string_view piece) {
+        std::vector<Directive> directives = findDirectives(piece, where);
+        if (directives.empty()) {
+            output.append(piece);
+            return;
+        }
+        output += applyDirectives(piece, directives, startDate, startIndex, where, false);
+        if (!g_schedule.enabled) return;
+        for (Directive& directive : directives) {
+            directive.markerPos += copiedUpTo;
+            directive.textBegin += copiedUpTo;
+            directive.textEnd += copiedUpTo;
+            scheduled.push_back(std::move(directive));
+        }
+    };
 
+    size_t open = partialsDir.empty() ? std::string_view::npos : content.find(kIncludeOpen);
+    while (open != std::string_view::npos) {
+        size_t close = content.find(kIncludeClose, open + kIncludeOpen.size());
+        size_t end = close == std::string_view::npos ? close : content.find(kIncludeEnd, close);
+        if (end == std::string_view::npos) {
+            std::cerr << "Warning: Unterminated Include in \"" << where << "\". Skipping the rest." << std::endl;
+            break;
+        }
+        std::string name(content.substr(open + kIncludeOpen.size(), close - open - kIncludeOpen.size()));
+        size_t bodyBegin = close + kIncludeClose.size();
+        renderPiece(content.substr(copiedUpTo, bodyBegin - copiedUpTo));
+        std::shared_ptr<const std::string> partial = renderPartial(name, partialsDir, startDate, startIndex);
+        output.append(partial ? std::string_view(*partial) : content.substr(bodyBegin, end - bodyBegin));
+        copiedUpTo = end;
+        open = content.find(kIncludeOpen, end);
+    }
+    renderPiece(content.substr(copiedUpTo));
 
+    LabelScan labels;
+    for (size_t i = 0; i < scheduled.size(); ++i) {
+        recordDate(content, scheduled, i, renderDirective(scheduled[i], startDate, startIndex), where, startDate,
+                   startIndex, labels);
+    }
+    return output;
+}
 
+// --- Schedule output ---
 
+namespace {
 
+/**
+ * @brief Reduces a stretch of HTML to its text, one part per table cell.
+ *
+ * Old date texts of directives inside the stretch are left out, since the
+ * schedule carries the new date itself.
+ */
+std::string labelText(std::string_view content, size_t begin, size_t end, const std::vector<Directive>& directives) {
+    std::vector<std::string> parts(1);
+    // Next directive whose old text may lie in the stretch
+    size_t skip = std::partition_point(directives.begin(), directives.end(),
+                                       [begin](const Directive& d) { return d.textEnd <= begin; }) -
+                  directives.begin();
+    for (size_t i = begin; i < end; ++i) {
+        while (skip < directives.size() && directives[skip].textEnd <= i) ++skip;
+        if (skip < directives.size() && i >= directives[skip].textBegin) {
+            i = directives[skip].textEnd - 1;
+            continue;
+        }
+        char c = content[i];
+        if (c == '<') {
+            size_t close = content.substr(0, end).find('>', i);
+            if (close == std::string_view::npos) break;
+            std::string_view tag = content.substr(i + 1, 2);
+            if ((tag == "td" || tag == "th") && !parts.back().empty()) parts.emplace_back();
+            else if (!parts.back().empty() && parts.back().back() != ' ') parts.back() += ' ';
+            i = close;
+            continue;
+        }
+        if (c == '&') {
+            static const std::pair<std::string_view, char> entities[] = {
+                {"&amp;", '&'}, {"&nbsp;", ' '}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&#39;", '\''}};
+            bool decoded = false;
+            for (const auto& entity : entities) {
+                if (content.compare(i, entity.first.size(), entity.first) == 0) {
+                    c = entity.second;
+                    i += entity.first.size() - 1;
+                    decoded = true;
+                    break;
+                }
+            }
+            if (!decoded) c = '&';
+        }
+        if (std::isspace(static_cast<unsigned char>(c))) {
+            if (!parts.back().empty() && parts.back().back() != ' ') parts.back() += ' ';
+        } else {
+            parts.back() += c;
+        }
+    }
+    std::string label;
+    for (auto& part : parts) {
+        while (!part.empty() && part.back() == ' ') part.pop_back();
+        if (part.empty()) continue;
+        if (!label.empty()) label += "; ";
+        label += part;
+    }
+    if (label.size() > 160) label = label.substr(0, 157) + "...";
+    return label;
+}
 
+/**
+ * @brief Escapes text for an iCalendar property value.
+ */
+std::string icsEscape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '\\' || c == ';' || c == ',') escaped += '\\';
+        if (c == '\n') escaped += "\\n";
+        else escaped += c;
+    }
+    return escaped;
+}
 
+/**
+ * @brief Escapes text for a JSON string literal.
+ */
+std::string jsonEscape(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+} // namespace
+
+/**
+ * @brief Records a rendered directive in the schedule if it names a day.
+ *
+ * The label is the text of the table row around the directive or, outside
+ * tables, of the nearest heading before it.
+ * @param content The text the directive was found in.
+ * @param directives All directives found in that text.
+ * @param index The directive being rendered.
+ * @param rendered Its new date text.
+ * @param where Name of the file or entry.
+ * @param startDate The school year's start date.
+ * @param startIndex The starting index for day numbers.
+ * @param labels Rows and headings seen by earlier calls for the same text.
+ */
+void recordDate(std::string_view content, const std::vector<Directive>& directives, size_t index,
+                const std::string& rendered, const std::string& where, const std::tm& startDate, int startIndex,
+                LabelScan& labels) {
+    const Directive& directive = directives[index];
+    if (directive.format.find('D') == std::string::npos) return; // A year or month, not a date
+
+    // Catch up on the rows and headings between the previous directive and this one.
+    for (size_t at = content.find('<', labels.scanned); at < directive.markerPos; at = content.find('<', at + 1)) {
+        std::string_view tag = content.substr(at, 4);
+        if (tag.substr(0, 3) == "<tr") {
+            labels.rowBegin = at;
+        } else if (tag == "</tr") {
+            labels.lastRowEnd = at;
+        } else if (tag.size() >= 3 && tag[1] == 'h' && tag[2] >= '1' && tag[2] <= '6') {
+            if (labels.headingEnd != std::string_view::npos && labels.headingEnd <= at) {
+                labels.headingEnd = content.find("</h", at);
+            }
+            if (labels.headingEnd != std::string_view::npos) {
+                std::string heading = labelText(content, at, labels.headingEnd, directives);
+                if (!heading.empty()) labels.heading = std::move(heading);
+            }
+        }
+    }
+    labels.scanned = std::max(labels.scanned, directive.markerPos);
+    if (labels.nextRowEnd != std::string_view::npos && labels.nextRowEnd < directive.textEnd) {
+        labels.nextRowEnd = content.find("</tr", directive.textEnd);
+    }
+
+    std::string label;
+    if (labels.rowBegin != std::string_view::npos && labels.nextRowEnd != std::string_view::npos &&
+        (labels.lastRowEnd == std::string_view::npos || labels.lastRowEnd < labels.rowBegin)) {
+        if (labels.labelledRow != labels.rowBegin) {
+            labels.rowLabel = labelText(content, labels.rowBegin, labels.nextRowEnd, directives);
+            labels.labelledRow = labels.rowBegin;
+        }
+        label = labels.rowLabel;
+    } else {
+        label = labels.heading;
+    }
+
+    ScheduleEntry entry;
+    entry.source = where;
+    entry.position = directive.markerPos;
+    entry.label = label;
+    entry.rendered = rendered;
+    entry.date = addDays(startDate, directive.hasDayOffset ? directive.dayOffset - startIndex : 0);
+    while (!entry.rendered.empty() && entry.rendered.back() == ' ') entry.rendered.pop_back(); // Width padding
+    std::lock_guard<std::mutex> lock(g_schedule.mutex);
+    g_schedule.entries.push_back(std::move(entry));
+}
+
+/**
+ * @brief Writes the recorded dates as <base>.ics and <base>.json.
+ *
+ * Both are sorted by date. The calendar has one all-day event per distinct
+ * date and label, since a course usually repeats its schedule across pages.
+ * @param basePath Output path; a .ics or .json extension is dropped.
+ * @return True if both files were written, false otherwise.
+ */
+bool writeSchedule(const std::filesystem::path& basePath) {
+    std::filesystem::path base = basePath;
+    if (base.extension() == ".ics" || base.extension() == ".json") base.replace_extension();
+
+    std::vector<ScheduleEntry>& entries = g_schedule.entries;
+    auto day = [](const std::tm& date) {
+        char text[16];
+        std::strftime(text, sizeof(text), "%Y%m%d", &date);
+        return std::string(text);
+    };
+    std::sort(entries.begin(), entries.end(), [&](const ScheduleEntry& a, const ScheduleEntry& b) {
+        std::string dayA = day(a.date), dayB = day(b.date);
+        if (dayA != dayB) return dayA < dayB;
+        if (a.source != b.source) return a.source < b.source;
+        return a.position < b.position;
+    });
+
+    std::ostringstream json;
+    json << "{\n  \"dates\": [";
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const ScheduleEntry& entry = entries[i];
+        char iso[16];
+        std::strftime(iso, sizeof(iso), "%Y-%m-%d", &entry.date);
+        json << (i ? ",\n" : "\n") << "    {\"date\": \"" << iso << "\", \"text\": \"" << jsonEscape(entry.rendered)
+             << "\", \"label\": \"" << jsonEscape(entry.label) << "\", \"source\": \"" << jsonEscape(entry.source)
+             << "\", \"offset\": " << entry.position << "}";
+    }
+    json << (entries.empty() ? "" : "\n  ") << "]\n}\n";
+
+    std::time_t now = std::time(nullptr);
+    char stamp[32];
+    std::strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%SZ", std::gmtime(&now));
+    std::string ics = "BEGIN:VCALENDAR\r\nVERSION:2.0\r\nPRODID:-//canvasupdater//schedule//EN\r\n"
+                      "CALSCALE:GREGORIAN\r\n";
+    std::unordered_map<std::string, bool> seen;
+    for (const auto& entry : entries) {
+        std::string summary = entry.label.empty() ? entry.rendered : entry.label;
+        std::string key = day(entry.date) + '|' + summary;
+        if (!seen.emplace(key, true).second) continue;
+        std::tm next = addDays(entry.date, 1);
+        std::vector<std::string> lines = {
+            "BEGIN:VEVENT",
+            "UID:" + sha256Hex(key).substr(0, 32) + "@canvasupdater",
+            std::string("DTSTAMP:") + stamp,
+            "DTSTART;VALUE=DATE:" + day(entry.date),
+            "DTEND;VALUE=DATE:" + day(next),
+            "SUMMARY:" + icsEscape(summary),
+            "DESCRIPTION:" + icsEscape(entry.source),
+            "END:VEVENT"};
+        for (const auto& line : lines) {
+            // Fold lines at 75 octets without splitting a UTF-8 sequence.
+            size_t start = 0;
+            while (line.size() - start > 75) {
+                size_t cut = start + 75 - (start ? 1 : 0);
+                while (cut > start && (static_cast<unsigned char>(line[cut]) & 0xC0) == 0x80) --cut;
+                ics += line.substr(start, cut - start) + "\r\n ";
+                start = cut;
+            }
+            ics += line.substr(start) + "\r\n";
+        }
+    }
+    ics += "END:VCALENDAR\r\n";
+
+    for (const auto& [extension, text] : {std::pair<const char*, std::string>{".ics", ics}, {".json", json.str()}}) {
+        std::filesystem::path path = base;
+        path += extension;
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out || !(out << text) || !out.flush()) return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Overwrites the dates of a file in place when none of them changes length.
+ * @param filePath The file the directives were found in.
+ * @param content Its current content.
+ * @param directives Directives found in that content, in order.
+ * @param rendered The new text for each directive.
+ * @return True if the file is up to date, false if it needs a full rewrite.
+ */
+bool patchFileInPlace(const std::filesystem::path& filePath, std::string_view content,
+                      const std::vector<Directive>& directives, const std::vector<std::string>& rendered) {
+#ifndef _WIN32
+    for (size_t i = 0; i < directives.size(); ++i) {
+        if (rendered[i].size() != directives[i].textEnd - directives[i].textBegin) return false;
+    }
+    int fd = ::open(filePath.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool ok = true;
+    for (size_t i = 0; i < directives.size() && ok; ++i) {
+        const Directive& directive = directives[i];
+        if (content.compare(directive.textBegin, rendered[i].size(), rendered[i]) == 0) continue;
+        ok = ::pwrite(fd, rendered[i].data(), rendered[i].size(), static_cast<off_t>(directive.textBegin)) ==
+             static_cast<ssize_t>(rendered[i].size());
+    }
+    ::close(fd);
+    return ok;
+#else
+    (void)filePath; (void)content; (void)directives; (void)rendered;
+    return false; // Text-mode reads do not give byte offsets here
+#endif
+}
+
+/**
+ * @brief Scans and processes a single file for DateReplace directives.
+ *
+ * When every rendered date is as long as the text it replaces, only those
+ * bytes are overwritten; otherwise the whole file is rewritten. Files whose
+ * dates are already current are left alone and not counted as rewritten.
+ * @param filePath The path to the file to process.
+ * @param startDate The school year's start date.
+ * @param startIndex The starting index for day numbers (e.g., 0 or 1).
+ * @param partialsDir The -partials directory for Include markers, or empty.
+ */
+void processFile(const std::filesystem::path& filePath, const std::tm& startDate, int startIndex,
+                 const std::filesystem::path& partialsDir) {
+    if (!hasTextExtension(filePath.string())) return;
+    g_stats.entriesScanned++;
+
+    std::ifstream fileIn(filePath);
+    if (!fileIn) {
+        std::cerr << "Warning: Could not open file " << filePath << ". Skipping." << std::endl;
+        return;
+    }
+
+    std::stringstream buffer;
+    buffer << fileIn.rdbuf();
+    std::string content = buffer.str();
+    fileIn.close();
+
+    bool hasIncludes = !partialsDir.empty() && content.find(kIncludeOpen) != std::string::npos;
+    std::vector<Directive> directives = findDirectives(content, filePath.string(), defaultThreadCount());
+    if (directives.empty() && !hasIncludes) return;
+
+    for (const auto& directive : directives) {
+        if (!directive.hasDayOffset) continue;
+        // --- DEBUGGING OUTPUT ---
+        std::cout << "[DEBUG] In file: " << filePath.filename().string() << "\n"
+                  << "        Full directive args: \"" << directive.args << "\"\n"
+                  << "        Attempting to parse day number from: \""
+                  << directive.args.substr(directive.args.rfind(',') + 1) << "\"" << std::endl;
+        // --- END DEBUGGING OUTPUT ---
+    }
+
+    if (hasIncludes) {
+        std::string output = applyTemplate(content, filePath.string(), startDate, startIndex, partialsDir);
+        if (output == content) return;
+        content = std::move(output);
+    } else {
+        std::vector<std::string> rendered;
+        rendered.reserve(directives.size());
+        LabelScan labels;
+        for (size_t i = 0; i < directives.size(); ++i) {
+            rendered.push_back(renderDirective(directives[i], startDate, startIndex));
+            if (g_schedule.enabled) {
+                recordDate(content, directives, i, rendered.back(), filePath.string(), startDate, startIndex, labels);
+            }
+            g_stats.directivesRendered++;
+        }
+        // A file whose dates already match is neither opened for writing nor counted.
+        bool changed = false;
+        for (size_t i = 0; i < directives.size() && !changed; ++i) {
+            const Directive& directive = directives[i];
+            changed = content.compare(directive.textBegin, directive.textEnd - directive.textBegin, rendered[i]) != 0;
+        }
+        if (!changed) return;
+        if (patchFileInPlace(filePath, content, directives, rendered)) {
+            g_stats.entriesRewritten++;
+            g_stats.entriesPatched++;
+            return;
+        }
+
+        std::string output;
+        output.reserve(content.size() + 64);
+        size_t copiedUpTo = 0;
+        for (size_t i = 0; i < directives.size(); ++i) {
+            output.append(content, copiedUpTo, directives[i].textBegin - copiedUpTo);
+            output += rendered[i];
+            copiedUpTo = directives[i].textEnd;
+        }
+        output.append(content, copiedUpTo, std::string::npos);
+        content = std::move(output);
+    }
+
+    std::ofstream fileOut(filePath, std::ios::trunc);
+    if (!fileOut) {
+        std::cerr << "Warning: Could not write to file " << filePath << ". Skipping." << std::endl;
+        return;
+    }
+    fileOut << content;
+    fileOut.close();
+    g_stats.entriesRewritten++;
+}
+
+/**
+ * @brief Recursively iterates through a directory and processes each file.
+ * @param dirPath The directory to process.
+ * @param startDate The school year's start date.
+ * @param startIndex The starting index for day numbers.
+ * @param partialsDir The -partials directory for Include markers, or empty.
+ */
+void processDirectory(const std::filesystem::path& dirPath, const std::tm& startDate, int startIndex,
+                      const std::filesystem::path& partialsDir) {
+    // Collect the files first so the pending count is known up front.
+    std::vector<std::filesystem::path> files;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(dirPath)) {
+        if (entry.is_regular_file()) {
+            files.push_back(entry.path());
+        }
+    }
+
+    std::atomic<long long>& pending = queueDepth("files");
+    pending = static_cast<long long>(files.size());
+    WorkerSlot& slot = workerSlot("main");
+    for (const auto& file : files) {
+        pending--;
+        WorkerActivity activity(slot, "scan " + file.string());
+        processFile(file, startDate, startIndex, partialsDir);
+    }
+}
+
+/**
+ * @brief Zips the contents of a directory into a new archive file.
+ * @param sourceDir The directory whose contents should be zipped.
+ * @param archivePath The path for the output archive file, or an s3://bucket/key to upload to.
+ * @return True if the archive was created, false otherwise.
+ */
+bool rezipDirectory(const std::string& sourceDir, const std::filesystem::path& archivePath) {
+    if (isS3Path(archivePath.string())) {
+        // Let zip write to stdout and stream that straight into the upload.
+        FILE* zipOut = popen(("cd " + sourceDir + " && zip -r -q - .").c_str(), "r");
+        if (!zipOut) {
+            std::cerr << "Error: Failed to start zip." << std::endl;
+            return false;
+        }
+        try {
+            S3Upload upload(parseS3Path(archivePath.string()), kUploadPartSize, cpuBudget().ioThreads);
+            std::ostream out(&upload);
+            char buffer[65536];
+            size_t n;
+            while ((n = fread(buffer, 1, sizeof(buffer), zipOut)) > 0) out.write(buffer, static_cast<std::streamsize>(n));
+            if (pclose(zipOut) != 0) {
+                zipOut = nullptr;
+                throw std::runtime_error("zip failed. Make sure the 'zip' command is installed and in your system's PATH");
+            }
+            zipOut = nullptr;
+            upload.complete();
+            g_stats.bytesOut += upload.bytesWritten();
+        } catch (const std::exception& e) {
+            if (zipOut) pclose(zipOut);
+            std::cerr << "Error: Failed to re-zip the directory: " << e.what() << std::endl;
+            return false;
+        }
+        std::cout << "Successfully uploaded new archive to '" << archivePath.string() << "'" << std::endl;
+        return true;
+    }
+
+    // To create a zip with the correct internal structure, we must run the zip
+    // command from *inside* the source directory.
+    // We use absolute paths to ensure correctness regardless of execution location.
+    std::filesystem::path absoluteArchivePath = std::filesystem::absolute(archivePath);
+
+    // The command changes into the source directory, then creates a zip file
+    // containing all of its contents ('.'). The '-r' flag makes it recursive.
+    std::string command = "cd " + sourceDir + " && zip -r \"" + absoluteArchivePath.string() + "\" .";
+
+    int result = std::system(command.c_str());
+
+    if (result != 0) {
+        std::cerr << "Error: Failed to re-zip the directory. Make sure the 'zip' command is installed and in your system's PATH." << std::endl;
+        return false;
+    }
+    std::cout << "Successfully created new archive at '" << absoluteArchivePath.string() << "'" << std::endl;
+    return true;
+}
+
+/**
+ * @brief Returns the name used for a phase in logs and metrics.
+ */
+const char* phaseName(Phase phase) {
+    switch (phase) {
+        case Phase::Startup: return "startup";
+        case Phase::Unzip:   return "unzip";
+        case Phase::Process: return "process";
+        case Phase::Rezip:   return "rezip";
+        case Phase::Done:    return "done";
+        default:             return "unknown";
+    }
+}
+
+/**
+ * @brief Writes the run statistics as an OpenMetrics textfile for node_exporter.
+ *
+ * Every sample carries a "course" label, and each course of the run gets its
+ * own series. Gauges of the run as a whole (CPU budget, pools, phases, cache
+ * hit ratios) are repeated under every course, since its archives shared them.
+ * The file is written next to its final name and then renamed over it, so the
+ * textfile collector never scrapes a half-written file.
+ * @param metricsPath Destination of the .prom file.
+ * @param courses The courses of the run, with their labels and counters.
+ * @param success Whether the run completed without errors.
+ * @return True if the file was written, false otherwise.
+ */
+bool writeMetricsFile(const std::filesystem::path& metricsPath, const std::deque<CourseStats>& courses, bool success) {
+    // Label values must escape backslashes, quotes and newlines.
+    std::vector<std::string> courseLabels;
+    for (const auto& course : courses) {
+        std::string label;
+        for (char c : course.label) {
+            if (c == '\\') label += "\\\\";
+            else if (c == '"') label += "\\\"";
+            else if (c == '\n') label += "\\n";
+            else label += c;
+        }
+        courseLabels.push_back("course=\"" + label + "\"");
+    }
+    // A run that failed without a failed job (an unwritable schedule, say) counts against every course.
+    bool jobFailed = std::any_of(courses.begin(), courses.end(), [](const CourseStats& c) { return c.failed.load(); });
+
+    std::ostringstream out;
+    out << std::setprecision(15); // Keep byte counts and timestamps out of scientific notation
+    auto header = [&](const std::string& name, const std::string& help) {
+        out << "# TYPE " << name << " gauge\n"
+            << "# HELP " << name << " " << help << "\n";
+    };
+    auto gauge = [&](const std::string& name, const std::string& help, double value) {
+        header(name, help);
+        for (const auto& courseLabel : courseLabels) out << name << "{" << courseLabel << "} " << value << "\n";
+    };
+    auto counter = [&](const std::string& name, const std::string& help, CourseCounter index) {
+        header(name, help);
+        for (size_t n = 0; n < courses.size(); ++n) {
+            out << name << "{" << courseLabels[n] << "} " << courses[n].counts[index] << "\n";
+        }
+    };
+
+    unsigned long long hits = g_stats.renderCacheHits;
+    unsigned long long lookups = hits + g_stats.renderCacheMisses;
+    unsigned long long partialHits = g_stats.partialCacheHits;
+    unsigned long long partialLookups = partialHits + g_stats.partialCacheMisses;
+
+    header("canvasupdater_last_run_success", "Whether the last run completed without errors.");
+    for (size_t n = 0; n < courses.size(); ++n) {
+        bool ok = jobFailed ? !courses[n].failed : success;
+        out << "canvasupdater_last_run_success{" << courseLabels[n] << "} " << (ok ? 1 : 0) << "\n";
+    }
+    gauge("canvasupdater_last_run_timestamp_seconds", "Unix time at which the last run finished.",
+          static_cast<double>(std::time(nullptr)));
+    counter("canvasupdater_archives_processed", "Archives rewritten by the last run.", kArchivesProcessed);
+    counter("canvasupdater_entries_scanned", "Text entries scanned for directives.", kEntriesScanned);
+    counter("canvasupdater_entries_rewritten", "Entries whose content changed.", kEntriesRewritten);
+    counter("canvasupdater_entries_patched", "Extracted files patched in place because no date changed length.",
+            kEntriesPatched);
+    counter("canvasupdater_directives_rendered", "DateReplace directives rendered.", kDirectivesRendered);
+    counter("canvasupdater_stage_edits", "Edits made by transformation stages.", kStageEdits);
+    counter("canvasupdater_png_bytes_saved", "Bytes saved by recompressing PNG images.", kPngBytesSaved);
+    counter("canvasupdater_bytes_in", "Bytes of input archives read.", kBytesIn);
+    counter("canvasupdater_bytes_out", "Bytes of output archives written.", kBytesOut);
+
+    const CpuBudget& budget = cpuBudget();
+    gauge("canvasupdater_cpus_online", "CPUs reported by the operating system.", budget.hardware);
+    gauge("canvasupdater_cpus_affinity", "CPUs in the process affinity mask (0 if unknown).", budget.affinity);
+    gauge("canvasupdater_cpu_quota", "cgroup CPU quota in CPUs (0 if unlimited).", budget.quota);
+    gauge("canvasupdater_cpus_usable", "CPUs the default pool sizes were derived from.", budget.cpus);
+    header("canvasupdater_pool_threads", "Threads in each worker pool of the last run.");
+    for (const auto& courseLabel : courseLabels) {
+        out << "canvasupdater_pool_threads{" << courseLabel << ",pool=\"compute\"} " << g_stats.computeThreads << "\n"
+            << "canvasupdater_pool_threads{" << courseLabel << ",pool=\"io\"} " << g_stats.ioThreads << "\n";
+    }
+
+    header("canvasupdater_phase_duration_seconds", "Wall time spent in each phase of the last run.");
+    for (const auto& courseLabel : courseLabels) {
+        for (int i = 0; i < static_cast<int>(Phase::Count); ++i) {
+            Phase phase = static_cast<Phase>(i);
+            if (phase == Phase::Startup || phase == Phase::Done) continue;
+            out << "canvasupdater_phase_duration_seconds{" << courseLabel << ",phase=\"" << phaseName(phase) << "\"} "
+                << g_stats.phaseSeconds[i] << "\n";
+        }
+    }
+
+    header("canvasupdater_cache_hit_ratio", "Fraction of lookups served from each cache.");
+    for (const auto& courseLabel : courseLabels) {
+        out << "canvasupdater_cache_hit_ratio{" << courseLabel << ",cache=\"render\"} "
+            << (lookups ? static_cast<double>(hits) / lookups : 0.0) << "\n"
+            << "canvasupdater_cache_hit_ratio{" << courseLabel << ",cache=\"partial\"} "
+            << (partialLookups ? static_cast<double>(partialHits) / partialLookups : 0.0) << "\n";
+    }
+    out << "# EOF\n";
+
+    std::filesystem::path tmpPath = metricsPath;
+    tmpPath += ".tmp";
+    {
+        std::ofstream fileOut(tmpPath, std::ios::trunc);
+        if (!fileOut) return false;
+        fileOut << out.str();
+        if (!fileOut) return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, metricsPath, ec);
+    return !ec;
+}
+
+/**
+ * @brief Builds a human-readable snapshot of the run's in-flight state.
+ * @return Phase, per-worker task and elapsed time, queue depths and counters.
+ */
+std::string progressSnapshot() {
+    using namespace std::chrono;
+    auto now = steady_clock::now();
+    auto seconds = [](steady_clock::duration d) { return duration<double>(d).count(); };
+    steady_clock::time_point phaseSince{nanoseconds(g_progress.phaseSinceNs.load())};
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    out << "=== canvasupdater snapshot (" << seconds(now - g_progress.runStart) << "s into run) ===\n";
+    out << "phase: " << phaseName(static_cast<Phase>(g_progress.phase.load()));
+    if (g_progress.phaseSinceNs != 0) out << " (" << seconds(now - phaseSince) << "s)";
+    out << "\n";
+
+    std::lock_guard<std::mutex> boardLock(g_progress.boardMutex);
+    out << "workers:\n";
+    for (auto& slot : g_progress.workers) {
+        std::lock_guard<std::mutex> lock(slot.mutex);
+        out << "  " << slot.name << ": " << (slot.task.empty() ? "idle" : slot.task)
+            << " (" << seconds(now - slot.since) << "s)\n";
+    }
+    out << "queues:\n";
+    for (auto& queue : g_progress.queues) {
+        out << "  " << queue.first << ": " << queue.second.load() << "\n";
+    }
+    out << "counters: archives=" << g_stats.archivesProcessed
+        << " scanned=" << g_stats.entriesScanned
+        << " rewritten=" << g_stats.entriesRewritten
+        << " directives=" << g_stats.directivesRendered
+        << " bytes_in=" << g_stats.bytesIn
+        << " bytes_out=" << g_stats.bytesOut
+        << " render_cache_hits=" << g_stats.renderCacheHits
+        << " render_cache_misses=" << g_stats.renderCacheMisses << "\n";
+    return out.str();
+}
+
+#ifndef _WIN32
+namespace {
+std::thread g_reporterThread;
+std::atomic<bool> g_reporterStop{false};
+}
+#endif
+
+/**
+ * @brief Starts the thread that prints a snapshot whenever SIGUSR1 arrives.
+ *
+ * SIGUSR1 is blocked here, before any other thread exists, so every thread
+ * inherits the mask and the signal is only ever consumed by sigwait() in the
+ * reporter. No work happens in signal context, which keeps it async-signal-safe.
+ */
+void startSnapshotReporter() {
+#ifndef _WIN32
+    if (g_reporterThread.joinable()) return;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+    g_reporterThread = std::thread([set]() {
+        while (true) {
+            int sig = 0;
+            if (sigwait(&set, &sig) != 0) continue;
+            if (g_reporterStop) break;
+            std::string snapshot = progressSnapshot();
+            // One write keeps the snapshot contiguous even if workers log meanwhile.
+            ssize_t ignored = write(STDERR_FILENO, snapshot.data(), snapshot.size());
+            (void)ignored;
+        }
+    });
+#endif
+}
+
+/**
+ * @brief Stops the SIGUSR1 reporter thread, if it is running.
+ */
+void stopSnapshotReporter() {
+#ifndef _WIN32
+    if (!g_reporterThread.joinable()) return;
+    g_reporterStop = true;
+    pthread_kill(g_reporterThread.native_handle(), SIGUSR1);
+    g_reporterThread.join();
+#endif
+}
+
+// --- Archive reading ---
+
+MappedFile::MappedFile(const std::filesystem::path& path) {
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Could not open '" + path.string() + "'");
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void* mapped = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            data_ = static_cast<const char*>(mapped);
+            size_ = static_cast<size_t>(info.st_size);
+        }
+    }
+    close(fd);
+    if (data_ != nullptr || info.st_size == 0) return;
+#endif
+    // Fall back to reading the whole file.
+    std::ifstream fileIn(path, std::ios::binary);
+    if (!fileIn) {
+        throw std::runtime_error("Could not open '" + path.string() + "'");
+    }
+    std::ostringstream buffer;
+    buffer << fileIn.rdbuf();
+    fallback_ = buffer.str();
+    data_ = fallback_.data();
+    size_ = fallback_.size();
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if (data_ != nullptr && data_ != fallback_.data()) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+#endif
+}
+
+namespace {
+uint16_t readLE16(const char* p) {
+    const auto* b = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint16_t>(b[0] | (b[1] << 8));
+}
+
+uint32_t readLE32(const char* p) {
+    const auto* b = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint32_t>(b[0]) | (static_cast<uint32_t>(b[1]) << 8) |
+           (static_cast<uint32_t>(b[2]) << 16) | (static_cast<uint32_t>(b[3]) << 24);
+}
+
+uint64_t readLE64(const char* p) {
+    return static_cast<uint64_t>(readLE32(p)) | (static_cast<uint64_t>(readLE32(p + 4)) << 32);
+}
+}
+
+ZipArchive::ZipArchive(const std::filesystem::path& path)
+    : file_(std::make_unique<MappedFile>(path)), data_(file_->view()) {
+    uint64_t neededStart = 0;
+    parseCentralDirectory(neededStart);
+}
+
+/**
+ * @brief Reads just the central directory of an archive through a positional reader.
+ *
+ * Only the end of the archive is fetched (a second read covers a central
+ * directory larger than the first guess), so entry payloads can later be
+ * read individually, e.g. with pread() or ranged requests.
+ * @param readAt Returns `size` bytes starting at `offset`.
+ * @param archiveSize Total size of the archive.
+ * @return An archive whose entries() are known but whose payloads are not loaded.
+ */
+ZipArchive ZipArchive::fromTail(const std::function<std::string(uint64_t offset, size_t size)>& readAt,
+                                uint64_t archiveSize) {
+    ZipArchive archive;
+    uint64_t start = archiveSize > 64 * 1024 ? archiveSize - 64 * 1024 : 0;
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        archive.buffer_ = readAt(start, static_cast<size_t>(archiveSize - start));
+        archive.baseOffset_ = start;
+        archive.data_ = archive.buffer_;
+        archive.entries_.clear();
+        uint64_t neededStart = start;
+        if (archive.parseCentralDirectory(neededStart)) return archive;
+        start = neededStart;
+    }
+    throw std::runtime_error("could not read the central directory");
+}
+
+/**
+ * @brief Locates the end-of-central-directory record (zip64 aware) and reads every entry header.
+ * @param neededStart Set to the archive offset that must be loaded when the
+ *        central directory starts before the bytes currently held.
+ * @return True once the entries are read, false if earlier bytes are needed.
+ */
+bool ZipArchive::parseCentralDirectory(uint64_t& neededStart) {
+    const size_t kEocdSize = 22;
+    if (data_.size() < kEocdSize) {
+        throw std::runtime_error("not a zip archive (too small)");
+    }
+
+    // The EOCD record sits at the end, followed by a comment of up to 64 KiB.
+    size_t eocdPos = std::string_view::npos;
+    size_t searchFloor = data_.size() > kEocdSize + 0xFFFF ? data_.size() - kEocdSize - 0xFFFF : 0;
+    for (size_t pos = data_.size() - kEocdSize + 1; pos-- > searchFloor;) {
+        if (readLE32(data_.data() + pos) == 0x06054b50) {
+            eocdPos = pos;
+            break;
+        }
+    }
+    if (eocdPos == std::string_view::npos) {
+        throw std::runtime_error("not a zip archive (no end of central directory)");
+    }
+
+    const char* eocd = data_.data() + eocdPos;
+    uint64_t entryCount = readLE16(eocd + 10);
+    uint64_t cdSize = readLE32(eocd + 12);
+    uint64_t cdOffset = readLE32(eocd + 16);
+
+    // Zip64 archives keep the real values in a second record found through a locator.
+    if (eocdPos >= 20 && readLE32(eocd - 20) == 0x07064b50) {
+        uint64_t eocd64Pos = readLE64(eocd - 20 + 8);
+        if (eocd64Pos < baseOffset_) {
+            neededStart = eocd64Pos;
+            return false;
+        }
+        eocd64Pos -= baseOffset_;
+        if (eocd64Pos + 56 > data_.size() || readLE32(data_.data() + eocd64Pos) != 0x06064b50) {
+            throw std::runtime_error("corrupt zip64 end of central directory");
+        }
+        const char* eocd64 = data_.data() + eocd64Pos;
+        entryCount = readLE64(eocd64 + 32);
+        cdSize = readLE64(eocd64 + 40);
+        cdOffset = readLE64(eocd64 + 48);
+    }
+    centralDirectoryOffset_ = cdOffset;
+    if (cdOffset < baseOffset_) {
+        neededStart = cdOffset;
+        return false;
+    }
+    cdOffset -= baseOffset_;
+    if (cdOffset + cdSize > data_.size()) {
+        throw std::runtime_error("central directory lies outside the archive");
+    }
+
+    entries_.reserve(static_cast<size_t>(std::min<uint64_t>(entryCount, cdSize / 46)));
+    const char* p = data_.data() + cdOffset;
+    const char* end = p + cdSize;
+    for (uint64_t i = 0; i < entryCount; ++i) {
+        if (end - p < 46 || readLE32(p) != 0x02014b50) {
+            throw std::runtime_error("corrupt central directory");
+        }
+        ZipEntry entry;
+        entry.versionMadeBy = readLE16(p + 4);
+        entry.flags = readLE16(p + 8);
+        entry.method = readLE16(p + 10);
+        entry.modTime = readLE16(p + 12);
+        entry.modDate = readLE16(p + 14);
+        entry.crc32 = readLE32(p + 16);
+        entry.compressedSize = readLE32(p + 20);
+        entry.uncompressedSize = readLE32(p + 24);
+        uint16_t nameLength = readLE16(p + 28);
+        uint16_t extraLength = readLE16(p + 30);
+        uint16_t commentLength = readLE16(p + 32);
+        entry.externalAttributes = readLE32(p + 38);
+        entry.localHeaderOffset = readLE32(p + 42);
+        if (end - p < 46 + nameLength + extraLength + commentLength) {
+            throw std::runtime_error("corrupt central directory");
+        }
+        entry.name.assign(p + 46, nameLength);
+
+        // The zip64 extra field holds, in order, whichever sizes overflowed 32 bits.
+        const char* extra = p + 46 + nameLength;
+        const char* extraEnd = extra + extraLength;
+        while (extraEnd - extra >= 4) {
+            uint16_t tag = readLE16(extra);
+            uint16_t size = readLE16(extra + 2);
+            const char* field = extra + 4;
+            const char* fieldEnd = field + std::min<ptrdiff_t>(size, extraEnd - field);
+            if (tag == 0x0001) {
+                if (entry.uncompressedSize == 0xFFFFFFFF && fieldEnd - field >= 8) {
+                    entry.uncompressedSize = readLE64(field);
+                    field += 8;
+                }
+                if (entry.compressedSize == 0xFFFFFFFF && fieldEnd - field >= 8) {
+                    entry.compressedSize = readLE64(field);
+                    field += 8;
+                }
+                if (entry.localHeaderOffset == 0xFFFFFFFF && fieldEnd - field >= 8) {
+                    entry.localHeaderOffset = readLE64(field);
+                }
+            }
+            extra += 4 + size;
+        }
+
+        entries_.push_back(std::move(entry));
+        p += 46 + nameLength + extraLength + commentLength;
+    }
+    return true;
+}
+
+/**
+ * @brief Returns the stored (usually deflated) bytes of an entry without copying them.
+ */
+std::string_view ZipArchive::compressedData(const ZipEntry& entry) const {
+    if (entry.localHeaderOffset < baseOffset_) {
+        throw std::runtime_error("entry '" + entry.name + "' was not loaded");
+    }
+    uint64_t headerPos = entry.localHeaderOffset - baseOffset_;
+    if (headerPos + 30 > data_.size() || readLE32(data_.data() + headerPos) != 0x04034b50) {
+        throw std::runtime_error("corrupt local header for '" + entry.name + "'");
+    }
+    uint64_t dataPos = headerPos + localHeaderSize(data_.substr(static_cast<size_t>(headerPos), 30));
+    if (dataPos + entry.compressedSize > data_.size()) {
+        throw std::runtime_error("entry '" + entry.name + "' extends past the end of the archive");
+    }
+    return data_.substr(static_cast<size_t>(dataPos), static_cast<size_t>(entry.compressedSize));
+}
+
+/**
+ * @brief Returns the full size of a local file header from its fixed 30-byte part.
+ */
+size_t localHeaderSize(std::string_view fixedPart) {
+    if (fixedPart.size() < 30 || readLE32(fixedPart.data()) != 0x04034b50) {
+        throw std::runtime_error("corrupt local header");
+    }
+    return 30 + readLE16(fixedPart.data() + 26) + readLE16(fixedPart.data() + 28);
+}
+
+/**
+ * @brief Decompresses an entry and checks it against the recorded CRC-32.
+ */
+std::string ZipArchive::extract(const ZipEntry& entry) const {
+    return decompressEntry(entry, compressedData(entry));
+}
+
+/**
+ * @brief Decompresses an entry's payload and checks it against the recorded CRC-32.
+ * @param entry The entry's metadata.
+ * @param raw The entry's compressed bytes.
+ * @return The uncompressed content.
+ */
+std::string decompressEntry(const ZipEntry& entry, std::string_view raw) {
+    if (entry.flags & 0x0001) {
+        throw std::runtime_error("entry '" + entry.name + "' is encrypted");
+    }
+    std::string content;
+    if (entry.method == 0) {
+        content.assign(raw);
+    } else if (entry.method == 8) {
+        content = inflateRaw(reinterpret_cast<const uint8_t*>(raw.data()), raw.size(),
+                             static_cast<size_t>(entry.uncompressedSize));
+    } else {
+        throw std::runtime_error("entry '" + entry.name + "' uses unsupported compression method " +
+                                 std::to_string(entry.method));
+    }
+    if (crc32Update(0, content.data(), content.size()) != entry.crc32) {
+        throw std::runtime_error("CRC mismatch in entry '" + entry.name + "'");
+    }
+    return content;
+}
+
+/**
+ * @brief Updates a CRC-32 (the zip/gzip polynomial) with more data.
+ * @param crc The CRC of the preceding data, or 0 to start.
+ * @param data The bytes to add.
+ * @param size Number of bytes.
+ * @return The updated CRC.
+ */
+uint32_t crc32Update(uint32_t crc, const void* data, size_t size) {
+    // Slicing-by-8 tables: one byte-at-a-time table plus seven derived ones.
+    static const auto tables = [] {
+        std::vector<std::array<uint32_t, 256>> t(8);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k) t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+        }
+        return t;
+    }();
+
+    const auto* p = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+    while (size >= 8) {
+        uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24));
+        crc = tables[7][lo & 0xFF] ^ tables[6][(lo >> 8) & 0xFF] ^ tables[5][(lo >> 16) & 0xFF] ^
+              tables[4][lo >> 24] ^ tables[3][p[4]] ^ tables[2][p[5]] ^ tables[1][p[6]] ^ tables[0][p[7]];
+        p += 8;
+        size -= 8;
+    }
+    while (size--) {
+        crc = tables[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+namespace {
+/**
+ * @brief Canonical Huffman decoding table for inflate.
+ *
+ * Codes of up to kFastBits bits resolve with a single lookup; longer ones fall
+ * back to walking the canonical code counts.
+ */
+struct HuffmanTable {
+    static constexpr int kFastBits = 10;
+    uint16_t fast[1 << kFastBits];  // (length << 9) | symbol, 0 if the code is longer
+    uint16_t count[16];
+    uint16_t symbol[320];
+
+    bool build(const uint8_t* lengths, int n) {
+        std::memset(count, 0, sizeof(count));
+        std::memset(fast, 0, sizeof(fast));
+        for (int s = 0; s < n; ++s) count[lengths[s]]++;
+        count[0] = 0;
+
+        int left = 1;
+        for (int len = 1; len < 16; ++len) {
+            left = (left << 1) - count[len];
+            if (left < 0) return false; // Over-subscribed
+        }
+
+        uint16_t offsets[16];
+        offsets[1] = 0;
+        for (int len = 1; len < 15; ++len) offsets[len + 1] = offsets[len] + count[len];
+        for (int s = 0; s < n; ++s) {
+            if (lengths[s] != 0) symbol[offsets[lengths[s]]++] = static_cast<uint16_t>(s);
+        }
+
+        int code = 0;
+        int index = 0;
+        for (int len = 1; len < 16; ++len) {
+            for (int k = 0; k < count[len]; ++k, ++code, ++index) {
+                if (len > kFastBits) continue;
+                int reversed = 0;
+                for (int b = 0; b < len; ++b) reversed |= ((code >> b) & 1) << (len - 1 - b);
+                for (int r = reversed; r < (1 << kFastBits); r += 1 << len) {
+                    fast[r] = static_cast<uint16_t>((len << 9) | symbol[index]);
+                }
+            }
+            code <<= 1;
+        }
+        return true;
+    }
+};
+
+/**
+ * @brief LSB-first bit reader over a byte range, padding with zeros past the end.
+ */
+struct BitReader {
+    const uint8_t* in;
+    const uint8_t* end;
+    uint64_t bits = 0;
+    int count = 0;
+    int padBytes = 0;
+
+    void refill() {
+        while (count <= 56) {
+            if (in < end) {
+                bits |= static_cast<uint64_t>(*in++) << count;
+            } else {
+                padBytes++;
+            }
+            count += 8;
+        }
+    }
+    uint32_t take(int n) {
+        if (count < n) refill();
+        uint32_t value = static_cast<uint32_t>(bits & ((1ull << n) - 1));
+        bits >>= n;
+        count -= n;
+        return value;
+    }
+    bool overran() const { return padBytes * 8 > count; }
+
+    int decode(const HuffmanTable& table) {
+        if (count < 15) refill();
+        uint16_t entry = table.fast[bits & ((1u << HuffmanTable::kFastBits) - 1)];
+        if (entry != 0) {
+            int len = entry >> 9;
+            bits >>= len;
+            count -= len;
+            return entry & 0x1FF;
+        }
+        int code = 0, first = 0, index = 0;
+        for (int len = 1; len < 16; ++len) {
+            code |= static_cast<int>(bits & 1);
+            bits >>= 1;
+            count--;
+            int n = table.count[len];
+            if (code - n < first) return table.symbol[index + (code - first)];
+            index += n;
+            first = (first + n) << 1;
+            code <<= 1;
+        }
+        return -1;
+    }
+};
+
+const uint16_t kLengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const uint8_t kLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const uint16_t kDistanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                    193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+                                    6145, 8193, 12289, 16385, 24577};
+const uint8_t kDistanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+}
+
+/**
+ * @brief Decompresses a raw deflate stream (RFC 1951), as stored in zip entries.
+ * @param data The compressed bytes.
+ * @param size Number of compressed bytes.
+ * @param expectedSize Uncompressed size, if known. It sizes the output up front and
+ *        the stream may not decode to more than this.
+ * @return The decompressed bytes.
+ * @throws std::runtime_error if the stream is corrupt, truncated or longer than expectedSize.
+ */
+std::string inflateRaw(const uint8_t* data, size_t size, size_t expectedSize) {
+    // Sizes come from untrusted headers; deflate cannot expand by more than 1032:1.
+    const size_t kMaxRatio = 1032;
+    size_t bound = size <= (SIZE_MAX - 64) / kMaxRatio ? size * kMaxRatio + 64 : SIZE_MAX;
+    std::string out;
+    out.resize(expectedSize > 0 ? std::min(expectedSize, bound) : std::min(size * 4 + 64, bound));
+    size_t outPos = 0;
+    auto ensure = [&](size_t extra) {
+        if (outPos + extra <= out.size()) return;
+        if (expectedSize > 0 && outPos + extra > expectedSize) {
+            throw std::runtime_error("deflate stream longer than its recorded size");
+        }
+        out.resize(std::max(std::min(out.size() * 2, bound), outPos + extra));
+    };
+
+    BitReader reader{data, data + size};
+    HuffmanTable literals;
+    HuffmanTable distances;
+    bool last = false;
+
+    while (!last) {
+        last = reader.take(1) != 0;
+        uint32_t type = reader.take(2);
+
+        if (type == 0) {
+            // Stored block: realign on the byte boundary that follows the header.
+            reader.take(reader.count & 7);
+            int buffered = reader.count / 8 - reader.padBytes;
+            if (buffered < 0) throw std::runtime_error("truncated deflate stream");
+            reader.in -= buffered;
+            reader.bits = 0;
+            reader.count = 0;
+            reader.padBytes = 0;
+            if (reader.end - reader.in < 4) throw std::runtime_error("truncated deflate stream");
+            uint16_t len = static_cast<uint16_t>(reader.in[0] | (reader.in[1] << 8));
+            uint16_t nlen = static_cast<uint16_t>(reader.in[2] | (reader.in[3] << 8));
+            reader.in += 4;
+            if (len != static_cast<uint16_t>(~nlen)) throw std::runtime_error("corrupt stored block");
+            if (reader.end - reader.in < len) throw std::runtime_error("truncated deflate stream");
+            ensure(len);
+            std::memcpy(&out[outPos], reader.in, len);
+            outPos += len;
+            reader.in += len;
+            continue;
+        }
+
+        if (type == 1) {
+            uint8_t lengths[320];
+            int s = 0;
+            for (; s < 144; ++s) lengths[s] = 8;
+            for (; s < 256; ++s) lengths[s] = 9;
+            for (; s < 280; ++s) lengths[s] = 7;
+            for (; s < 288; ++s) lengths[s] = 8;
+            literals.build(lengths, 288);
+            for (s = 0; s < 30; ++s) lengths[s] = 5;
+            distances.build(lengths, 30);
+        } else if (type == 2) {
+            int literalCount = static_cast<int>(reader.take(5)) + 257;
+            int distanceCount = static_cast<int>(reader.take(5)) + 1;
+            int codeLengthCount = static_cast<int>(reader.take(4)) + 4;
+            static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+            uint8_t lengths[320] = {};
+            for (int i = 0; i < codeLengthCount; ++i) lengths[order[i]] = static_cast<uint8_t>(reader.take(3));
+            HuffmanTable codeLengths;
+            if (!codeLengths.build(lengths, 19)) throw std::runtime_error("corrupt code lengths");
+
+            int total = literalCount + distanceCount;
+            int i = 0;
+            while (i < total) {
+                int sym = reader.decode(codeLengths);
+                if (sym < 0) throw std::runtime_error("corrupt code lengths");
+                if (sym < 16) {
+                    lengths[i++] = static_cast<uint8_t>(sym);
+                    continue;
+                }
+                uint8_t value = 0;
+                int repeat;
+                if (sym == 16) {
+                    if (i == 0) throw std::runtime_error("corrupt code lengths");
+                    value = lengths[i - 1];
+                    repeat = 3 + static_cast<int>(reader.take(2));
+                } else if (sym == 17) {
+                    repeat = 3 + static_cast<int>(reader.take(3));
+                } else {
+                    repeat = 11 + static_cast<int>(reader.take(7));
+                }
+                if (i + repeat > total) throw std::runtime_error("corrupt code lengths");
+                while (repeat--) lengths[i++] = value;
+            }
+            if (lengths[256] == 0) throw std::runtime_error("missing end-of-block code");
+            if (!literals.build(lengths, literalCount) || !distances.build(lengths + literalCount, distanceCount)) {
+                throw std::runtime_error("corrupt Huffman tables");
+            }
+        } else {
+            throw std::runtime_error("invalid deflate block type");
+        }
+
+        while (true) {
+            int sym = reader.decode(literals);
+            if (reader.overran()) throw std::runtime_error("truncated deflate stream"); // Decoding the zero padding
+            if (sym < 0) throw std::runtime_error("corrupt deflate data");
+            if (sym < 256) {
+                ensure(1);
+                out[outPos++] = static_cast<char>(sym);
+                continue;
+            }
+            if (sym == 256) break;
+            sym -= 257;
+            if (sym >= 29) throw std::runtime_error("corrupt deflate data");
+            size_t length = kLengthBase[sym] + reader.take(kLengthExtra[sym]);
+            int distSym = reader.decode(distances);
+            if (distSym < 0 || distSym >= 30) throw std::runtime_error("corrupt deflate data");
+            size_t distance = kDistanceBase[distSym] + reader.take(kDistanceExtra[distSym]);
+            if (distance > outPos) throw std::runtime_error("deflate distance too far back");
+            ensure(length);
+            char* dst = &out[outPos];
+            const char* src = dst - distance;
+            if (distance >= length) {
+                std::memcpy(dst, src, length);
+            } else {
+                for (size_t k = 0; k < length; ++k) dst[k] = src[k]; // Overlapping copy repeats the pattern
+            }
+            outPos += length;
+        }
+        if (reader.overran()) throw std::runtime_error("truncated deflate stream");
+    }
+
+    out.resize(outPos);
+    return out;
+}
+
+// --- Worker pools ---
+
+namespace {
+
+/**
+ * @brief Reads a cgroup v2 cpu.max file ("max 100000" or "<quota> <period>").
+ * @return The quota in CPUs, or 0 if unlimited or unreadable.
+ */
+double readCpuMax(const std::filesystem::path& file) {
+    std::ifstream in(file);
+    std::string quota;
+    double period = 0;
+    if (!(in >> quota >> period) || quota == "max" || period <= 0) return 0;
+    try {
+        return std::stod(quota) / period;
+    } catch (const std::exception& e) {
+        return 0;
+    }
+}
+
+/**
+ * @brief Reads a cgroup v1 CFS quota from cpu.cfs_quota_us and cpu.cfs_period_us.
+ * @return The quota in CPUs, or 0 if unlimited (-1) or unreadable.
+ */
+double readCfsQuota(const std::filesystem::path& dir) {
+    std::ifstream quotaIn(dir / "cpu.cfs_quota_us");
+    std::ifstream periodIn(dir / "cpu.cfs_period_us");
+    double quota = 0, period = 0;
+    if (!(quotaIn >> quota) || !(periodIn >> period) || quota <= 0 || period <= 0) return 0;
+    return quota / period;
+}
+
+/**
+ * @brief Takes the tightest limit of a cgroup and all of its ancestors up to the mount point.
+ *
+ * Inside a container the path from /proc/self/cgroup may not exist under the
+ * mount (the container sees its own cgroup as the root), so missing levels
+ * are skipped and the mount point itself is always checked.
+ */
+double tightestQuota(const std::filesystem::path& mount, const std::string& cgroupPath,
+                     const std::function<double(const std::filesystem::path&)>& read) {
+    double tightest = 0;
+    std::filesystem::path dir = (mount / std::filesystem::path(cgroupPath).relative_path()).lexically_normal();
+    for (;;) {
+        double quota = read(dir);
+        if (quota > 0 && (tightest == 0 || quota < tightest)) tightest = quota;
+        if (dir == mount || dir.parent_path() == dir || dir.string().size() <= mount.string().size()) break;
+        dir = dir.parent_path();
+    }
+    return tightest;
+}
+
+} // namespace
+
+/**
+ * @brief Finds the CPU quota the kernel enforces on this process through cgroups.
+ *
+ * Handles cgroup v2 (cpu.max on the unified hierarchy) and v1 (CFS quota on
+ * the cpu controller), including hybrid setups that mount both.
+ * @param procCgroup Normally /proc/self/cgroup.
+ * @param cgroupRoot Normally /sys/fs/cgroup.
+ * @return The quota in CPUs, or 0 if there is none.
+ */
+double cgroupCpuQuota(const std::filesystem::path& procCgroup, const std::filesystem::path& cgroupRoot) {
+    std::ifstream in(procCgroup);
+    std::string line;
+    double tightest = 0;
+    auto consider = [&](double quota) {
+        if (quota > 0 && (tightest == 0 || quota < tightest)) tightest = quota;
+    };
+    std::error_code ignored;
+    while (std::getline(in, line)) {
+        // Each line is "<id>:<controllers>:<path>"; v2 has id 0 and no controllers.
+        size_t first = line.find(':');
+        size_t second = line.find(':', first + 1);
+        if (first == std::string::npos || second == std::string::npos) continue;
+        std::string controllers = line.substr(first + 1, second - first - 1);
+        std::string path = line.substr(second + 1);
+
+        if (controllers.empty()) {
+            for (const auto& mount : {cgroupRoot, cgroupRoot / "unified"}) {
+                if (std::filesystem::exists(mount / "cgroup.controllers", ignored)) {
+                    consider(tightestQuota(mount, path, [](const std::filesystem::path& dir) {
+                        return readCpuMax(dir / "cpu.max");
+                    }));
+                    break;
+                }
+            }
+            continue;
+        }
+        std::stringstream list(controllers);
+        std::string controller;
+        bool hasCpu = false;
+        while (std::getline(list, controller, ',')) hasCpu = hasCpu || controller == "cpu";
+        if (!hasCpu) continue;
+        for (const auto& mount : {cgroupRoot / controllers, cgroupRoot / "cpu"}) {
+            if (std::filesystem::exists(mount / "cpu.cfs_period_us", ignored)) {
+                consider(tightestQuota(mount, path, readCfsQuota));
+                break;
+            }
+        }
+    }
+    return tightest;
+}
+
+/**
+ * @brief Works out, once, how many CPUs the process can use and how big its pools should be.
+ *
+ * Compression and scanning are CPU-bound, so they get one thread per usable
+ * CPU. File I/O threads spend most of their time blocked, so there are twice
+ * as many of those, within limits.
+ */
+const CpuBudget& cpuBudget() {
+    static const CpuBudget budget = [] {
+        CpuBudget b;
+        b.hardware = std::max(1u, std::thread::hardware_concurrency());
+        b.cpus = b.hardware;
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            b.affinity = static_cast<unsigned>(CPU_COUNT(&set));
+            if (b.affinity > 0) b.cpus = std::min(b.cpus, b.affinity);
+        }
+        b.quota = cgroupCpuQuota("/proc/self/cgroup", "/sys/fs/cgroup");
+        if (b.quota > 0) {
+            // A 1.5-CPU quota can keep two threads mostly busy; round up.
+            b.cpus = std::min(b.cpus, static_cast<unsigned>(std::ceil(b.quota)));
+        }
+#endif
+        b.cpus = std::max(1u, b.cpus);
+        b.computeThreads = b.cpus;
+        b.ioThreads = std::min(16u, std::max(2u, b.cpus * 2));
+        return b;
+    }();
+    return budget;
+}
+
+/**
+ * @brief Default number of worker threads for CPU-bound work.
+ */
+unsigned defaultThreadCount() {
+    return cpuBudget().computeThreads;
+}
+
+/**
+ * @brief Runs work(index) for every index in [0, count) on a pool of threads.
+ *
+ * Each thread publishes its progress in the slot "<poolName>-<n>". The first
+ * exception thrown by any item is rethrown once all threads have finished.
+ * @param count Number of work items.
+ * @param threads Maximum number of threads to use.
+ * @param poolName Prefix for the progress slots.
+ * @param work Called once per index, from any of the pool's threads.
+ */
+void parallelFor(size_t count, unsigned threads, const std::string& poolName,
+                 const std::function<void(size_t index, WorkerSlot& slot)>& work) {
+    if (count == 0) return;
+    threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, count)));
+
+    std::atomic<size_t> next{0};
+    std::atomic<long long>& pending = queueDepth(poolName);
+    pending += static_cast<long long>(count);
+    std::exception_ptr failure;
+    std::mutex failureMutex;
+    CourseStats* course = t_course; // The pool works for the caller's course
+
+    auto run = [&](unsigned n) {
+        CourseScope scope(course);
+        WorkerSlot& slot = workerSlot(poolName + "-" + std::to_string(n));
+        size_t index;
+        while ((index = next++) < count) {
+            pending--;
+            try {
+                work(index, slot);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(failureMutex);
+                if (!failure) failure = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned n = 1; n < threads; ++n) pool.emplace_back(run, n);
+    run(0);
+    for (auto& thread : pool) thread.join();
+    if (failure) std::rethrow_exception(failure);
+}
+
+// --- Directive catalog ---
+// A catalog is a single file of string tables followed by one array per column:
+//   "CUCATLG1", u64 rows,
+//   string tables: archives, entries, formats, texts (u32 count, u64 bytes, u32 lengths[], bytes),
+//   columns: archive u32[], entry u32[], offset u64[], format u32[], day i32[], text u32[].
+// Repeated strings (entry names, formats, rendered dates) are stored once, and a
+// query only touches the columns it filters on.
+
+namespace {
+const char kCatalogMagic[8] = {'C', 'U', 'C', 'A', 'T', 'L', 'G', '1'};
+const int32_t kNoDayOffset = INT32_MIN; // Directive without a day number, e.g. DateReplace(Y)
+
+/**
+ * @brief Assigns dense ids to strings, in first-seen order.
+ */
+struct StringTable {
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, uint32_t> ids;
+
+    uint32_t intern(const std::string& value) {
+        auto it = ids.find(value);
+        if (it != ids.end()) return it->second;
+        uint32_t id = static_cast<uint32_t>(strings.size());
+        strings.push_back(value);
+        ids.emplace(value, id);
+        return id;
+    }
+};
+
+struct CatalogRow {
+    uint32_t archive;
+    std::string entry;
+    uint64_t offset;
+    std::string format;
+    int32_t day;
+    std::string text;
+};
+
+template <typename T>
+void writeLE(std::ostream& out, T value) {
+    char bytes[sizeof(T)];
+    for (size_t i = 0; i < sizeof(T); ++i) bytes[i] = static_cast<char>((static_cast<uint64_t>(value) >> (8 * i)) & 0xFF);
+    out.write(bytes, sizeof(T));
+}
+
+void writeStringTable(std::ostream& out, const std::vector<std::string>& strings) {
+    uint64_t bytes = 0;
+    for (const auto& s : strings) bytes += s.size();
+    writeLE<uint32_t>(out, static_cast<uint32_t>(strings.size()));
+    writeLE<uint64_t>(out, bytes);
+    for (const auto& s : strings) writeLE<uint32_t>(out, static_cast<uint32_t>(s.size()));
+    for (const auto& s : strings) out.write(s.data(), static_cast<std::streamsize>(s.size()));
+}
+
+/**
+ * @brief Bounds-checked cursor over a loaded catalog.
+ */
+struct CatalogReader {
+    std::string_view data;
+    size_t pos = 0;
+
+    std::string_view take(size_t n) {
+        if (data.size() - pos < n) throw std::runtime_error("catalog is truncated");
+        std::string_view bytes = data.substr(pos, n);
+        pos += n;
+        return bytes;
+    }
+    uint32_t u32() { return readLE32(take(4).data()); }
+    uint64_t u64() { return readLE64(take(8).data()); }
+
+    std::vector<std::string_view> stringTable() {
+        uint32_t count = u32();
+        uint64_t bytes = u64();
+        std::string_view lengths = take(static_cast<size_t>(count) * 4);
+        std::string_view blob = take(static_cast<size_t>(bytes));
+        std::vector<std::string_view> strings(count);
+        size_t at = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            uint32_t length = readLE32(lengths.data() + 4 * i);
+            if (blob.size() - at < length) throw std::runtime_error("catalog is corrupt");
+            strings[i] = blob.substr(at, length);
+            at += length;
+        }
+        return strings;
+    }
+};
+
+/**
+ * @brief Expands the command line into archive paths, searching directories for .imscc/.zip files.
+ */
+std::vector<std::filesystem::path> collectArchives(const std::vector<std::string>& inputs) {
+    std::vector<std::filesystem::path> archives;
+    for (const auto& input : inputs) {
+        if (std::filesystem::is_directory(input)) {
+            std::vector<std::filesystem::path> found;
+            for (const auto& entry : std::filesystem::recursive_directory_iterator(input)) {
+                std::string extension = entry.path().extension().string();
+                if (entry.is_regular_file() && (extension == ".imscc" || extension == ".zip")) {
+                    found.push_back(entry.path());
+                }
+            }
+            std::sort(found.begin(), found.end());
+            archives.insert(archives.end(), found.begin(), found.end());
+        } else {
+            archives.emplace_back(input);
+        }
+    }
+    return archives;
+}
+
+std::string trimFormat(std::string format) {
+    format.erase(0, format.find_first_not_of(" \t\n\r\"_()"));
+    format.erase(format.find_last_not_of(" \t\n\r\"_()") + 1);
+    return format;
+}
+}
+
+/**
+ * @brief "index" command: scans archives in parallel and writes a directive catalog.
+ * @param argc Argument count, excluding the program and command names.
+ * @param argv Argument values.
+ * @return 0 on success, 1 on error.
+ */
+int indexCommand(int argc, char* argv[]) {
+    std::string catalogPathStr;
+    unsigned threads = defaultThreadCount();
+    std::vector<std::string> inputs;
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc) {
+            catalogPathStr = argv[++i];
+        } else if (arg == "-j" && i + 1 < argc) {
+            try {
+                threads = static_cast<unsigned>(std::max(1, std::stoi(argv[++i])));
+            } catch (const std::exception& e) {
+                std::cerr << "Error: Invalid number for -j argument." << std::endl;
+                return 1;
+            }
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+    if (catalogPathStr.empty() || inputs.empty()) {
+        std::cerr << "Usage: index -o <catalog> [-j <threads>] <archive.imscc|directory>..." << std::endl;
+        return 1;
+    }
+
+    std::vector<std::filesystem::path> archives = collectArchives(inputs);
+    std::vector<std::vector<CatalogRow>> rowsPerArchive(archives.size());
+    std::atomic<size_t> failed{0};
+    auto startTime = std::chrono::steady_clock::now();
+
+    // Archives are scanned in parallel; rows are merged afterwards in input order.
+    parallelFor(archives.size(), threads, "index", [&](size_t a, WorkerSlot& slot) {
+        WorkerActivity activity(slot, "index " + archives[a].string());
+        try {
+            ZipArchive archive(archives[a]);
+            g_stats.bytesIn += archive.data().size();
+            for (const auto& entry : archive.entries()) {
+                if (!hasTextExtension(entry.name)) continue;
+                std::string content = archive.extract(entry);
+                g_stats.entriesScanned++;
+                for (const auto& directive : findDirectives(content, archives[a].string() + ":" + entry.name)) {
+                    rowsPerArchive[a].push_back(CatalogRow{
+                        static_cast<uint32_t>(a), entry.name, directive.markerPos, directive.rawFormat,
+                        directive.hasDayOffset ? directive.dayOffset : kNoDayOffset,
+                        content.substr(directive.textBegin, directive.textEnd - directive.textBegin)});
+                }
+            }
+            g_stats.archivesProcessed++;
+        } catch (const std::exception& e) {
+            std::cerr << "Warning: Could not index '" << archives[a].string() << "': " << e.what() << std::endl;
+            failed++;
+        }
+    });
+
+    StringTable archiveNames, entryNames, formats, texts;
+    std::vector<uint32_t> archiveColumn, entryColumn, formatColumn, textColumn;
+    std::vector<uint64_t> offsetColumn;
+    std::vector<int32_t> dayColumn;
+    for (const auto& archive : archives) archiveNames.intern(archive.string());
+    for (const auto& rows : rowsPerArchive) {
+        for (const auto& row : rows) {
+            archiveColumn.push_back(row.archive);
+            entryColumn.push_back(entryNames.intern(row.entry));
+            offsetColumn.push_back(row.offset);
+            formatColumn.push_back(formats.intern(row.format));
+            dayColumn.push_back(row.day);
+            textColumn.push_back(texts.intern(row.text));
+        }
+    }
+
+    std::ofstream out(catalogPathStr, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        std::cerr << "Error: Could not write catalog '" << catalogPathStr << "'." << std::endl;
+        return 1;
+    }
+    out.write(kCatalogMagic, sizeof(kCatalogMagic));
+    writeLE<uint64_t>(out, archiveColumn.size());
+    writeStringTable(out, archiveNames.strings);
+    writeStringTable(out, entryNames.strings);
+    writeStringTable(out, formats.strings);
+    writeStringTable(out, texts.strings);
+    for (uint32_t v : archiveColumn) writeLE(out, v);
+    for (uint32_t v : entryColumn) writeLE(out, v);
+    for (uint64_t v : offsetColumn) writeLE(out, v);
+    for (uint32_t v : formatColumn) writeLE(out, v);
+    for (int32_t v : dayColumn) writeLE(out, static_cast<uint32_t>(v));
+    for (uint32_t v : textColumn) writeLE(out, v);
+    out.close();
+    if (!out) {
+        std::cerr << "Error: Could not write catalog '" << catalogPathStr << "'." << std::endl;
+        return 1;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+    std::cout << "Indexed " << archiveColumn.size() << " directives from " << (archives.size() - failed)
+              << " archives in " << elapsed.count() << "s." << std::endl;
+    return failed == 0 ? 0 : 1;
+}
+
+/**
+ * @brief "query" command: filters a directive catalog without touching the archives.
+ * @param argc Argument count, excluding the program and command names.
+ * @param argv Argument values.
+ * @return 0 on success, 1 on error.
+ */
+int queryCommand(int argc, char* argv[]) {
+    std::string catalogPathStr;
+    std::string formatFilter, archiveFilter, entryFilter, textFilter;
+    bool hasOffsetFilter = false;
+    int offsetFilter = 0;
+    bool listArchives = false;
+    bool countOnly = false;
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-offset" && i + 1 < argc) {
+            try {
+                offsetFilter = std::stoi(argv[++i]);
+                hasOffsetFilter = true;
+            } catch (const std::exception& e) {
+                std::cerr << "Error: Invalid number for -offset argument." << std::endl;
+                return 1;
+            }
+        } else if (arg == "-format" && i + 1 < argc) {
+            formatFilter = trimFormat(argv[++i]);
+        } else if (arg == "-archive" && i + 1 < argc) {
+            archiveFilter = argv[++i];
+        } else if (arg == "-entry" && i + 1 < argc) {
+            entryFilter = argv[++i];
+        } else if (arg == "-text" && i + 1 < argc) {
+            textFilter = argv[++i];
+        } else if (arg == "-archives") {
+            listArchives = true;
+        } else if (arg == "-count") {
+            countOnly = true;
+        } else {
+            catalogPathStr = arg;
+        }
+    }
+    if (catalogPathStr.empty()) {
+        std::cerr << "Usage: query <catalog> [-offset N] [-format F] [-archive S] [-entry S] [-text S] [-archives] [-count]"
+                  << std::endl;
+        return 1;
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+    try {
+        MappedFile file(catalogPathStr);
+        CatalogReader reader{file.view()};
+        if (reader.take(sizeof(kCatalogMagic)) != std::string_view(kCatalogMagic, sizeof(kCatalogMagic))) {
+            throw std::runtime_error("not a directive catalog");
+        }
+        size_t rows = static_cast<size_t>(reader.u64());
+        auto archiveNames = reader.stringTable();
+        auto entryNames = reader.stringTable();
+        auto formats = reader.stringTable();
+        auto texts = reader.stringTable();
+        const char* archiveColumn = reader.take(rows * 4).data();
+        const char* entryColumn = reader.take(rows * 4).data();
+        const char* offsetColumn = reader.take(rows * 8).data();
+        const char* formatColumn = reader.take(rows * 4).data();
+        const char* dayColumn = reader.take(rows * 4).data();
+        const char* textColumn = reader.take(rows * 4).data();
+
+        // String filters are evaluated once per distinct value, not once per row.
+        auto matchTable = [](const std::vector<std::string_view>& table, auto predicate) {
+            std::vector<char> matches(table.size());
+            for (size_t i = 0; i < table.size(); ++i) matches[i] = predicate(table[i]);
+            return matches;
+        };
+        auto contains = [](const std::string& needle) {
+            return [needle](std::string_view value) { return value.find(needle) != std::string_view::npos; };
+        };
+        auto archiveOk = matchTable(archiveNames, contains(archiveFilter));
+        auto entryOk = matchTable(entryNames, contains(entryFilter));
+        auto textOk = matchTable(texts, contains(textFilter));
+        auto formatOk = matchTable(formats, [&](std::string_view value) {
+            return formatFilter.empty() || trimFormat(std::string(value)) == formatFilter;
+        });
+
+        size_t matched = 0;
+        std::vector<char> archiveMatched(archiveNames.size());
+        std::ostringstream out;
+        for (size_t r = 0; r < rows; ++r) {
+            int32_t day = static_cast<int32_t>(readLE32(dayColumn + 4 * r));
+            if (hasOffsetFilter && day != offsetFilter) continue;
+            uint32_t archive = readLE32(archiveColumn + 4 * r);
+            uint32_t entry = readLE32(entryColumn + 4 * r);
+            uint32_t format = readLE32(formatColumn + 4 * r);
+            uint32_t text = readLE32(textColumn + 4 * r);
+            if (archive >= archiveOk.size() || entry >= entryOk.size() || format >= formatOk.size() ||
+                text >= textOk.size()) {
+                throw std::runtime_error("catalog is corrupt");
+            }
+            if (!archiveOk[archive] || !entryOk[entry] || !formatOk[format] || !textOk[text]) continue;
+
+            matched++;
+            if (countOnly) continue;
+            if (listArchives) {
+                if (!archiveMatched[archive]) out << archiveNames[archive] << "\n";
+                archiveMatched[archive] = 1;
+                continue;
+            }
+            out << archiveNames[archive] << "\t" << entryNames[entry] << "\t" << readLE64(offsetColumn + 8 * r)
+                << "\t" << formats[format] << "\t";
+            if (day == kNoDayOffset) out << "-";
+            else out << day;
+            out << "\t" << texts[text] << "\n";
+        }
+        std::cout << out.str();
+        if (countOnly) std::cout << matched << std::endl;
+
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - startTime;
+        std::cerr << matched << " of " << rows << " directives matched in " << elapsed.count() << " ms." << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Could not read catalog '" << catalogPathStr << "': " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// --- Archive diff ---
+
+namespace {
+/**
+ * @brief Pairs up the directives of two versions of an entry by their arguments.
+ *
+ * Uses a longest-common-subsequence alignment so an inserted or removed
+ * directive does not shift every pairing after it.
+ * @return Index pairs; -1 on one side marks a directive only present on the other.
+ */
+std::vector<std::pair<long, long>> alignDirectives(const std::vector<Directive>& before,
+                                                   const std::vector<Directive>& after) {
+    size_t n = before.size(), m = after.size();
+    std::vector<std::pair<long, long>> pairs;
+    if (n * m > 4000000) {
+        // Too large to align; compare position by position instead.
+        for (size_t i = 0; i < std::max(n, m); ++i) {
+            pairs.emplace_back(i < n ? static_cast<long>(i) : -1, i < m ? static_cast<long>(i) : -1);
+        }
+        return pairs;
+    }
+    std::vector<std::vector<uint32_t>> lcs(n + 1, std::vector<uint32_t>(m + 1, 0));
+    for (size_t i = n; i-- > 0;) {
+        for (size_t j = m; j-- > 0;) {
+            lcs[i][j] = before[i].args == after[j].args ? lcs[i + 1][j + 1] + 1 : std::max(lcs[i + 1][j], lcs[i][j + 1]);
+        }
+    }
+    size_t i = 0, j = 0;
+    while (i < n || j < m) {
+        if (i < n && j < m && before[i].args == after[j].args) {
+            pairs.emplace_back(static_cast<long>(i++), static_cast<long>(j++));
+        } else if (j < m && (i == n || lcs[i][j + 1] >= lcs[i + 1][j])) {
+            pairs.emplace_back(-1, static_cast<long>(j++));
+        } else {
+            pairs.emplace_back(static_cast<long>(i++), -1);
+        }
+    }
+    return pairs;
+}
+
+/**
+ * @brief Returns the content with every directive's date text removed.
+ */
+std::string withoutDirectiveText(const std::string& content, const std::vector<Directive>& directives) {
+    std::string rest;
+    rest.reserve(content.size());
+    size_t copiedUpTo = 0;
+    for (const auto& directive : directives) {
+        rest.append(content, copiedUpTo, directive.textBegin - copiedUpTo);
+        copiedUpTo = directive.textEnd;
+    }
+    rest.append(content, copiedUpTo, std::string::npos);
+    return rest;
+}
+}
+
+/**
+ * @brief "diff" command: compares two archives through their central directories.
+ *
+ * Entries whose CRC-32 and sizes match are treated as unchanged without being
+ * read. Only changed text entries are inflated, and those are reported at the
+ * level of individual DateReplace directives.
+ * @param argc Argument count, excluding the program and command names.
+ * @param argv Argument values.
+ * @return 0 on success, 1 on error.
+ */
+int diffCommand(int argc, char* argv[]) {
+    if (argc != 2) {
+        std::cerr << "Usage: diff <old.imscc> <new.imscc>" << std::endl;
+        return 1;
+    }
+    auto startTime = std::chrono::steady_clock::now();
+    try {
+        ZipArchive before(argv[0]);
+        ZipArchive after(argv[1]);
+
+        std::unordered_map<std::string, const ZipEntry*> beforeByName;
+        for (const auto& entry : before.entries()) beforeByName[entry.name] = &entry;
+
+        size_t added = 0, removed = 0, changed = 0, unchanged = 0, inflated = 0;
+        std::ostringstream out;
+        out << "--- " << argv[0] << "\n+++ " << argv[1] << "\n";
+
+        for (const auto& entry : after.entries()) {
+            auto it = beforeByName.find(entry.name);
+            if (it == beforeByName.end()) {
+                out << "A " << entry.name << " (" << entry.uncompressedSize << " bytes)\n";
+                added++;
+                continue;
+            }
+            const ZipEntry& old = *it->second;
+            beforeByName.erase(it);
+            if (old.crc32 == entry.crc32 && old.uncompressedSize == entry.uncompressedSize) {
+                unchanged++;
+                continue;
+            }
+
+            changed++;
+            out << "M " << entry.name << " (" << old.uncompressedSize << " -> " << entry.uncompressedSize << " bytes)\n";
+            if (!hasTextExtension(entry.name)) continue;
+
+            std::string oldContent = before.extract(old);
+            std::string newContent = after.extract(entry);
+            inflated += 2;
+            std::vector<Directive> oldDirectives = findDirectives(oldContent, std::string(argv[0]) + ":" + entry.name);
+            std::vector<Directive> newDirectives = findDirectives(newContent, std::string(argv[1]) + ":" + entry.name);
+
+            for (const auto& pair : alignDirectives(oldDirectives, newDirectives)) {
+                const Directive* o = pair.first >= 0 ? &oldDirectives[pair.first] : nullptr;
+                const Directive* n = pair.second >= 0 ? &newDirectives[pair.second] : nullptr;
+                auto text = [](const std::string& content, const Directive& d) {
+                    return content.substr(d.textBegin, d.textEnd - d.textBegin);
+                };
+                if (o && n) {
+                    std::string oldText = text(oldContent, *o), newText = text(newContent, *n);
+                    if (oldText == newText) continue;
+                    out << "    @" << n->markerPos << " DateReplace(" << n->args << "): \"" << oldText
+                        << "\" -> \"" << newText << "\"\n";
+                } else if (o) {
+                    out << "    - @" << o->markerPos << " DateReplace(" << o->args << "): \"" << text(oldContent, *o) << "\"\n";
+                } else {
+                    out << "    + @" << n->markerPos << " DateReplace(" << n->args << "): \"" << text(newContent, *n) << "\"\n";
+                }
+            }
+            if (withoutDirectiveText(oldContent, oldDirectives) != withoutDirectiveText(newContent, newDirectives)) {
+                out << "    (content outside directives also changed)\n";
+            }
+        }
+        for (const auto& leftover : before.entries()) {
+            if (beforeByName.count(leftover.name)) {
+                out << "D " << leftover.name << "\n";
+                removed++;
+            }
+        }
+
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - startTime;
+        std::cout << out.str() << (unchanged + changed + added) << " entries compared: " << changed << " changed, "
+                  << added << " added, " << removed << " removed, " << unchanged << " unchanged; " << inflated
+                  << " entries inflated in " << elapsed.count() << " ms." << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Could not compare archives: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// --- Archive writing ---
+
+namespace {
+void appendLE16(std::string& out, uint16_t value) {
+    out += static_cast<char>(value & 0xFF);
+    out += static_cast<char>(value >> 8);
+}
+
+void appendLE32(std::string& out, uint32_t value) {
+    appendLE16(out, static_cast<uint16_t>(value & 0xFFFF));
+    appendLE16(out, static_cast<uint16_t>(value >> 16));
+}
+
+void appendLE64(std::string& out, uint64_t value) {
+    appendLE32(out, static_cast<uint32_t>(value & 0xFFFFFFFF));
+    appendLE32(out, static_cast<uint32_t>(value >> 32));
+}
+
+uint32_t clamp32(uint64_t value) {
+    return value >= 0xFFFFFFFF ? 0xFFFFFFFF : static_cast<uint32_t>(value);
+}
+}
+
+void ZipWriter::write(const std::string& bytes) {
+    out_.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    offset_ += bytes.size();
+}
+
+/**
+ * @brief Appends an entry whose compressed bytes are already known, copying them verbatim.
+ * @param entry Metadata of the entry; crc32, sizes and method must describe the bytes.
+ * @param compressed The compressed payload.
+ */
+void ZipWriter::addRaw(const ZipEntry& entry, std::string_view compressed) {
+    ZipEntry written = entry;
+    write(localHeader(written, offset_, compressed.size()));
+    out_.write(compressed.data(), static_cast<std::streamsize>(compressed.size()));
+    offset_ += compressed.size();
+    written_.push_back(std::move(written));
+}
+
+/**
+ * @brief Builds the local header for an entry about to be written.
+ * @param entry Metadata of the entry; its offset, compressed size and flags are updated.
+ * @param offset Archive offset at which the header will be written.
+ * @param compressedSize Size of the payload that follows the header.
+ * @return The header bytes.
+ */
+std::string ZipWriter::localHeader(ZipEntry& entry, uint64_t offset, uint64_t compressedSize) {
+    entry.localHeaderOffset = offset;
+    entry.compressedSize = compressedSize;
+    entry.flags &= ~0x0008; // Sizes are in the local header, so no data descriptor follows
+
+    bool zip64 = entry.compressedSize >= 0xFFFFFFFF || entry.uncompressedSize >= 0xFFFFFFFF;
+    std::string header;
+    appendLE32(header, 0x04034b50);
+    appendLE16(header, zip64 ? 45 : 20);
+    appendLE16(header, entry.flags);
+    appendLE16(header, entry.method);
+    appendLE16(header, entry.modTime);
+    appendLE16(header, entry.modDate);
+    appendLE32(header, entry.crc32);
+    appendLE32(header, zip64 ? 0xFFFFFFFF : static_cast<uint32_t>(entry.compressedSize));
+    appendLE32(header, zip64 ? 0xFFFFFFFF : static_cast<uint32_t>(entry.uncompressedSize));
+    appendLE16(header, static_cast<uint16_t>(entry.name.size()));
+    appendLE16(header, zip64 ? 20 : 0);
+    header += entry.name;
+    if (zip64) {
+        appendLE16(header, 0x0001);
+        appendLE16(header, 16);
+        appendLE64(header, entry.uncompressedSize);
+        appendLE64(header, entry.compressedSize);
+    }
+    return header;
+}
+
+/**
+ * @brief Appends an entry stored without compression.
+ * @param entry Metadata of the entry; crc32, sizes and method are filled in here.
+ * @param content The uncompressed content.
+ */
+void ZipWriter::addStored(ZipEntry entry, std::string_view content) {
+    entry.method = 0;
+    entry.crc32 = crc32Update(0, content.data(), content.size());
+    entry.uncompressedSize = content.size();
+    addRaw(entry, content);
+}
+
+/**
+ * @brief Writes the central directory and end records. No entries may be added afterwards.
+ */
+void ZipWriter::finish() {
+    write(centralDirectory(written_, offset_));
+    out_.flush();
+}
+
+/**
+ * @brief Builds the central directory and end records for written entries.
+ * @param entries The entries, with their local header offsets, in archive order.
+ * @param cdOffset Archive offset at which the central directory will be written.
+ * @return The bytes that end the archive.
+ */
+std::string ZipWriter::centralDirectory(const std::vector<ZipEntry>& entries, uint64_t cdOffset) {
+    std::string directory;
+    for (const auto& entry : entries) {
+        std::string extra;
+        if (entry.uncompressedSize >= 0xFFFFFFFF) appendLE64(extra, entry.uncompressedSize);
+        if (entry.compressedSize >= 0xFFFFFFFF) appendLE64(extra, entry.compressedSize);
+        if (entry.localHeaderOffset >= 0xFFFFFFFF) appendLE64(extra, entry.localHeaderOffset);
+        if (!extra.empty()) {
+            std::string field;
+            appendLE16(field, 0x0001);
+            appendLE16(field, static_cast<uint16_t>(extra.size()));
+            extra = field + extra;
+        }
+
+        appendLE32(directory, 0x02014b50);
+        appendLE16(directory, entry.versionMadeBy != 0 ? entry.versionMadeBy : 20);
+        appendLE16(directory, extra.empty() ? 20 : 45);
+        appendLE16(directory, entry.flags);
+        appendLE16(directory, entry.method);
+        appendLE16(directory, entry.modTime);
+        appendLE16(directory, entry.modDate);
+        appendLE32(directory, entry.crc32);
+        appendLE32(directory, clamp32(entry.compressedSize));
+        appendLE32(directory, clamp32(entry.uncompressedSize));
+        appendLE16(directory, static_cast<uint16_t>(entry.name.size()));
+        appendLE16(directory, static_cast<uint16_t>(extra.size()));
+        appendLE16(directory, 0); // Comment length
+        appendLE16(directory, 0); // Disk number
+        appendLE16(directory, 0); // Internal attributes
+        appendLE32(directory, entry.externalAttributes);
+        appendLE32(directory, clamp32(entry.localHeaderOffset));
+        directory += entry.name;
+        directory += extra;
+    }
+    uint64_t cdSize = directory.size();
+    uint64_t endOffset = cdOffset + cdSize;
+
+    bool zip64 = entries.size() >= 0xFFFF || cdOffset >= 0xFFFFFFFF || cdSize >= 0xFFFFFFFF;
+    if (zip64) {
+        appendLE32(directory, 0x06064b50);
+        appendLE64(directory, 44); // Size of the rest of this record
+        appendLE16(directory, 45);
+        appendLE16(directory, 45);
+        appendLE32(directory, 0);
+        appendLE32(directory, 0);
+        appendLE64(directory, entries.size());
+        appendLE64(directory, entries.size());
+        appendLE64(directory, cdSize);
+        appendLE64(directory, cdOffset);
+        appendLE32(directory, 0x07064b50);
+        appendLE32(directory, 0);
+        appendLE64(directory, endOffset);
+        appendLE32(directory, 1);
+    }
+    appendLE32(directory, 0x06054b50);
+    appendLE16(directory, 0);
+    appendLE16(directory, 0);
+    appendLE16(directory, static_cast<uint16_t>(std::min<size_t>(entries.size(), 0xFFFF)));
+    appendLE16(directory, static_cast<uint16_t>(std::min<size_t>(entries.size(), 0xFFFF)));
+    appendLE32(directory, clamp32(cdSize));
+    appendLE32(directory, clamp32(cdOffset));
+    appendLE16(directory, 0); // Comment length
+    return directory;
+}
+
+// --- Content-addressed blob store ---
+
+/**
+ * @brief Computes the SHA-256 digest of some bytes.
+ * @return The digest as 64 lowercase hex digits.
+ */
+std::string sha256Hex(std::string_view data) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+
+    auto compress = [&](const unsigned char* block) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (static_cast<uint32_t>(block[4 * i]) << 24) | (block[4 * i + 1] << 16) | (block[4 * i + 2] << 8) |
+                   block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    };
+
+    const auto* p = reinterpret_cast<const unsigned char*>(data.data());
+    size_t full = data.size() / 64;
+    for (size_t i = 0; i < full; ++i) compress(p + 64 * i);
+
+    // Final block(s): the remaining bytes, a 1 bit, zero padding and the bit length.
+    unsigned char tail[128] = {};
+    size_t rest = data.size() - full * 64;
+    std::memcpy(tail, p + full * 64, rest);
+    tail[rest] = 0x80;
+    size_t tailSize = rest < 56 ? 64 : 128;
+    uint64_t bitLength = static_cast<uint64_t>(data.size()) * 8;
+    for (int i = 0; i < 8; ++i) tail[tailSize - 1 - i] = static_cast<unsigned char>(bitLength >> (8 * i));
+    compress(tail);
+    if (tailSize == 128) compress(tail + 64);
+
+    std::ostringstream hex;
+    for (uint32_t word : h) hex << std::hex << std::setw(8) << std::setfill('0') << word;
+    return hex.str();
+}
+
+std::filesystem::path BlobStore::pathFor(const std::string& hash) const {
+    return root_ / hash.substr(0, 2) / hash;
+}
+
+/**
+ * @brief Adds a blob to the store unless an identical one is already there.
+ * @param data The blob's bytes.
+ * @param hash Receives the blob's hash.
+ * @return True if the blob was new, false if it was already stored.
+ */
+bool BlobStore::put(std::string_view data, std::string& hash) const {
+    hash = sha256Hex(data);
+    std::filesystem::path path = pathFor(hash);
+    if (std::filesystem::exists(path)) return false;
+
+    // Write under a unique temporary name and rename it into place, so concurrent
+    // writers of the same blob never expose a partial file.
+    std::filesystem::create_directories(path.parent_path());
+    std::ostringstream tmpName;
+    tmpName << hash << ".tmp." << std::this_thread::get_id() << "." << std::chrono::steady_clock::now().time_since_epoch().count();
+    std::filesystem::path tmpPath = path.parent_path() / tmpName.str();
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        if (!out) {
+            throw std::runtime_error("could not write blob '" + tmpPath.string() + "'");
+        }
+    }
+    std::filesystem::rename(tmpPath, path);
+    return true;
+}
+
+std::unique_ptr<MappedFile> BlobStore::get(const std::string& hash) const {
+    return std::make_unique<MappedFile>(pathFor(hash));
+}
+
+/**
+ * @brief Reads a manifest written by writeManifest().
+ *
+ * One tab-separated line per entry: hash, method, crc32, compressed size,
+ * uncompressed size, DOS time, DOS date, external attributes, version made by,
+ * flags and finally the entry name. Throws std::runtime_error if malformed.
+ */
+std::vector<ManifestEntry> readManifest(const std::filesystem::path& manifestPath) {
+    std::ifstream in(manifestPath, std::ios::binary);
+    std::string line;
+    if (!in || !std::getline(in, line) || line != "canvasupdater-manifest 1") {
+        throw std::runtime_error("'" + manifestPath.string() + "' is not a manifest");
+    }
+    std::vector<ManifestEntry> entries;
+    while (std::getline(in, line)) {
+        if (line.empty()) continue;
+        std::istringstream fields(line);
+        ManifestEntry item;
+        ZipEntry& e = item.entry;
+        fields >> item.hash >> e.method >> std::hex >> e.crc32 >> std::dec >> e.compressedSize >> e.uncompressedSize
+               >> e.modTime >> e.modDate >> e.externalAttributes >> e.versionMadeBy >> e.flags;
+        if (!fields || fields.get() != '\t' || item.hash.size() != 64) {
+            throw std::runtime_error("malformed manifest line: " + line);
+        }
+        std::getline(fields, e.name);
+        entries.push_back(std::move(item));
+    }
+    return entries;
+}
+
+/**
+ * @brief Writes a manifest describing an archive in terms of blobs.
+ * @return True if the file was written, false otherwise.
+ */
+bool writeManifest(const std::filesystem::path& manifestPath, const std::vector<ManifestEntry>& entries) {
+    std::ofstream out(manifestPath, std::ios::binary | std::ios::trunc);
+    if (!out) return false;
+    out << "canvasupdater-manifest 1\n";
+    for (const auto& item : entries) {
+        const ZipEntry& e = item.entry;
+        out << item.hash << '\t' << e.method << '\t' << std::hex << std::setw(8) << std::setfill('0') << e.crc32
+            << std::dec << '\t' << e.compressedSize << '\t' << e.uncompressedSize << '\t' << e.modTime << '\t'
+            << e.modDate << '\t' << e.externalAttributes << '\t' << e.versionMadeBy << '\t' << e.flags << '\t'
+            << e.name << '\n';
+    }
+    return static_cast<bool>(out);
+}
+
+/**
+ * @brief Rewrites the dates of a manifest-described archive.
+ *
+ * Only text entries are read from the store. Entries that change are stored
+ * as new blobs; everything else keeps pointing at the existing blobs.
+ * @param manifestIn The manifest to read.
+ * @param manifestOut The manifest to write.
+ * @param blobs The blob store both manifests refer to.
+ * @param options Start date, index and compression level.
+ * @return True on success, false otherwise.
+ */
+bool rewriteManifest(const std::filesystem::path& manifestIn, const std::filesystem::path& manifestOut,
+                     const BlobStore& blobs, const RewriteOptions& options) {
+    try {
+        std::vector<ManifestEntry> entries = readManifest(manifestIn);
+        for (auto& item : entries) {
+            ZipEntry& entry = item.entry;
+            if (!hasTextExtension(entry.name) || (entry.method != 0 && entry.method != 8)) continue;
+
+            auto blob = blobs.get(item.hash);
+            g_stats.bytesIn += blob->view().size();
+            std::string content = decompressEntry(entry, blob->view());
+            std::unique_ptr<PackedEntry> packed = rewriteEntry(entry, content, manifestIn.string() + ":" + entry.name, options);
+            if (!packed) continue;
+
+            entry = packed->entry;
+            if (blobs.put(packed->data, item.hash)) g_stats.bytesOut += packed->data.size();
+        }
+        if (!writeManifest(manifestOut, entries)) {
+            std::cerr << "Error: Could not write manifest '" << manifestOut.string() << "'." << std::endl;
+            return false;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Could not rewrite manifest: " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief "store" command: moves archives into the blob store and writes a manifest for each.
+ * @param argc Argument count, excluding the program and command names.
+ * @param argv Argument values.
+ * @return 0 on success, 1 on error.
+ */
+int storeCommand(int argc, char* argv[]) {
+    std::string blobDirStr, manifestPathStr;
+    std::vector<std::string> inputs;
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-blobs" && i + 1 < argc) {
+            blobDirStr = argv[++i];
+        } else if (arg == "-o" && i + 1 < argc) {
+            manifestPathStr = argv[++i];
+        } else {
+            inputs.push_back(arg);
+        }
+    }
+    if (blobDirStr.empty() || inputs.empty() || (!manifestPathStr.empty() && inputs.size() != 1)) {
+        std::cerr << "Usage: store -blobs <dir> [-o <manifest>] <archive.imscc>...  (-o needs a single archive)" << std::endl;
+        return 1;
+    }
+
+    BlobStore blobs(blobDirStr);
+    uint64_t newBytes = 0, sharedBytes = 0;
+    size_t newBlobs = 0, sharedBlobs = 0;
+    for (const auto& input : inputs) {
+        try {
+            ZipArchive archive(input);
+            std::vector<ManifestEntry> entries;
+            for (const auto& entry : archive.entries()) {
+                ManifestEntry item{entry, ""};
+                std::string_view payload = archive.compressedData(entry);
+                if (blobs.put(payload, item.hash)) {
+                    newBlobs++;
+                    newBytes += payload.size();
+                } else {
+                    sharedBlobs++;
+                    sharedBytes += payload.size();
+                }
+                entries.push_back(std::move(item));
+            }
+            std::filesystem::path manifestPath = manifestPathStr.empty()
+                ? std::filesystem::path(input).replace_extension(".manifest")
+                : std::filesystem::path(manifestPathStr);
+            if (!writeManifest(manifestPath, entries)) {
+                std::cerr << "Error: Could not write manifest '" << manifestPath.string() << "'." << std::endl;
+                return 1;
+            }
+            std::cout << "Stored '" << input << "' as '" << manifestPath.string() << "'" << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: Could not store '" << input << "': " << e.what() << std::endl;
+            return 1;
+        }
+    }
+    std::cout << newBlobs << " new blobs (" << newBytes << " bytes), " << sharedBlobs
+              << " already stored (" << sharedBytes << " bytes)." << std::endl;
+    return 0;
+}
+
+/**
+ * @brief "rebuild" command: assembles a full archive from a manifest by copying compressed blobs.
+ * @param argc Argument count, excluding the program and command names.
+ * @param argv Argument values.
+ * @return 0 on success, 1 on error.
+ */
+int rebuildCommand(int argc, char* argv[]) {
+    std::string blobDirStr, manifestPathStr, outputPathStr;
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-blobs" && i + 1 < argc) {
+            blobDirStr = argv[++i];
+        } else if (arg == "-o" && i + 1 < argc) {
+            outputPathStr = argv[++i];
+        } else {
+            manifestPathStr = arg;
+        }
+    }
+    if (blobDirStr.empty() || manifestPathStr.empty() || outputPathStr.empty()) {
+        std::cerr << "Usage: rebuild -blobs <dir> <manifest> -o <archive.imscc>" << std::endl;
+        return 1;
+    }
+
+    try {
+        BlobStore blobs(blobDirStr);
+        std::vector<ManifestEntry> entries = readManifest(manifestPathStr);
+        std::ofstream out(outputPathStr, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error("could not create '" + outputPathStr + "'");
+        }
+        ZipWriter writer(out);
+        for (const auto& item : entries) {
+            auto blob = blobs.get(item.hash);
+            if (blob->view().size() != item.entry.compressedSize) {
+                throw std::runtime_error("blob for '" + item.entry.name + "' has the wrong size");
+            }
+            writer.addRaw(item.entry, blob->view());
+        }
+        writer.finish();
+        if (!out) {
+            throw std::runtime_error("could not write '" + outputPathStr + "'");
+        }
+        std::cout << "Successfully created new archive at '" << outputPathStr << "'" << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Could not rebuild archive: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// --- Transformation stages ---
+// A stage registers the markers it cares about and is handed every place one
+// occurs in a text entry, as a view of the buffer the directive scan already
+// has. It answers with edits against that same buffer; the edits of all
+// stages and the rendered dates are then spliced in one pass. Stages are
+// built in, or loaded from a shared object that exports
+//
+//     extern "C" const CanvasUpdaterStage* canvasupdater_stage(void);
+//
+// The C struct keeps plugins independent of this file's C++ types.
+
+extern "C" {
+struct CanvasUpdaterStage {
+    int version;                // kStageApiVersion
+    const char* name;
+    const char* const* markers; // Null-terminated
+    // Called for each marker occurrence, from any worker thread. The content
+    // is only valid during the call; edits are reported through edit(sink, ...).
+    void (*match)(const char* content, size_t size, size_t markerPos, size_t markerIndex, const char* where,
+                  void (*edit)(void* sink, size_t begin, size_t end, const char* text, size_t textSize),
+                  void* sink);
+};
+}
+
+const int kStageApiVersion = 1;
+
+class Stage {
+public:
+    virtual ~Stage() = default;
+    virtual std::string name() const = 0;
+    virtual std::vector<std::string> markers() const = 0;
+
+    /**
+     * @brief Handles one occurrence of one of this stage's markers.
+     *
+     * Called from the directive scan as it passes each marker. Large buffers are scanned
+     * in parallel stretches, so calls for one buffer may come from several threads.
+     * @param content The whole entry, unchanged by other stages.
+     * @param markerPos Offset of the marker in it.
+     * @param markerIndex Which of markers() matched.
+     * @param where Name of the file or entry, for warnings.
+     * @param edits Receives the stage's edits.
+     */
+    virtual void match(std::string_view content, size_t markerPos, size_t markerIndex, const std::string& where,
+                       std::vector<StageEdit>& edits) const = 0;
+};
+
+// Every stage, and its markers sorted for the scan.
+struct StagePipeline {
+    std::vector<std::unique_ptr<Stage>> stages;
+    struct Marker {
+        std::string text;
+        const Stage* stage;
+        size_t index; // In the stage's markers()
+    };
+    std::vector<Marker> markers;
+    std::string firstBytes; // First byte of every marker, for find_first_of()
+};
+
+namespace {
+
+/**
+ * @brief Gives images without an alt attribute an empty one, marking them decorative.
+ *
+ * Canvas flags such images in its accessibility checker; an empty alt is
+ * the correct markup for the diagrams and dividers in our templates.
+ */
+class ImageAltStage : public Stage {
+public:
+    std::string name() const override { return "img-alt"; }
+    std::vector<std::string> markers() const override { return {"<img"}; }
+
+    void match(std::string_view content, size_t markerPos, size_t, const std::string&,
+               std::vector<StageEdit>& edits) const override {
+        size_t nameEnd = markerPos + 4;
+        if (nameEnd >= content.size() || !(std::isspace(static_cast<unsigned char>(content[nameEnd])) ||
+                                           content[nameEnd] == '>' || content[nameEnd] == '/')) {
+            return; // <imgfoo>, not an image
+        }
+        size_t tagEnd = content.find('>', nameEnd);
+        if (tagEnd == std::string_view::npos) return;
+        std::string tag(content.substr(nameEnd, tagEnd - nameEnd));
+        std::transform(tag.begin(), tag.end(), tag.begin(), [](unsigned char c) { return std::tolower(c); });
+        for (size_t at = tag.find("alt"); at != std::string::npos; at = tag.find("alt", at + 1)) {
+            size_t after = tag.find_first_not_of(" \t\r\n", at + 3);
+            bool attribute = at > 0 && std::isspace(static_cast<unsigned char>(tag[at - 1]));
+            if (attribute && (after == std::string::npos || tag[after] == '=' || tag[after] == '/')) return;
+        }
+        edits.push_back({nameEnd, nameEnd, " alt=\"\""});
+    }
+};
+
+/**
+ * @brief Rewrites course, file, assignment, quiz and module IDs in Canvas links.
+ *
+ * When a course shell is copied, links such as /courses/12345/files/678/preview
+ * still point at the old course. The mapping file has one "kind old new"
+ * line per ID, e.g. "course 12345 67890" or "file 678 910"; '#' starts a
+ * comment. Each ID after a matching path segment is looked up in a hash
+ * map for its kind and replaced if it is mapped.
+ */
+class LinkStage : public Stage {
+public:
+    /**
+     * @brief Reads a mapping file.
+     * @return The stage, or null after printing an error.
+     */
+    static std::unique_ptr<LinkStage> load(const std::filesystem::path& mappingPath) {
+        std::ifstream in(mappingPath);
+        if (!in) {
+            std::cerr << "Error: Could not open link mapping '" << mappingPath.string() << "'." << std::endl;
+            return nullptr;
+        }
+        auto stage = std::make_unique<LinkStage>();
+        std::string line;
+        for (int lineNumber = 1; std::getline(in, line); ++lineNumber) {
+            line = line.substr(0, line.find('#'));
+            std::istringstream fields(line);
+            std::string kind, oldId, newId, extra;
+            if (!(fields >> kind)) continue;
+            auto segment = std::find(kSegments.begin(), kSegments.end(), kind);
+            uint64_t oldValue = 0;
+            if (segment == kSegments.end() || !(fields >> oldId >> newId) || (fields >> extra) ||
+                !parseId(oldId, oldValue) || newId.find_first_not_of("0123456789") != std::string::npos) {
+                std::cerr << "Error: Invalid line " << lineNumber << " in link mapping '" << mappingPath.string()
+                          << "' (expected \"course|file|assignment|quiz|module <old id> <new id>\")." << std::endl;
+                return nullptr;
+            }
+            stage->ids_[segment - kSegments.begin()][oldValue] = newId;
+        }
+        return stage;
+    }
+
+    std::string name() const override { return "links"; }
+
+    std::vector<std::string> markers() const override {
+        std::vector<std::string> markers;
+        for (const char* kind : kSegments) markers.push_back(std::string("/") + kind + "s/");
+        markers[kQuiz] = "/quizzes/";
+        return markers;
+    }
+
+    void match(std::string_view content, size_t markerPos, size_t markerIndex, const std::string&,
+               std::vector<StageEdit>& edits) const override {
+        const auto& ids = ids_[markerIndex];
+        if (ids.empty()) return;
+        size_t begin = content.find('/', markerPos + 1) + 1;
+        size_t end = begin;
+        while (end < content.size() && end - begin < 20 && content[end] >= '0' && content[end] <= '9') ++end;
+        uint64_t id = 0;
+        if (!parseId(content.substr(begin, end - begin), id)) return;
+        auto mapped = ids.find(id);
+        if (mapped != ids.end()) edits.push_back({begin, end, mapped->second});
+    }
+
+private:
+    static constexpr std::array<const char*, 5> kSegments = {"course", "file", "assignment", "quiz", "module"};
+    static constexpr size_t kQuiz = 3;
+
+    static bool parseId(std::string_view text, uint64_t& id) {
+        if (text.empty() || text.size() > 19) return false;
+        id = 0;
+        for (char c : text) {
+            if (c < '0' || c > '9') return false;
+            id = id * 10 + static_cast<uint64_t>(c - '0');
+        }
+        return true;
+    }
+
+    std::array<std::unordered_map<uint64_t, std::string>, kSegments.size()> ids_;
+};
+
+/**
+ * @brief Adapts a stage loaded from a shared object.
+ *
+ * The library stays loaded until the process exits, as stages live as long
+ * as the run.
+ */
+class PluginStage : public Stage {
+public:
+    explicit PluginStage(const CanvasUpdaterStage* api) : api_(api) {}
+
+    std::string name() const override { return api_->name ? api_->name : "plugin"; }
+
+    std::vector<std::string> markers() const override {
+        std::vector<std::string> markers;
+        for (const char* const* marker = api_->markers; marker && *marker; ++marker) markers.emplace_back(*marker);
+        return markers;
+    }
+
+    void match(std::string_view content, size_t markerPos, size_t markerIndex, const std::string& where,
+               std::vector<StageEdit>& edits) const override {
+        auto edit = [](void* sink, size_t begin, size_t end, const char* text, size_t textSize) {
+            static_cast<std::vector<StageEdit>*>(sink)->push_back({begin, end, std::string(text, textSize)});
+        };
+        api_->match(content.data(), content.size(), markerPos, markerIndex, where.c_str(), edit, &edits);
+    }
+
+private:
+    const CanvasUpdaterStage* api_;
+};
+
+/**
+ * @brief Creates a built-in stage by name, or loads one from a shared object.
+ * @param spec "img-alt", "links=<mapping file>", or a path to a .so.
+ * @return The stage, or null after printing an error.
+ */
+std::unique_ptr<Stage> makeStage(const std::string& spec) {
+    if (spec == "img-alt") return std::make_unique<ImageAltStage>();
+    if (spec.rfind("links=", 0) == 0) return LinkStage::load(spec.substr(6));
+    if (spec.find('/') == std::string::npos && spec.find(".so") == std::string::npos) {
+        std::cerr << "Error: Unknown stage '" << spec << "' (built in: img-alt, links=<mapping>; or give a path to a .so)."
+                  << std::endl;
+        return nullptr;
+    }
+#ifndef _WIN32
+    void* library = dlopen(spec.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!library) {
+        std::cerr << "Error: Could not load stage '" << spec << "': " << dlerror() << std::endl;
+        return nullptr;
+    }
+    using EntryPoint = const CanvasUpdaterStage* (*)();
+    auto entryPoint = reinterpret_cast<EntryPoint>(dlsym(library, "canvasupdater_stage"));
+    const CanvasUpdaterStage* api = entryPoint ? entryPoint() : nullptr;
+    if (!api || api->version != kStageApiVersion || !api->match) {
+        std::cerr << "Error: '" << spec << "' does not export a version " << kStageApiVersion
+                  << " canvasupdater_stage()." << std::endl;
+        dlclose(library);
+        return nullptr;
+    }
+    return std::make_unique<PluginStage>(api);
+#else
+    std::cerr << "Error: Loading stages from shared objects is not supported on this platform." << std::endl;
+    return nullptr;
+#endif
+}
+
+} // namespace
+
+/**
+ * @brief Builds the stage pipeline for a run.
+ * @param specs Stage names or shared object paths, in the order given.
+ * @return The pipeline, or null if a stage could not be created.
+ */
+std::shared_ptr<const StagePipeline> loadStages(const std::vector<std::string>& specs) {
+    auto pipeline = std::make_shared<StagePipeline>();
+    for (const auto& spec : specs) {
+        std::unique_ptr<Stage> stage = makeStage(spec);
+        if (!stage) return nullptr;
+        std::vector<std::string> markers = stage->markers();
+        for (size_t i = 0; i < markers.size(); ++i) {
+            if (markers[i].empty()) continue;
+            pipeline->markers.push_back({markers[i], stage.get(), i});
+            if (pipeline->firstBytes.find(markers[i][0]) == std::string::npos) pipeline->firstBytes += markers[i][0];
+        }
+        pipeline->stages.push_back(std::move(stage));
+    }
+    return pipeline;
+}
+
+/**
+ * @brief Hands every stage marker that starts in [from, until) to its stage.
+ * @param content The whole buffer.
+ * @param from First offset a marker may start at.
+ * @param until Markers at or after this offset are left alone.
+ * @param pipeline The stages and their markers.
+ * @param where Name of the file or entry.
+ * @param edits Receives the stages' edits.
+ */
+void matchStageMarkers(std::string_view content, size_t from, size_t until, const StagePipeline& pipeline,
+                       const std::string& where, std::vector<StageEdit>& edits) {
+    if (pipeline.firstBytes.empty()) return;
+    for (size_t pos = content.find_first_of(pipeline.firstBytes, from); pos < until;
+         pos = content.find_first_of(pipeline.firstBytes, pos + 1)) {
+        for (const auto& marker : pipeline.markers) {
+            if (marker.text[0] == content[pos] && content.compare(pos, marker.text.size(), marker.text) == 0) {
+                marker.stage->match(content, pos, marker.index, where, edits);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Renders the directives and applies them together with the stages' edits in one pass.
+ *
+ * Stages see the buffer as it was read, so they never depend on each
+ * other's output. A stage edit that overlaps a rendered date, or an earlier
+ * stage edit, is dropped with a warning.
+ * @param content The entry's text.
+ * @param directives Directives found in it.
+ * @param edits Stage edits found by the same scan.
+ * @param where Name of the file or entry.
+ * @param options Start date, index and stages.
+ * @return The rewritten text.
+ */
+std::string applyStages(std::string_view content, const std::vector<Directive>& directives,
+                        std::vector<StageEdit> edits, const std::string& where, const RewriteOptions& options) {
+    std::vector<StageEdit> dateEdits;
+    dateEdits.reserve(directives.size());
+    LabelScan labels;
+    for (size_t i = 0; i < directives.size(); ++i) {
+        std::string rendered = renderDirective(directives[i], options.startDate, options.startIndex);
+        if (g_schedule.enabled) {
+            recordDate(content, directives, i, rendered, where, options.startDate, options.startIndex, labels);
+        }
+        dateEdits.push_back({directives[i].textBegin, directives[i].textEnd, std::move(rendered)});
+        g_stats.directivesRendered++;
+    }
+
+    auto byPosition = [](const StageEdit& a, const StageEdit& b) {
+        return a.begin != b.begin ? a.begin < b.begin : a.end < b.end;
+    };
+    // An insertion conflicts with a replacement it falls strictly inside.
+    auto overlaps = [](const StageEdit& a, const StageEdit& b) {
+        if (a.begin == a.end) return b.begin < a.begin && a.begin < b.end;
+        if (b.begin == b.end) return a.begin < b.begin && b.begin < a.end;
+        return a.begin < b.end && b.begin < a.end;
+    };
+    std::stable_sort(edits.begin(), edits.end(), byPosition);
+
+    // Dates win: stage edits that overlap one are dropped before anything is applied.
+    std::vector<StageEdit> kept;
+    kept.reserve(edits.size());
+    size_t firstDate = 0;
+    for (auto& edit : edits) {
+        while (firstDate < dateEdits.size() && dateEdits[firstDate].end <= edit.begin) ++firstDate;
+        bool clash = false;
+        for (size_t d = firstDate; d < dateEdits.size() && dateEdits[d].begin <= edit.end && !clash; ++d) {
+            clash = overlaps(edit, dateEdits[d]);
+        }
+        if (clash) {
+            std::cerr << "Warning: Dropping a stage edit at offset " << edit.begin << " in \"" << where
+                      << "\" that overlaps a date." << std::endl;
+            continue;
+        }
+        kept.push_back(std::move(edit));
+    }
+
+    std::string output;
+    output.reserve(content.size() + 64);
+    size_t copiedUpTo = 0;
+    size_t nextDate = 0, nextEdit = 0;
+    unsigned long long applied = 0;
+    while (nextDate < dateEdits.size() || nextEdit < kept.size()) {
+        bool isDate = nextEdit == kept.size() ||
+                      (nextDate < dateEdits.size() && !byPosition(kept[nextEdit], dateEdits[nextDate]));
+        const StageEdit& edit = isDate ? dateEdits[nextDate++] : kept[nextEdit++];
+        if (!isDate && (edit.begin < copiedUpTo || edit.end < edit.begin || edit.end > content.size())) {
+            std::cerr << "Warning: Dropping an overlapping or out of range edit at offset " << edit.begin << " in \""
+                      << where << "\"." << std::endl;
+            continue;
+        }
+        output.append(content, copiedUpTo, edit.begin - copiedUpTo);
+        output += edit.text;
+        copiedUpTo = edit.end;
+        if (!isDate) applied++;
+    }
+    output.append(content, copiedUpTo, std::string_view::npos);
+    g_stats.stageEdits += applied;
+    return output;
+}
+
+// --- Image recompression ---
+// With -png, every .png entry is re-encoded without loss: the image data is
+// inflated and deflated again at level 9 into a single IDAT chunk, and
+// ancillary chunks other than transparency and colour information are
+// dropped. Results are cached by the SHA-256 of the original image, in
+// memory and, with -png-cache, on disk, so an image shared by many courses
+// is only recompressed once. GIFs are left alone: their LZW data has no
+// stronger setting to re-encode with.
+
+struct PngResult {
+    std::string name;
+    size_t before = 0;
+    size_t after = 0;   // Equal to before when nothing was gained
+    bool cached = false;
+};
+
+struct PngResults {
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<const std::string>> memo; // Hash to optimized image, empty if none
+    size_t memoBytes = 0; // Optimized bytes held by memo, at most kPngMemoBytes
+    std::vector<PngResult> images;
+};
+
+const size_t kPngMemoBytes = 64 << 20;
+const size_t kPngMaxRawBytes = 256 << 20; // Larger images are left alone rather than decoded
+
+PngResults g_png;
+
+namespace {
+
+const std::string_view kPngSignature("\x89PNG\r\n\x1a\n", 8);
+
+uint32_t readBE32(const char* p) {
+    const auto* b = reinterpret_cast<const uint8_t*>(p);
+    return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | uint32_t(b[3]);
+}
+
+void appendBE32(std::string& out, uint32_t value) {
+    out += static_cast<char>(value >> 24);
+    out += static_cast<char>(value >> 16);
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+uint32_t adler32(std::string_view data) {
+    uint32_t a = 1, b = 0;
+    for (size_t pos = 0; pos < data.size();) {
+        size_t run = std::min<size_t>(data.size() - pos, 5552); // Largest run before the sums can overflow
+        for (size_t end = pos + run; pos < end; ++pos) {
+            a += static_cast<uint8_t>(data[pos]);
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+void appendPngChunk(std::string& out, std::string_view type, std::string_view data) {
+    appendBE32(out, static_cast<uint32_t>(data.size()));
+    size_t crcFrom = out.size();
+    out.append(type.data(), type.size());
+    out.append(data.data(), data.size());
+    appendBE32(out, crc32Update(0, out.data() + crcFrom, out.size() - crcFrom));
+}
+
+bool isPngName(const std::string& name) {
+    std::string extension = std::filesystem::path(name).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return extension == ".png";
+}
+
+/**
+ * @brief Re-encodes a PNG losslessly.
+ * @param png The original file.
+ * @return The smaller file, or an empty string if it could not be made smaller.
+ * @throws std::runtime_error if the file is not a well-formed PNG.
+ */
+std::string optimizePng(std::string_view png) {
+    if (png.substr(0, kPngSignature.size()) != kPngSignature) throw std::runtime_error("not a PNG file");
+    // Kept besides the critical chunks: transparency, and what the colours mean.
+    static const std::array<std::string_view, 6> keep = {"tRNS", "cHRM", "gAMA", "iCCP", "sRGB", "sBIT"};
+
+    std::vector<std::pair<std::string_view, std::string_view>> chunks; // Type and data, IDAT left out
+    std::string idat;
+    size_t idatAt = 0; // Index in chunks where the image data goes
+    std::string_view header;
+    for (size_t pos = kPngSignature.size();;) {
+        if (png.size() - pos < 12) throw std::runtime_error("truncated chunk");
+        uint32_t length = readBE32(png.data() + pos);
+        if (length > png.size() - pos - 12) throw std::runtime_error("truncated chunk");
+        std::string_view type = png.substr(pos + 4, 4);
+        std::string_view data = png.substr(pos + 8, length);
+        if (crc32Update(0, png.data() + pos + 4, length + 4) != readBE32(png.data() + pos + 8 + length)) {
+            throw std::runtime_error("bad CRC in " + std::string(type) + " chunk");
+        }
+        pos += 12 + length;
+        if (type == "acTL") return ""; // Animated PNG: its frames live in chunks we would drop
+        if (type == "IHDR") header = data;
+        if (type == "IDAT") {
+            if (idat.empty()) idatAt = chunks.size();
+            idat.append(data.data(), data.size());
+        } else if (type == "IEND") {
+            break;
+        } else if (type == "IHDR" || type == "PLTE" || std::find(keep.begin(), keep.end(), type) != keep.end()) {
+            chunks.emplace_back(type, data);
+        } else if ((type[0] & 0x20) == 0) {
+            throw std::runtime_error("unknown critical chunk " + std::string(type)); // Lowercase first letter: ancillary
+        }
+    }
+    if (header.size() != 13 || idat.size() < 6) throw std::runtime_error("missing IHDR or IDAT");
+
+    // The image data is a zlib stream: two header bytes, deflate data, Adler-32.
+    auto cmf = static_cast<uint8_t>(idat[0]), flg = static_cast<uint8_t>(idat[1]);
+    if ((cmf & 0x0F) != 8 || (flg & 0x20) || ((cmf << 8) | flg) % 31 != 0) {
+        throw std::runtime_error("unsupported zlib header");
+    }
+    uint32_t width = readBE32(header.data()), height = readBE32(header.data() + 4);
+    int depth = static_cast<uint8_t>(header[8]), colourType = static_cast<uint8_t>(header[9]);
+    static const int channels[7] = {1, 0, 3, 1, 2, 0, 4};
+    size_t expected = 0;
+    if (header[12] == 0 && colourType <= 6 && channels[colourType]) {
+        expected = static_cast<size_t>(height) * (1 + (static_cast<size_t>(width) * depth * channels[colourType] + 7) / 8);
+    }
+    // The dimensions are untrusted; refuse sizes the image data could not decode to, or that we would not hold.
+    if (expected > kPngMaxRawBytes) throw std::runtime_error("image too large to recompress");
+    if (expected > (idat.size() - 6) * 1032 + 64) throw std::runtime_error("image data too short for its size");
+    std::string pixels = inflateRaw(reinterpret_cast<const uint8_t*>(idat.data()) + 2, idat.size() - 6, expected);
+    if (adler32(pixels) != readBE32(idat.data() + idat.size() - 4)) throw std::runtime_error("bad image data checksum");
+
+    std::string recompressed = "\x78\xDA" + deflateRaw(pixels, 9);
+    appendBE32(recompressed, adler32(pixels));
+    if (recompressed.size() >= idat.size()) recompressed = std::move(idat); // Keep the encoder's own stream
+
+    std::string out(kPngSignature);
+    for (size_t i = 0; i <= chunks.size(); ++i) {
+        if (i == idatAt) {
+            for (size_t at = 0; at < recompressed.size(); at += 1 << 20) {
+                appendPngChunk(out, "IDAT", std::string_view(recompressed).substr(at, 1 << 20));
+            }
+        }
+        if (i < chunks.size()) appendPngChunk(out, chunks[i].first, chunks[i].second);
+    }
+    appendPngChunk(out, "IEND", "");
+    return out.size() < png.size() ? out : std::string();
+}
+
+} // namespace
+
+/**
+ * @brief Recompresses a .png entry, reusing an earlier result for the same image.
+ * @param entry The entry's metadata.
+ * @param content The image.
+ * @param where Name used in warnings and in the report.
+ * @param options Where the cache lives.
+ * @return The repacked entry, or null if the image could not be made smaller.
+ */
+std::unique_ptr<PackedEntry> recompressPngEntry(const ZipEntry& entry, const std::string& content,
+                                                const std::string& where, const RewriteOptions& options) {
+    std::string hash = sha256Hex(content);
+    std::shared_ptr<const std::string> optimized;
+    bool cached = false;
+    {
+        std::lock_guard<std::mutex> lock(g_png.mutex);
+        auto found = g_png.memo.find(hash);
+        if (found != g_png.memo.end()) optimized = found->second;
+    }
+    std::filesystem::path cachePath, missPath;
+    if (!options.pngCacheDir.empty()) {
+        cachePath = options.pngCacheDir / (hash + ".png");
+        missPath = options.pngCacheDir / (hash + ".none");
+    }
+    if (!optimized && !cachePath.empty()) {
+        std::ifstream in(cachePath, std::ios::binary);
+        if (in) {
+            optimized = std::make_shared<const std::string>(std::istreambuf_iterator<char>(in),
+                                                            std::istreambuf_iterator<char>());
+        }
+        else if (std::filesystem::exists(missPath)) optimized = std::make_shared<const std::string>();
+    }
+    if (optimized) {
+        cached = true;
+    } else {
+        std::string result;
+        try {
+            result = optimizePng(content);
+        } catch (const std::exception& e) {
+            std::cerr << "Warning: Leaving \"" << where << "\" as it is: " << e.what() << std::endl;
+        }
+        optimized = std::make_shared<const std::string>(std::move(result));
+        if (!cachePath.empty()) {
+            // The same image may finish on two workers, or on two hosts sharing the cache, at once.
+            char host[256] = "host";
+#ifndef _WIN32
+            gethostname(host, sizeof(host) - 1);
+#endif
+            std::ostringstream suffix;
+            suffix << ".tmp." << host << "." << getpid() << "." << std::this_thread::get_id();
+            std::filesystem::path target = optimized->empty() ? missPath : cachePath;
+            std::filesystem::path tmpPath = target;
+            tmpPath += suffix.str();
+            std::error_code error;
+            std::filesystem::create_directories(options.pngCacheDir, error);
+            {
+                std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+                out << *optimized;
+            }
+            std::filesystem::rename(tmpPath, target, error);
+            if (error) std::filesystem::remove(tmpPath, error);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_png.mutex);
+        if (g_png.memoBytes + optimized->size() <= kPngMemoBytes && g_png.memo.emplace(hash, optimized).second) {
+            g_png.memoBytes += optimized->size(); // Past the limit, -png-cache still avoids the work
+        }
+        g_png.images.push_back({where, content.size(), optimized->empty() ? content.size() : optimized->size(), cached});
+    }
+    if (optimized->empty()) return nullptr;
+
+    auto packed = std::make_unique<PackedEntry>();
+    packed->entry = packEntry(entry, *optimized, 0, packed->data); // Already deflated inside
+    g_stats.pngBytesSaved += content.size() - optimized->size();
+    g_stats.entriesRewritten++;
+    return packed;
+}
+
+/**
+ * @brief Prints the bytes saved per image, largest saving first.
+ */
+void reportPngSavings() {
+    std::vector<PngResult>& images = g_png.images;
+    if (images.empty()) return;
+    std::stable_sort(images.begin(), images.end(), [](const PngResult& a, const PngResult& b) {
+        return a.before - a.after > b.before - b.after;
+    });
+    size_t before = 0, after = 0, cached = 0;
+    std::cout << "PNG recompression:" << std::endl;
+    for (const auto& image : images) {
+        before += image.before;
+        after += image.after;
+        cached += image.cached;
+        std::cout << "  " << std::setw(9) << image.before << " -> " << std::setw(9) << image.after << "  "
+                  << std::fixed << std::setprecision(1) << std::setw(5)
+                  << 100.0 * (image.before - image.after) / std::max<size_t>(1, image.before) << "%  "
+                  << image.name << (image.cached ? " (cached)" : "") << std::endl;
+    }
+    std::cout << "  " << images.size() << " images (" << cached << " from cache): " << before << " -> " << after
+              << " bytes, " << std::fixed << std::setprecision(1) << 100.0 * (before - after) / std::max<size_t>(1, before)
+              << "% saved" << std::defaultfloat << std::endl;
+}
+
+// --- In-process rewrite engine ---
+
+/**
+ * @brief Rewrites the directives of one decompressed entry and recompresses it.
+ * @param entry The entry's metadata.
+ * @param content The entry's uncompressed content.
+ * @param where Name used in warnings, e.g. "archive:entry".
+ * @param options Start date, index and compression level.
+ * @return The repacked entry, or null if its content did not change.
+ */
+std::unique_ptr<PackedEntry> rewriteEntry(const ZipEntry& entry, const std::string& content,
+                                          const std::string& where, const RewriteOptions& options) {
+    if (options.recompressPng && isPngName(entry.name)) return recompressPngEntry(entry, content, where, options);
+    g_stats.entriesScanned++;
+    std::string updated;
+    if (!options.partialsDir.empty() && content.find(kIncludeOpen) != std::string::npos) {
+        updated = applyTemplate(content, where, options.startDate, options.startIndex, options.partialsDir);
+        if (options.stages) {
+            // The partials bring in new text, so the rendered buffer gets its own stage pass.
+            std::vector<StageEdit> edits;
+            matchStageMarkers(updated, 0, updated.size(), *options.stages, where, edits);
+            updated = applyStages(updated, {}, std::move(edits), where, options);
+        }
+    } else if (options.stages) {
+        std::vector<StageEdit> edits;
+        std::vector<Directive> directives = findDirectives(content, where, options.threads, options.stages.get(), &edits);
+        updated = applyStages(content, directives, std::move(edits), where, options);
+    } else {
+        std::vector<Directive> directives = findDirectives(content, where, options.threads);
+        if (directives.empty()) return nullptr;
+        updated = applyDirectives(content, directives, options.startDate, options.startIndex, where);
+    }
+    if (updated == content) return nullptr;
+
+    auto packed = std::make_unique<PackedEntry>();
+    packed->entry = packEntry(entry, updated, options.level, packed->data);
+    g_stats.entriesRewritten++;
+    return packed;
+}
+
+/**
+ * @brief Checks whether an entry is one the rewrite engines scan, or one of the images they recompress.
+ */
+bool isRewritableEntry(const ZipEntry& entry, const RewriteOptions& options) {
+    return (hasTextExtension(entry.name) || (options.recompressPng && isPngName(entry.name))) &&
+           (entry.method == 0 || entry.method == 8) && !(entry.flags & 0x0001);
+}
+
+#ifndef _WIN32
+namespace {
+
+/**
+ * @brief Writes all of data at offset, or throws.
+ */
+void pwriteAll(int fd, uint64_t offset, std::string_view data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = pwrite(fd, data.data() + done, data.size() - done, static_cast<off_t>(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throw std::runtime_error(std::strerror(errno));
+        done += static_cast<size_t>(n);
+    }
+}
+
+/**
+ * @brief Writes an archive with one pwrite() per entry from a pool of workers.
+ *
+ * Every entry's compressed size is known by now, so its offset is the sum
+ * of the records before it, in the original order. The file is allocated at
+ * its final size up front; workers then write their entries' headers and
+ * data independently, and the central directory goes in last. The bytes are
+ * the same as ZipWriter would write one entry after another.
+ * @param path The archive to create.
+ * @param archive The input, for unchanged entries.
+ * @param rewritten Repacked entries, null where the input's bytes are kept.
+ * @param threads Workers writing at once.
+ * @return Total bytes written.
+ */
+uint64_t writeArchiveInParallel(const std::filesystem::path& path, const ZipArchive& archive,
+                                const std::vector<std::unique_ptr<PackedEntry>>& rewritten, unsigned threads) {
+    const std::vector<ZipEntry>& entries = archive.entries();
+    std::vector<ZipEntry> written(entries.size());
+    std::vector<std::string> headers(entries.size());
+    uint64_t offset = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        written[i] = rewritten[i] ? rewritten[i]->entry : entries[i];
+        uint64_t size = rewritten[i] ? rewritten[i]->data.size() : entries[i].compressedSize;
+        headers[i] = ZipWriter::localHeader(written[i], offset, size);
+        offset += headers[i].size() + size;
+    }
+    std::string directory = ZipWriter::centralDirectory(written, offset);
+    uint64_t total = offset + directory.size();
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) throw std::runtime_error("could not create '" + path.string() + "': " + std::strerror(errno));
+    try {
+#ifdef __linux__
+        // Reserve the blocks once instead of extending the file from many threads.
+        if (posix_fallocate(fd, 0, static_cast<off_t>(total)) != 0 && ftruncate(fd, static_cast<off_t>(total)) != 0) {
+            throw std::runtime_error(std::strerror(errno));
+        }
+#else
+        if (ftruncate(fd, static_cast<off_t>(total)) != 0) throw std::runtime_error(std::strerror(errno));
+#endif
+        parallelFor(entries.size(), threads, "write", [&](size_t i, WorkerSlot& slot) {
+            WorkerActivity activity(slot, "write " + entries[i].name);
+            uint64_t at = written[i].localHeaderOffset;
+            pwriteAll(fd, at, headers[i]);
+            pwriteAll(fd, at + headers[i].size(),
+                      rewritten[i] ? std::string_view(rewritten[i]->data) : archive.compressedData(entries[i]));
+        });
+        pwriteAll(fd, offset, directory);
+    } catch (const std::exception& e) {
+        close(fd);
+        throw std::runtime_error("could not write '" + path.string() + "': " + e.what());
+    }
+    if (close(fd) != 0) throw std::runtime_error("could not write '" + path.string() + "': " + std::strerror(errno));
+    return total;
+}
+
+} // namespace
+#endif
+
+/**
+ * @brief Rewrites an archive without extracting it to disk.
+ *
+ * Text entries are inflated and scanned on a pool of worker threads, largest
+ * first so one big entry does not end up running alone at the tail. Each
+ * decompressed buffer goes straight to the directive scanner, and changed
+ * entries are recompressed by the same worker. The output keeps the original
+ * entry order; unchanged entries are copied as their original compressed
+ * bytes. Local outputs are written by the workers in parallel.
+ * @param job The input archive and the archive to create.
+ * @param options Start date, index, compression level and thread count.
+ * @return True on success, false otherwise.
+ */
+bool rewriteArchive(const ArchiveJob& job, const RewriteOptions& options) {
+    CourseScope scope(courseFor(job.input.string()));
+    if (isS3Path(job.input.string())) return rewriteRemoteArchive(job, options);
+    if (isCanvasPath(job.input.string())) return rewriteCanvasExport(job, options);
+    try {
+        ZipArchive archive(job.input);
+        const std::vector<ZipEntry>& entries = archive.entries();
+        g_stats.bytesIn += archive.data().size();
+
+        std::vector<size_t> textEntries;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (isRewritableEntry(entries[i], options)) textEntries.push_back(i);
+        }
+        std::stable_sort(textEntries.begin(), textEntries.end(), [&](size_t a, size_t b) {
+            return entries[a].uncompressedSize > entries[b].uncompressedSize;
+        });
+
+        std::vector<std::unique_ptr<PackedEntry>> rewritten(entries.size());
+        {
+            PhaseTimer timer(Phase::Process);
+            parallelFor(textEntries.size(), options.threads, "inflate", [&](size_t n, WorkerSlot& slot) {
+                const ZipEntry& entry = entries[textEntries[n]];
+                WorkerActivity activity(slot, "inflate+scan " + entry.name);
+                rewritten[textEntries[n]] = rewriteEntry(entry, archive.extract(entry),
+                                                         job.input.string() + ":" + entry.name, options);
+            });
+        }
+
+        PhaseTimer timer(Phase::Rezip);
+#ifndef _WIN32
+        if (!isS3Path(job.output.string())) {
+            g_stats.bytesOut += writeArchiveInParallel(job.output, archive, rewritten, options.threads);
+            g_stats.archivesProcessed++;
+            std::cout << "Successfully created new archive at '" << std::filesystem::absolute(job.output).string()
+                      << "'" << std::endl;
+            return true;
+        }
+#endif
+        WorkerActivity activity(workerSlot("main"), "write " + job.output.string());
+        std::unique_ptr<S3Upload> upload;
+        std::unique_ptr<std::ostream> stream;
+        if (isS3Path(job.output.string())) {
+            upload = std::make_unique<S3Upload>(parseS3Path(job.output.string()), kUploadPartSize, options.ioThreads);
+            stream = std::make_unique<std::ostream>(upload.get());
+        } else {
+            stream = std::make_unique<std::ofstream>(job.output, std::ios::binary | std::ios::trunc);
+        }
+        std::ostream& out = *stream;
+        if (!out) {
+            throw std::runtime_error("could not create '" + job.output.string() + "'");
+        }
+        ZipWriter writer(out);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (rewritten[i]) {
+                writer.addRaw(rewritten[i]->entry, rewritten[i]->data);
+            } else {
+                writer.addRaw(entries[i], archive.compressedData(entries[i]));
+            }
+        }
+        writer.finish();
+        if (upload) upload->complete(); // Reports a failed part in more detail than the stream state
+        if (!out) {
+            throw std::runtime_error("could not write '" + job.output.string() + "'");
+        }
+        g_stats.bytesOut += writer.bytesWritten();
+        g_stats.archivesProcessed++;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Could not rewrite '" << job.input.string() << "': " << e.what() << std::endl;
+        return false;
+    }
+    std::cout << "Successfully created new archive at '"
+              << (isS3Path(job.output.string()) ? job.output.string() : std::filesystem::absolute(job.output).string())
+              << "'" << std::endl;
+    return true;
+}
+
+#ifndef CANVASUPDATER_ASYNC
+/**
+ * @brief Rewrites several archives, one after another, each on the worker pool.
+ * @return True if every archive was rewritten.
+ */
+bool rewriteArchives(const std::vector<ArchiveJob>& jobs, const RewriteOptions& options) {
+    g_stats.computeThreads = options.threads;
+    g_stats.ioThreads = 1; // The writer runs on the calling thread
+    bool ok = true;
+    for (const auto& job : jobs) {
+        if (!rewriteArchive(job, options)) {
+            if (CourseStats* course = courseFor(job.input.string())) course->failed = true;
+            ok = false;
+        }
+    }
+    return ok;
+}
+#endif
+
+#ifdef CANVASUPDATER_ASYNC
+// --- Asynchronous rewrite engine ---
+// Each archive and each text entry is a coroutine. A few compute threads run
+// them off one epoll instance, so thousands of entries across many archives can
+// be in flight at once. Regular files cannot be waited on with epoll, so reads
+// and writes are handed to a small pool of I/O threads; the coroutine is
+// suspended meanwhile and its compute thread moves on to scanning and
+// compressing other entries.
+
+namespace {
+
+struct TaskPromiseBase {
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            return handle.promise().continuation;
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct TaskResult {
+    std::optional<T> value;
+    void return_value(T result) { value = std::move(result); }
+    T take() { return std::move(*value); }
+};
+
+template <>
+struct TaskResult<void> {
+    void return_void() {}
+    void take() {}
+};
+
+/**
+ * @brief A lazily started coroutine; awaiting it runs it and yields its result.
+ */
+template <typename T>
+class Task {
+public:
+    struct promise_type : TaskPromiseBase, TaskResult<T> {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+    Task(const Task&) = delete;
+    ~Task() {
+        if (handle_) handle_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle_.promise().continuation = caller;
+        return handle_;
+    }
+    T await_resume() {
+        if (handle_.promise().error) std::rethrow_exception(handle_.promise().error);
+        return handle_.promise().take();
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// A fire-and-forget coroutine that frees itself when it finishes.
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/**
+ * @brief Compute threads sharing one epoll instance, plus a pool of blocking I/O threads.
+ *
+ * Runnable coroutines sit in a queue; each push adds one to a semaphore eventfd
+ * registered with epoll, and whichever compute thread wins the read resumes one
+ * coroutine.
+ */
+class EventLoop {
+public:
+    EventLoop(unsigned computeThreads, unsigned ioThreads);
+    ~EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    void post(std::coroutine_handle<> handle);
+
+    /**
+     * @brief Awaitable that moves the awaiting coroutine onto a compute thread.
+     */
+    auto schedule() {
+        struct Awaiter {
+            EventLoop& loop;
+            bool await_ready() noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) { loop.post(handle); }
+            void await_resume() noexcept {}
+        };
+        return Awaiter{*this};
+    }
+
+    /**
+     * @brief Awaitable that runs a blocking call on an I/O thread and resumes on a compute thread.
+     * @param label What the I/O thread shows in progress snapshots.
+     * @param call The blocking work; its result (or exception) is handed back to the coroutine.
+     */
+    template <typename F>
+    auto blocking(std::string label, F call) {
+        using Result = decltype(call());
+        struct Awaiter {
+            EventLoop& loop;
+            std::string label;
+            F call;
+            std::optional<std::conditional_t<std::is_void_v<Result>, bool, Result>> result;
+            std::exception_ptr error;
+
+            bool await_ready() noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) {
+                loop.submitBlocking([this, handle](WorkerSlot& slot) {
+                    try {
+                        WorkerActivity activity(slot, label);
+                        if constexpr (std::is_void_v<Result>) {
+                            call();
+                            result = true;
+                        } else {
+                            result = call();
+                        }
+                    } catch (...) {
+                        error = std::current_exception();
+                    }
+                    loop.post(handle);
+                });
+            }
+            Result await_resume() {
+                if (error) std::rethrow_exception(error);
+                if constexpr (!std::is_void_v<Result>) return std::move(*result);
+            }
+        };
+        return Awaiter{*this, std::move(label), std::move(call), std::nullopt, nullptr};
+    }
+
+    /**
+     * @brief The progress slot of the compute thread running the caller.
+     */
+    static WorkerSlot& currentSlot() { return *currentSlot_; }
+
+private:
+    void submitBlocking(std::function<void(WorkerSlot&)> job);
+    void computeLoop(unsigned n);
+    void ioLoop(unsigned n);
+
+    int epollFd_ = -1;
+    int readyFd_ = -1;
+    std::mutex readyMutex_;
+    std::deque<std::coroutine_handle<>> ready_;
+    std::mutex ioMutex_;
+    std::condition_variable ioReady_;
+    std::deque<std::function<void(WorkerSlot&)>> ioJobs_;
+    std::atomic<bool> stopping_{false};
+    std::vector<std::thread> threads_;
+    static thread_local WorkerSlot* currentSlot_;
+};
+
+thread_local WorkerSlot* EventLoop::currentSlot_ = nullptr;
+
+EventLoop::EventLoop(unsigned computeThreads, unsigned ioThreads) {
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    readyFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+    if (epollFd_ < 0 || readyFd_ < 0) {
+        throw std::runtime_error(std::string("could not create event loop: ") + std::strerror(errno));
+    }
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = readyFd_;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, readyFd_, &event) != 0) {
+        throw std::runtime_error(std::string("could not register with epoll: ") + std::strerror(errno));
+    }
+    for (unsigned n = 0; n < std::max(1u, computeThreads); ++n) threads_.emplace_back(&EventLoop::computeLoop, this, n);
+    for (unsigned n = 0; n < std::max(1u, ioThreads); ++n) threads_.emplace_back(&EventLoop::ioLoop, this, n);
+}
+
+EventLoop::~EventLoop() {
+    {
+        std::lock_guard<std::mutex> lock(ioMutex_);
+        stopping_ = true;
+    }
+    ioReady_.notify_all();
+    uint64_t wake = threads_.size();
+    if (write(readyFd_, &wake, sizeof(wake)) < 0) {
+        std::cerr << "Warning: could not wake event loop threads: " << std::strerror(errno) << std::endl;
+    }
+    for (auto& thread : threads_) thread.join();
+    close(readyFd_);
+    close(epollFd_);
+}
+
+void EventLoop::post(std::coroutine_handle<> handle) {
+    {
+        std::lock_guard<std::mutex> lock(readyMutex_);
+        ready_.push_back(handle);
+    }
+    queueDepth("async")++;
+    uint64_t one = 1;
+    while (write(readyFd_, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+void EventLoop::submitBlocking(std::function<void(WorkerSlot&)> job) {
+    {
+        std::lock_guard<std::mutex> lock(ioMutex_);
+        ioJobs_.push_back(std::move(job));
+    }
+    queueDepth("io")++;
+    ioReady_.notify_one();
+}
+
+void EventLoop::computeLoop(unsigned n) {
+    currentSlot_ = &workerSlot("async-" + std::to_string(n));
+    std::array<epoll_event, 16> events;
+    while (!stopping_) {
+        int count = epoll_wait(epollFd_, events.data(), static_cast<int>(events.size()), -1);
+        if (count < 0 && errno != EINTR) {
+            std::cerr << "Error: epoll_wait failed: " << std::strerror(errno) << std::endl;
+            std::terminate();
+        }
+        for (int i = 0; i < count && !stopping_; ++i) {
+            uint64_t token;
+            if (events[i].data.fd != readyFd_ || read(readyFd_, &token, sizeof(token)) != sizeof(token)) continue;
+            std::coroutine_handle<> handle;
+            {
+                std::lock_guard<std::mutex> lock(readyMutex_);
+                handle = ready_.front();
+                ready_.pop_front();
+            }
+            queueDepth("async")--;
+            handle.resume();
+        }
+    }
+}
+
+void EventLoop::ioLoop(unsigned n) {
+    WorkerSlot& slot = workerSlot("io-" + std::to_string(n));
+    for (;;) {
+        std::function<void(WorkerSlot&)> job;
+        {
+            std::unique_lock<std::mutex> lock(ioMutex_);
+            ioReady_.wait(lock, [this] { return stopping_ || !ioJobs_.empty(); });
+            if (ioJobs_.empty()) return;
+            job = std::move(ioJobs_.front());
+            ioJobs_.pop_front();
+        }
+        queueDepth("io")--;
+        job(slot);
+    }
+}
+
+/**
+ * @brief One-shot event that coroutines can wait for.
+ */
+class AsyncEvent {
+public:
+    explicit AsyncEvent(EventLoop& loop) : loop_(loop) {}
+
+    void set() {
+        std::vector<std::coroutine_handle<>> waiters;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            set_ = true;
+            waiters.swap(waiters_);
+        }
+        // The event may be destroyed as soon as the lock is released.
+        for (auto handle : waiters) loop_.post(handle);
+    }
+
+    auto wait() {
+        struct Awaiter {
+            AsyncEvent& event;
+            bool await_ready() noexcept { return false; }
+            bool await_suspend(std::coroutine_handle<> handle) {
+                std::lock_guard<std::mutex> lock(event.mutex_);
+                if (event.set_) return false;
+                event.waiters_.push_back(handle);
+                return true;
+            }
+            void await_resume() noexcept {}
+        };
+        return Awaiter{*this};
+    }
+
+private:
+    EventLoop& loop_;
+    std::mutex mutex_;
+    bool set_ = false;
+    std::vector<std::coroutine_handle<>> waiters_;
+};
+
+/**
+ * @brief Counting semaphore for coroutines; bounds how many entries are being processed.
+ */
+class AsyncSemaphore {
+public:
+    AsyncSemaphore(EventLoop& loop, size_t permits) : loop_(loop), permits_(permits) {}
+
+    auto acquire() {
+        struct Awaiter {
+            AsyncSemaphore& semaphore;
+            bool await_ready() noexcept { return false; }
+            bool await_suspend(std::coroutine_handle<> handle) {
+                std::lock_guard<std::mutex> lock(semaphore.mutex_);
+                if (semaphore.permits_ > 0) {
+                    semaphore.permits_--;
+                    return false;
+                }
+                semaphore.waiters_.push_back(handle);
+                return true;
+            }
+            void await_resume() noexcept {}
+        };
+        return Awaiter{*this};
+    }
+
+    void release() {
+        std::coroutine_handle<> next;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (waiters_.empty()) {
+                permits_++;
+                return;
+            }
+            next = waiters_.front(); // The permit passes straight to the next waiter
+            waiters_.pop_front();
+        }
+        loop_.post(next);
+    }
+
+private:
+    EventLoop& loop_;
+    std::mutex mutex_;
+    size_t permits_;
+    std::deque<std::coroutine_handle<>> waiters_;
+};
+
+/**
+ * @brief Starts a task on the loop without waiting for it, then signals an event.
+ */
+Detached spawn(EventLoop& loop, Task<void> task, AsyncEvent& done) {
+    co_await loop.schedule();
+    try {
+        co_await task;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+    }
+    done.set();
+}
+
+/**
+ * @brief Runs a task on the loop and blocks the calling thread until it finishes.
+ */
+template <typename T>
+T syncWait(EventLoop& loop, Task<T> task) {
+    std::mutex mutex;
+    std::condition_variable finished;
+    bool done = false;
+    std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> result;
+    std::exception_ptr error;
+
+    auto runner = [&]() -> Detached {
+        co_await loop.schedule();
+        try {
+            if constexpr (std::is_void_v<T>) {
+                co_await std::move(task);
+            } else {
+                result = co_await std::move(task);
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        finished.notify_one();
+    };
+    runner();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&] { return done; });
+    if (error) std::rethrow_exception(error);
+    if constexpr (!std::is_void_v<T>) return std::move(*result);
+}
+
+/**
+ * @brief Reads exactly size bytes at offset, or throws.
+ */
+std::string preadExact(int fd, uint64_t offset, size_t size) {
+    std::string buffer(size, '\0');
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, &buffer[done], size - done, static_cast<off_t>(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw std::runtime_error(n == 0 ? "unexpected end of file" : std::strerror(errno));
+        done += static_cast<size_t>(n);
+    }
+    g_stats.bytesIn += size;
+    return buffer;
+}
+
+/**
+ * @brief Copies size bytes between two files in the kernel, falling back to pread/pwrite.
+ */
+void copyRange(int in, uint64_t inOffset, int out, uint64_t outOffset, uint64_t size) {
+    loff_t from = static_cast<loff_t>(inOffset);
+    loff_t to = static_cast<loff_t>(outOffset);
+    while (size > 0) {
+        ssize_t n = copy_file_range(in, &from, out, &to, static_cast<size_t>(size), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break; // Unsupported here (e.g. EXDEV on older kernels); copy by hand
+        size -= static_cast<uint64_t>(n);
+        g_stats.bytesIn += static_cast<uint64_t>(n);
+    }
+    const uint64_t chunk = 1 << 20;
+    while (size > 0) {
+        uint64_t part = std::min(size, chunk);
+        pwriteAll(out, static_cast<uint64_t>(to), preadExact(in, static_cast<uint64_t>(from), static_cast<size_t>(part)));
+        from += static_cast<loff_t>(part);
+        to += static_cast<loff_t>(part);
+        size -= part;
+    }
+}
+
+/**
+ * @brief Returns the file offset of an entry's compressed data.
+ */
+uint64_t entryDataOffset(int fd, const ZipEntry& entry) {
+    return entry.localHeaderOffset + localHeaderSize(preadExact(fd, entry.localHeaderOffset, 30));
+}
+
+// Owns a file descriptor for the lifetime of an archive coroutine.
+struct FileHandle {
+    int fd = -1;
+    FileHandle() = default;
+    FileHandle(const FileHandle&) = delete;
+    ~FileHandle() {
+        if (fd >= 0) close(fd);
+    }
+};
+
+struct EntryResult {
+    explicit EntryResult(EventLoop& loop) : done(loop) {}
+    AsyncEvent done;
+    std::unique_ptr<PackedEntry> packed;
+    std::exception_ptr error;
+};
+
+/**
+ * @brief Reads, scans and repacks one text entry.
+ *
+ * Holds one permit of the processing budget from before the read until the
+ * entry has been repacked, so only a bounded number of inflated entries exist
+ * at a time no matter how many archives are open.
+ */
+Detached processEntry(EventLoop& loop, int fd, const ZipEntry& entry, std::string where, const RewriteOptions& options,
+                      CourseStats* course, AsyncSemaphore& budget, EntryResult& result) {
+    co_await loop.schedule();
+    try {
+        std::string raw = co_await loop.blocking("read " + entry.name, [fd, &entry, course] {
+            CourseScope scope(course);
+            return preadExact(fd, entryDataOffset(fd, entry), static_cast<size_t>(entry.compressedSize));
+        });
+        WorkerActivity activity(EventLoop::currentSlot(), "inflate+scan " + entry.name);
+        CourseScope scope(course); // Nothing below suspends, so the scope stays on this thread
+        result.packed = rewriteEntry(entry, decompressEntry(entry, raw), where, options);
+    } catch (...) {
+        result.error = std::current_exception();
+    }
+    budget.release();
+    result.done.set();
+}
+
+struct WriteResult {
+    explicit WriteResult(EventLoop& loop) : done(loop) {}
+    AsyncEvent done;
+    std::exception_ptr error;
+};
+
+/**
+ * @brief Runs one record's writes on an I/O thread without the caller waiting for them.
+ */
+Detached writeRecord(EventLoop& loop, std::string label, std::function<void()> write, WriteResult& result) {
+    try {
+        co_await loop.blocking(std::move(label), std::move(write));
+    } catch (...) {
+        result.error = std::current_exception();
+    }
+    result.done.set();
+}
+
+/**
+ * @brief Starts every text entry of an archive, largest first, as the budget allows.
+ */
+Detached spawnEntries(EventLoop& loop, int fd, const ArchiveJob& job, const std::vector<ZipEntry>& entries,
+                      std::vector<size_t> order, const RewriteOptions& options, CourseStats* course,
+                      AsyncSemaphore& budget, std::vector<std::unique_ptr<EntryResult>>& results) {
+    for (size_t index : order) {
+        co_await budget.acquire();
+        processEntry(loop, fd, entries[index], job.input.string() + ":" + entries[index].name, options, course,
+                     budget, *results[index]);
+    }
+}
+
+/**
+ * @brief Rewrites one archive on the event loop.
+ *
+ * The central directory is read from the end of the file and text entries are
+ * started in the background. An entry's offset in the output is fixed as soon
+ * as every entry before it is ready, and its pwrite is handed to the I/O
+ * threads right away, so writes overlap instead of landing one at a time; the
+ * central directory is written once they have all finished. Unchanged entries
+ * are copied file-to-file without passing through this process where the
+ * kernel supports it.
+ */
+Task<bool> rewriteArchiveAsync(EventLoop& loop, const ArchiveJob& job, const RewriteOptions& options,
+                               AsyncSemaphore& budget) {
+    FileHandle in, out;
+    std::vector<std::unique_ptr<EntryResult>> results;
+    std::vector<std::unique_ptr<WriteResult>> writes;
+    std::exception_ptr failure;
+    // Counts are made in scopes that never span a co_await, since the frame may resume on another thread.
+    CourseStats* course = courseFor(job.input.string());
+    try {
+        ZipArchive archive = co_await loop.blocking("open " + job.input.string(), [&] {
+            CourseScope scope(course);
+            in.fd = open(job.input.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat info;
+            if (in.fd < 0 || fstat(in.fd, &info) != 0) {
+                throw std::runtime_error(std::string("could not open archive: ") + std::strerror(errno));
+            }
+            out.fd = open(job.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (out.fd < 0) {
+                throw std::runtime_error("could not create '" + job.output.string() + "': " + std::strerror(errno));
+            }
+            int fd = in.fd;
+            return ZipArchive::fromTail([fd](uint64_t offset, size_t size) { return preadExact(fd, offset, size); },
+                                        static_cast<uint64_t>(info.st_size));
+        });
+
+        std::vector<ZipEntry> entries = archive.entries();
+        std::vector<size_t> textEntries;
+        results.resize(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (!isRewritableEntry(entries[i], options)) continue;
+            textEntries.push_back(i);
+            results[i] = std::make_unique<EntryResult>(loop);
+        }
+        std::stable_sort(textEntries.begin(), textEntries.end(), [&](size_t a, size_t b) {
+            return entries[a].uncompressedSize > entries[b].uncompressedSize;
+        });
+        spawnEntries(loop, in.fd, job, entries, textEntries, options, course, budget, results);
+
+        uint64_t offset = 0;
+        std::vector<ZipEntry> written;
+        written.reserve(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (results[i]) {
+                co_await results[i]->done.wait();
+                if (results[i]->error) std::rethrow_exception(results[i]->error);
+            }
+            writes.push_back(std::make_unique<WriteResult>(loop));
+            int inFd = in.fd, outFd = out.fd;
+            if (results[i] && results[i]->packed) {
+                PackedEntry& packed = *results[i]->packed;
+                std::string header = ZipWriter::localHeader(packed.entry, offset, packed.data.size());
+                uint64_t size = header.size() + packed.data.size();
+                written.push_back(packed.entry);
+                writeRecord(loop, "write " + packed.entry.name,
+                            [outFd, offset, header = std::move(header), &result = *results[i]] {
+                                pwriteAll(outFd, offset, header);
+                                pwriteAll(outFd, offset + header.size(), result.packed->data);
+                                result.packed.reset();
+                            },
+                            *writes.back());
+                offset += size;
+            } else {
+                ZipEntry entry = entries[i];
+                std::string header = ZipWriter::localHeader(entry, offset, entry.compressedSize);
+                uint64_t size = header.size() + entry.compressedSize;
+                written.push_back(entry);
+                writeRecord(loop, "copy " + entry.name,
+                            [inFd, outFd, offset, header = std::move(header), entry = entries[i], course] {
+                                CourseScope scope(course);
+                                uint64_t dataOffset = entryDataOffset(inFd, entry);
+                                pwriteAll(outFd, offset, header);
+                                copyRange(inFd, dataOffset, outFd, offset + header.size(), entry.compressedSize);
+                            },
+                            *writes.back());
+                offset += size;
+            }
+        }
+        for (auto& write : writes) {
+            co_await write->done.wait();
+            if (write->error) std::rethrow_exception(write->error);
+        }
+
+        std::string directory = ZipWriter::centralDirectory(written, offset);
+        co_await loop.blocking("finish " + job.output.string(), [&] {
+            pwriteAll(out.fd, offset, directory);
+            if (ftruncate(out.fd, static_cast<off_t>(offset + directory.size())) != 0 || close(out.fd) != 0) {
+                out.fd = -1;
+                throw std::runtime_error("could not write '" + job.output.string() + "': " + std::strerror(errno));
+            }
+            out.fd = -1;
+        });
+        CourseScope scope(course);
+        g_stats.bytesOut += offset + directory.size();
+    } catch (...) {
+        failure = std::current_exception();
+    }
+
+    // Entries and writes still in flight refer to this frame; let them finish before it goes away.
+    for (auto& result : results) {
+        if (result) co_await result->done.wait();
+    }
+    for (auto& write : writes) co_await write->done.wait();
+    if (failure) {
+        try {
+            std::rethrow_exception(failure);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: Could not rewrite '" << job.input.string() << "': " << e.what() << std::endl;
+        }
+        if (course) course->failed = true;
+        co_return false;
+    }
+    {
+        CourseScope scope(course);
+        g_stats.archivesProcessed++;
+    }
+    std::cout << "Successfully created new archive at '" << std::filesystem::absolute(job.output).string() << "'"
+              << std::endl;
+    co_return true;
+}
+
+/**
+ * @brief Rewrites every archive concurrently and reports whether all succeeded.
+ */
+Task<bool> rewriteAllAsync(EventLoop& loop, const std::vector<ArchiveJob>& jobs, const RewriteOptions& options,
+                           AsyncSemaphore& budget) {
+    std::vector<std::unique_ptr<AsyncEvent>> done;
+    std::vector<char> succeeded(jobs.size(), 0);
+    auto runOne = [&](size_t n) -> Task<void> {
+        succeeded[n] = co_await rewriteArchiveAsync(loop, jobs[n], options, budget);
+    };
+    for (size_t n = 0; n < jobs.size(); ++n) {
+        done.push_back(std::make_unique<AsyncEvent>(loop));
+        spawn(loop, runOne(n), *done.back());
+    }
+    for (auto& event : done) co_await event->wait();
+    co_return std::all_of(succeeded.begin(), succeeded.end(), [](char ok) { return ok != 0; });
+}
+
+} // namespace
+
+/**
+ * @brief Rewrites several archives concurrently on the coroutine engine.
+ *
+ * Uses the requested numbers of compute and I/O threads; at most 64 entries
+ * per compute thread are inflated at any one time.
+ * @return True if every archive was rewritten.
+ */
+bool rewriteArchives(const std::vector<ArchiveJob>& jobs, const RewriteOptions& options) {
+    // The engine reads and writes local files with pread/pwrite, so S3 and Canvas jobs take the streaming path.
+    bool ok = true;
+    std::vector<ArchiveJob> localJobs;
+    for (const auto& job : jobs) {
+        bool remote = isS3Path(job.input.string()) || isCanvasPath(job.input.string()) || isS3Path(job.output.string());
+        if (!remote) {
+            localJobs.push_back(job);
+        } else if (!rewriteArchive(job, options)) {
+            if (CourseStats* course = courseFor(job.input.string())) course->failed = true;
+            ok = false;
+        }
+    }
+    if (localJobs.empty()) return ok;
+    try {
+        PhaseTimer timer(Phase::Process);
+        g_stats.computeThreads = options.threads;
+        g_stats.ioThreads = options.ioThreads;
+        EventLoop loop(options.threads, options.ioThreads);
+        AsyncSemaphore budget(loop, 64 * static_cast<size_t>(std::max(1u, options.threads)));
+        return syncWait(loop, rewriteAllAsync(loop, localJobs, options, budget)) && ok;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return false;
+    }
+}
+#endif
+
+// --- Deflate encoder ---
+
+namespace {
+/**
+ * @brief LSB-first bit writer for deflate output.
+ */
+struct BitWriter {
+    std::string out;
+    uint64_t bits = 0;
+    int count = 0;
+
+    void put(uint32_t value, int n) {
+        bits |= static_cast<uint64_t>(value) << count;
+        count += n;
+        if (count >= 32) {
+            char bytes[4] = {static_cast<char>(bits), static_cast<char>(bits >> 8), static_cast<char>(bits >> 16),
+                             static_cast<char>(bits >> 24)};
+            out.append(bytes, 4);
+            bits >>= 32;
+            count -= 32;
+        }
+    }
+    void flushToByte() {
+        while (count > 0) {
+            out += static_cast<char>(bits);
+            bits >>= 8;
+            count = count > 8 ? count - 8 : 0;
+        }
+        bits = 0;
+    }
+};
+
+uint32_t reverseBits(uint32_t code, int length) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; ++i) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+    return reversed;
+}
+
+/**
+ * @brief Computes Huffman code lengths limited to maxLength bits.
+ *
+ * Builds an optimal tree, then pushes overlong codes back under the limit the
+ * way miniz does, and finally hands the shortest lengths to the most frequent
+ * symbols. At least two symbols always get a code, as deflate decoders expect.
+ */
+void buildCodeLengths(std::vector<uint32_t> freq, int maxLength, std::vector<uint8_t>& lengths) {
+    size_t n = freq.size();
+    lengths.assign(n, 0);
+    std::vector<size_t> used;
+    for (size_t s = 0; s < n; ++s) if (freq[s]) used.push_back(s);
+    for (size_t s = 0; used.size() < 2 && s < n; ++s) {
+        if (!freq[s]) { freq[s] = 1; used.push_back(s); }
+    }
+    std::sort(used.begin(), used.end(), [&](size_t a, size_t b) { return freq[a] < freq[b] || (freq[a] == freq[b] && a < b); });
+
+    // Two-queue Huffman construction over the sorted leaves: depth of each leaf.
+    size_t leaves = used.size();
+    std::vector<uint64_t> weight(2 * leaves);
+    std::vector<size_t> parent(2 * leaves, 0);
+    for (size_t i = 0; i < leaves; ++i) weight[i] = freq[used[i]];
+    size_t leaf = 0, node = leaves, nextNode = leaves;
+    auto takeSmallest = [&]() {
+        if (leaf < leaves && (node >= nextNode || weight[leaf] <= weight[node])) return leaf++;
+        return node++;
+    };
+    for (; nextNode < 2 * leaves - 1; ++nextNode) {
+        size_t a = takeSmallest(), b = takeSmallest();
+        weight[nextNode] = weight[a] + weight[b];
+        parent[a] = parent[b] = nextNode;
+    }
+    std::vector<int> depth(2 * leaves - 1, 0);
+    for (size_t i = 2 * leaves - 2; i-- > 0;) depth[i] = depth[parent[i]] + 1;
+
+    std::vector<int> perLength(std::max(maxLength, 64) + 1, 0);
+    int deepest = 0;
+    for (size_t i = 0; i < leaves; ++i) {
+        perLength[std::min(depth[i], 64)]++;
+        deepest = std::max(deepest, depth[i]);
+    }
+    if (deepest > maxLength) {
+        for (int len = maxLength + 1; len <= 64; ++len) {
+            perLength[maxLength] += perLength[len];
+            perLength[len] = 0;
+        }
+        uint64_t total = 0;
+        for (int len = maxLength; len > 0; --len) total += static_cast<uint64_t>(perLength[len]) << (maxLength - len);
+        while (total != (1ull << maxLength)) {
+            perLength[maxLength]--;
+            for (int len = maxLength - 1; len > 0; --len) {
+                if (perLength[len]) {
+                    perLength[len]--;
+                    perLength[len + 1] += 2;
+                    break;
+                }
+            }
+            total--;
+        }
+    }
+
+    // Most frequent symbols (end of `used`) receive the shortest codes.
+    size_t next = leaves;
+    for (int len = 1; len <= maxLength; ++len) {
+        for (int k = 0; k < perLength[len]; ++k) lengths[used[--next]] = static_cast<uint8_t>(len);
+    }
+}
+
+/**
+ * @brief Assigns canonical codes (already bit-reversed for the writer) from code lengths.
+ */
+std::vector<uint16_t> canonicalCodes(const std::vector<uint8_t>& lengths) {
+    int perLength[16] = {};
+    for (uint8_t len : lengths) perLength[len]++;
+    perLength[0] = 0;
+    uint32_t next[16] = {};
+    uint32_t code = 0;
+    for (int len = 1; len < 16; ++len) {
+        code = (code + perLength[len - 1]) << 1;
+        next[len] = code;
+    }
+    std::vector<uint16_t> codes(lengths.size(), 0);
+    for (size_t s = 0; s < lengths.size(); ++s) {
+        if (lengths[s]) codes[s] = static_cast<uint16_t>(reverseBits(next[lengths[s]]++, lengths[s]));
+    }
+    return codes;
+}
+
+struct DeflateToken {
+    uint16_t lengthOrLiteral; // Literal byte, or match length when distance != 0
+    uint16_t distance;
+};
+
+struct DeflateLevel {
+    int good, lazy, nice, chain;
+};
+
+// Per-level search limits, following zlib's configuration table.
+const DeflateLevel kDeflateLevels[10] = {
+    {0, 0, 0, 0},       {4, 4, 8, 4},       {4, 5, 16, 8},      {4, 6, 32, 32},     {4, 4, 16, 16},
+    {8, 16, 32, 32},    {8, 16, 128, 128},  {8, 32, 128, 256},  {32, 128, 258, 1024}, {32, 258, 258, 4096}};
+
+int lengthSymbol(int length) {
+    int s = 0;
+    while (s < 28 && kLengthBase[s + 1] <= length) ++s;
+    return s;
+}
+
+int distanceSymbol(int distance) {
+    int s = 0;
+    while (s < 29 && kDistanceBase[s + 1] <= distance) ++s;
+    return s;
+}
+
+/**
+ * @brief Encodes one block of tokens, choosing whichever of stored, fixed or dynamic Huffman is smallest.
+ */
+void writeDeflateBlock(BitWriter& writer, const std::vector<DeflateToken>& tokens, const char* raw, size_t rawSize,
+                       bool last) {
+    static const auto lengthSymbols = [] {
+        std::array<uint8_t, 259> table{};
+        for (int len = 3; len <= 258; ++len) table[len] = static_cast<uint8_t>(lengthSymbol(len));
+        return table;
+    }();
+    static const auto distanceSymbols = [] {
+        std::vector<uint8_t> table(32769);
+        for (int d = 1; d <= 32768; ++d) table[d] = static_cast<uint8_t>(distanceSymbol(d));
+        return table;
+    }();
+
+    std::vector<uint32_t> litFreq(286, 0), distFreq(30, 0);
+    for (const auto& t : tokens) {
+        if (t.distance == 0) {
+            litFreq[t.lengthOrLiteral]++;
+        } else {
+            litFreq[257 + lengthSymbols[t.lengthOrLiteral]]++;
+            distFreq[distanceSymbols[t.distance]]++;
+        }
+    }
+    litFreq[256] = 1;
+
+    std::vector<uint8_t> litLengths, distLengths;
+    buildCodeLengths(litFreq, 15, litLengths);
+    buildCodeLengths(distFreq, 15, distLengths);
+
+    // Trim trailing unused codes and run-length encode the code lengths.
+    int litCount = 286, distCount = 30;
+    while (litCount > 257 && litLengths[litCount - 1] == 0) --litCount;
+    while (distCount > 1 && distLengths[distCount - 1] == 0) --distCount;
+    std::vector<uint8_t> all(litLengths.begin(), litLengths.begin() + litCount);
+    all.insert(all.end(), distLengths.begin(), distLengths.begin() + distCount);
+    std::vector<std::pair<uint8_t, uint8_t>> rle; // (symbol, extra bits value)
+    for (size_t i = 0; i < all.size();) {
+        size_t run = 1;
+        while (i + run < all.size() && all[i + run] == all[i]) ++run;
+        if (all[i] == 0 && run >= 3) {
+            size_t take = std::min<size_t>(run, 138);
+            if (take >= 11) rle.emplace_back(18, static_cast<uint8_t>(take - 11));
+            else rle.emplace_back(17, static_cast<uint8_t>(take - 3));
+            i += take;
+        } else if (all[i] != 0 && run >= 4) {
+            rle.emplace_back(all[i], 0);
+            size_t take = std::min<size_t>(run - 1, 6);
+            rle.emplace_back(16, static_cast<uint8_t>(take - 3));
+            i += 1 + take;
+        } else {
+            rle.emplace_back(all[i], 0);
+            i += 1;
+        }
+    }
+    std::vector<uint32_t> clFreq(19, 0);
+    for (const auto& r : rle) clFreq[r.first]++;
+    std::vector<uint8_t> clLengths;
+    buildCodeLengths(clFreq, 7, clLengths);
+    static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    int clCount = 19;
+    while (clCount > 4 && clLengths[order[clCount - 1]] == 0) --clCount;
+
+    // Size of each encoding in bits, to pick the cheapest.
+    auto payloadBits = [&](const std::vector<uint8_t>& lit, const std::vector<uint8_t>& dist) {
+        uint64_t bits = lit[256];
+        for (const auto& t : tokens) {
+            if (t.distance == 0) {
+                bits += lit[t.lengthOrLiteral];
+            } else {
+                int ls = lengthSymbols[t.lengthOrLiteral], ds = distanceSymbols[t.distance];
+                bits += lit[257 + ls] + kLengthExtra[ls] + dist[ds] + kDistanceExtra[ds];
+            }
+        }
+        return bits;
+    };
+    std::vector<uint8_t> fixedLit(288), fixedDist(30, 5);
+    for (int s = 0; s < 288; ++s) fixedLit[s] = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+    uint64_t dynamicBits = 3 + 14 + 3 * clCount + payloadBits(litLengths, distLengths);
+    for (const auto& r : rle) dynamicBits += clLengths[r.first] + (r.first == 16 ? 2 : r.first == 17 ? 3 : r.first == 18 ? 7 : 0);
+    uint64_t fixedBits = 3 + payloadBits(fixedLit, fixedDist);
+    uint64_t storedBits = (rawSize + 4 * ((rawSize + 65534) / 65535 + (rawSize == 0))) * 8 + 3 + 7;
+
+    if (storedBits <= dynamicBits && storedBits <= fixedBits) {
+        size_t pos = 0;
+        do {
+            size_t chunk = std::min<size_t>(rawSize - pos, 65535);
+            bool final = last && pos + chunk == rawSize;
+            writer.put(final ? 1 : 0, 1);
+            writer.put(0, 2);
+            writer.flushToByte();
+            writer.out += static_cast<char>(chunk & 0xFF);
+            writer.out += static_cast<char>(chunk >> 8);
+            writer.out += static_cast<char>(~chunk & 0xFF);
+            writer.out += static_cast<char>((~chunk >> 8) & 0xFF);
+            writer.out.append(raw + pos, chunk);
+            pos += chunk;
+        } while (pos < rawSize);
+        return;
+    }
+
+    bool useFixed = fixedBits <= dynamicBits;
+    const std::vector<uint8_t>& lit = useFixed ? fixedLit : litLengths;
+    const std::vector<uint8_t>& dist = useFixed ? fixedDist : distLengths;
+    writer.put(last ? 1 : 0, 1);
+    writer.put(useFixed ? 1 : 2, 2);
+    if (!useFixed) {
+        writer.put(litCount - 257, 5);
+        writer.put(distCount - 1, 5);
+        writer.put(clCount - 4, 4);
+        for (int i = 0; i < clCount; ++i) writer.put(clLengths[order[i]], 3);
+        std::vector<uint16_t> clCodes = canonicalCodes(clLengths);
+        for (const auto& r : rle) {
+            writer.put(clCodes[r.first], clLengths[r.first]);
+            if (r.first == 16) writer.put(r.second, 2);
+            else if (r.first == 17) writer.put(r.second, 3);
+            else if (r.first == 18) writer.put(r.second, 7);
+        }
+    }
+    std::vector<uint16_t> litCodes = canonicalCodes(lit);
+    std::vector<uint16_t> distCodes = canonicalCodes(dist);
+    for (const auto& t : tokens) {
+        if (t.distance == 0) {
+            writer.put(litCodes[t.lengthOrLiteral], lit[t.lengthOrLiteral]);
+            continue;
+        }
+        int ls = lengthSymbols[t.lengthOrLiteral], ds = distanceSymbols[t.distance];
+        writer.put(litCodes[257 + ls], lit[257 + ls]);
+        if (kLengthExtra[ls]) writer.put(t.lengthOrLiteral - kLengthBase[ls], kLengthExtra[ls]);
+        writer.put(distCodes[ds], dist[ds]);
+        if (kDistanceExtra[ds]) writer.put(t.distance - kDistanceBase[ds], kDistanceExtra[ds]);
+    }
+    writer.put(litCodes[256], lit[256]);
+}
+}
+
+/**
+ * @brief Compresses data into a raw deflate stream (RFC 1951) that any inflater accepts.
+ *
+ * Matches are found with hash chains over a 32 KiB window; levels 1-3 take the
+ * first good match (greedy), 4-9 use lazy matching with longer chains. Blocks
+ * are encoded stored, fixed or dynamic, whichever is smallest.
+ * @param data The bytes to compress.
+ * @param level 0 (store) to 9 (best compression).
+ * @return The compressed stream.
+ */
+std::string deflateRaw(std::string_view data, int level) {
+    level = std::max(0, std::min(9, level));
+    BitWriter writer;
+    writer.out.reserve(data.size() / 3 + 64);
+    const char* src = data.data();
+    const size_t n = data.size();
+
+    if (n > static_cast<size_t>(INT32_MAX)) {
+        throw std::runtime_error("deflate input larger than 2 GiB");
+    }
+
+    if (level == 0) {
+        size_t pos = 0;
+        do {
+            size_t chunk = std::min<size_t>(n - pos, 65535);
+            bool last = pos + chunk == n;
+            writer.put(last ? 1 : 0, 1);
+            writer.put(0, 2);
+            writer.flushToByte();
+            writer.out += static_cast<char>(chunk & 0xFF);
+            writer.out += static_cast<char>(chunk >> 8);
+            writer.out += static_cast<char>(~chunk & 0xFF);
+            writer.out += static_cast<char>((~chunk >> 8) & 0xFF);
+            writer.out.append(src + pos, chunk);
+            pos += chunk;
+        } while (pos < n);
+        return writer.out;
+    }
+
+    const DeflateLevel config = kDeflateLevels[level];
+    const bool lazy = level >= 4;
+    // Most course pages are a few KiB, so the tables are sized to the input
+    // rather than always clearing the full 32 KiB window.
+    int hashBits = 8;
+    while (hashBits < 15 && (size_t{1} << hashBits) < n) ++hashBits;
+    const size_t kWindow = 32768;
+    const size_t kMaxTokens = 1 << 15;
+    std::vector<int32_t> head(size_t{1} << hashBits, -1);
+    std::vector<int32_t> prev(std::min(kWindow, size_t{1} << hashBits), -1);
+    const size_t prevMask = prev.size() - 1;
+
+    auto hashAt = [&](size_t pos) {
+        uint32_t v = static_cast<uint8_t>(src[pos]) | (static_cast<uint8_t>(src[pos + 1]) << 8) |
+                     (static_cast<uint8_t>(src[pos + 2]) << 16);
+        return (v * 2654435761u) >> (32 - hashBits);
+    };
+    auto insert = [&](size_t pos) {
+        if (pos + 3 > n) return;
+        uint32_t h = hashAt(pos);
+        prev[pos & prevMask] = head[h];
+        head[h] = static_cast<int32_t>(pos);
+    };
+    auto matchLength = [&](size_t a, size_t b, size_t limit) {
+        size_t len = 0;
+        while (len + 8 <= limit) {
+            uint64_t x, y;
+            std::memcpy(&x, src + a + len, 8);
+            std::memcpy(&y, src + b + len, 8);
+            if (x != y) return len + (__builtin_ctzll(x ^ y) >> 3);
+            len += 8;
+        }
+        while (len < limit && src[a + len] == src[b + len]) ++len;
+        return len;
+    };
+    // Longest match for pos among earlier positions with the same hash.
+    auto longestMatch = [&](size_t pos, size_t prevLength, size_t& bestDistance) {
+        size_t limit = std::min<size_t>(258, n - pos);
+        if (limit < 3 || prevLength >= limit) return size_t{0};
+        size_t best = prevLength;
+        int chain = prevLength >= static_cast<size_t>(config.good) ? config.chain >> 2 : config.chain;
+        int32_t candidate = head[hashAt(pos)];
+        while (candidate >= 0 && chain-- > 0) {
+            size_t c = static_cast<size_t>(candidate);
+            if (c >= pos || pos - c >= kWindow) break;
+            if (src[c + best] == src[pos + best] || best < 3) {
+                size_t len = matchLength(c, pos, limit);
+                if (len > best) {
+                    best = len;
+                    bestDistance = pos - c;
+                    if (len >= static_cast<size_t>(config.nice) || len == limit) break;
+                }
+            }
+            int32_t next = prev[c & prevMask];
+            if (next >= candidate) break;
+            candidate = next;
+        }
+        return best > prevLength ? best : size_t{0};
+    };
+
+    std::vector<DeflateToken> tokens;
+    tokens.reserve(kMaxTokens + 2);
+    size_t blockStart = 0;
+    auto flushBlock = [&](size_t blockEnd, bool last) {
+        writeDeflateBlock(writer, tokens, src + blockStart, blockEnd - blockStart, last);
+        tokens.clear();
+        blockStart = blockEnd;
+    };
+    auto literal = [&](size_t pos) { tokens.push_back({static_cast<uint8_t>(src[pos]), 0}); };
+
+    size_t pos = 0;
+    if (!lazy) {
+        while (pos < n) {
+            size_t distance = 0;
+            size_t length = longestMatch(pos, 2, distance);
+            if (length >= 3) {
+                tokens.push_back({static_cast<uint16_t>(length), static_cast<uint16_t>(distance)});
+                // Long matches are skipped without indexing their interior, which is what keeps level 1-3 fast.
+                if (length <= static_cast<size_t>(config.lazy)) {
+                    for (size_t k = 0; k < length; ++k) insert(pos + k);
+                } else {
+                    insert(pos);
+                }
+                pos += length;
+            } else {
+                insert(pos);
+                literal(pos);
+                pos += 1;
+            }
+            if (tokens.size() >= kMaxTokens) flushBlock(pos, false);
+        }
+    } else {
+        size_t prevLength = 0, prevDistance = 0;
+        bool pendingLiteral = false; // Whether the byte at pos - 1 still needs to be emitted
+        while (pos < n) {
+            size_t distance = 0;
+            size_t length = 0;
+            if (prevLength < static_cast<size_t>(config.lazy)) {
+                length = longestMatch(pos, std::max<size_t>(prevLength, 2), distance);
+            }
+            insert(pos);
+            if (prevLength >= 3 && length <= prevLength) {
+                // The match that started one byte earlier is at least as good: take it.
+                tokens.push_back({static_cast<uint16_t>(prevLength), static_cast<uint16_t>(prevDistance)});
+                size_t matchEnd = pos - 1 + prevLength;
+                for (size_t k = pos + 1; k < matchEnd; ++k) insert(k);
+                pos = matchEnd;
+                prevLength = 0;
+                pendingLiteral = false;
+            } else {
+                if (pendingLiteral) literal(pos - 1);
+                pendingLiteral = true;
+                prevLength = length;
+                prevDistance = distance;
+                pos += 1;
+            }
+            if (tokens.size() >= kMaxTokens) {
+                // Block boundaries must fall between tokens; the pending byte starts the next block.
+                flushBlock(pendingLiteral ? pos - 1 : pos, false);
+            }
+        }
+        if (pendingLiteral) literal(n - 1);
+    }
+    flushBlock(n, true);
+    writer.flushToByte();
+    return writer.out;
+}
+
+/**
+ * @brief Compresses new content for an entry and updates its metadata to match.
+ *
+ * Falls back to storing the content when deflate would not make it smaller.
+ * @param entry The entry's existing metadata (name, times, attributes).
+ * @param content The new uncompressed content.
+ * @param level Deflate level, 0 to store.
+ * @param compressed Receives the bytes to write for the entry.
+ * @return The entry with method, CRC-32 and sizes filled in.
+ */
+ZipEntry packEntry(ZipEntry entry, std::string_view content, int level, std::string& compressed) {
+    entry.crc32 = crc32Update(0, content.data(), content.size());
+    entry.uncompressedSize = content.size();
+    entry.flags &= ~0x0008;
+    if (level > 0) {
+        compressed = deflateRaw(content, level);
+        if (compressed.size() < content.size()) {
+            entry.method = 8;
+            entry.compressedSize = compressed.size();
+            return entry;
+        }
+    }
+    entry.method = 0;
+    compressed.assign(content);
+    entry.compressedSize = compressed.size();
+    return entry;
+}
+
+/**
+ * @brief "bench-deflate" command: measures the built-in encoder on real course content.
+ *
+ * Text entries of the given archives (or the given files) are compressed at
+ * each level and decompressed again to check the round trip. Build with
+ * -DCANVASUPDATER_WITH_ZLIB and -lz to compare against zlib at the same levels.
+ * @param argc Argument count, excluding the program and command names.
+ * @param argv Argument values.
+ * @return 0 on success, 1 on error.
+ */
+int benchDeflateCommand(int argc, char* argv[]) {
+    std::vector<int> levels;
+    int iterations = 3;
+    std::vector<std::string> inputs;
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        try {
+            if (arg == "-level" && i + 1 < argc) {
+                levels.push_back(std::max(0, std::min(9, std::stoi(argv[++i]))));
+            } else if (arg == "-iterations" && i + 1 < argc) {
+                iterations = std::max(1, std::stoi(argv[++i]));
+            } else {
+                inputs.push_back(arg);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: Invalid number for " << arg << " argument." << std::endl;
+            return 1;
+        }
+    }
+    if (inputs.empty()) {
+        std::cerr << "Usage: bench-deflate [-level <0-9>]... [-iterations N] <archive.imscc|file>..." << std::endl;
+        return 1;
+    }
+    if (levels.empty()) levels = {1, 3, 6, 9};
+
+    std::vector<std::string> corpus;
+    uint64_t corpusBytes = 0;
+    try {
+        for (const auto& input : inputs) {
+            std::string extension = std::filesystem::path(input).extension().string();
+            if (extension == ".imscc" || extension == ".zip") {
+                ZipArchive archive(input);
+                for (const auto& entry : archive.entries()) {
+                    if (hasTextExtension(entry.name)) corpus.push_back(archive.extract(entry));
+                }
+            } else {
+                corpus.emplace_back(MappedFile(input).view());
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Could not load benchmark input: " << e.what() << std::endl;
+        return 1;
+    }
+    for (const auto& item : corpus) corpusBytes += item.size();
+    if (corpusBytes == 0) {
+        std::cerr << "Error: No text content found to compress." << std::endl;
+        return 1;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    auto measure = [&](const std::function<size_t(const std::string&)>& compress) {
+        size_t compressedBytes = 0;
+        auto start = Clock::now();
+        for (int it = 0; it < iterations; ++it) {
+            compressedBytes = 0;
+            for (const auto& item : corpus) compressedBytes += compress(item);
+        }
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        double mbPerSecond = corpusBytes * static_cast<double>(iterations) / elapsed.count() / 1e6;
+        return std::make_pair(mbPerSecond, static_cast<double>(corpusBytes) / std::max<size_t>(compressedBytes, 1));
+    };
+
+    std::cout << corpus.size() << " text entries, " << corpusBytes << " bytes, " << iterations << " iterations\n"
+              << std::left << std::setw(8) << "level" << std::setw(14) << "encoder" << std::setw(12) << "MB/s"
+              << "ratio" << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    for (int level : levels) {
+        for (const auto& item : corpus) {
+            std::string packed = deflateRaw(item, level);
+            if (inflateRaw(reinterpret_cast<const uint8_t*>(packed.data()), packed.size(), item.size()) != item) {
+                std::cerr << "Error: Round trip failed at level " << level << "." << std::endl;
+                return 1;
+            }
+        }
+        auto builtin = measure([&](const std::string& item) { return deflateRaw(item, level).size(); });
+        std::cout << std::setw(8) << level << std::setw(14) << "built-in" << std::setw(12) << builtin.first
+                  << builtin.second << std::endl;
+#ifdef CANVASUPDATER_WITH_ZLIB
+        auto zlib = measure([&](const std::string& item) {
+            z_stream stream{};
+            deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+            std::string packed(deflateBound(&stream, item.size()), '\0');
+            stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(item.data()));
+            stream.avail_in = static_cast<uInt>(item.size());
+            stream.next_out = reinterpret_cast<Bytef*>(&packed[0]);
+            stream.avail_out = static_cast<uInt>(packed.size());
+            deflate(&stream, Z_FINISH);
+            size_t size = stream.total_out;
+            deflateEnd(&stream);
+            return size;
+        });
+        std::cout << std::setw(8) << level << std::setw(14) << "zlib" << std::setw(12) << zlib.first << zlib.second
+                  << std::endl;
+#endif
+    }
+    return 0;
+}
+
+// --- Thread-scaling benchmark ---
+// Rewrites synthetic archives of a few typical shapes at increasing thread
+// counts and reports how well each shape scales, and which stage runs out of
+// headroom first.
+
+namespace {
+
+struct BenchProfile {
+    std::string name;
+    std::filesystem::path archive;
+    size_t entries = 0;
+    uint64_t bytes = 0; // Uncompressed
+};
+
+/**
+ * @brief Produces pseudo-random course text with a DateReplace directive every few lines.
+ */
+std::string syntheticCourseText(std::mt19937& random, size_t size, bool xml) {
+    static const char* const words[] = {"lab", "report", "circuit", "gate", "adder", "latch", "timing", "quiz",
+                                        "due", "section", "review", "exam", "karnaugh", "state", "machine", "bus"};
+    static const char* const formats[] = {"_M D, Y_", "_W, M D_", "_m/d_", "_D_"};
+    std::string text = xml ? "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<items>\n" : "<html><body><table>\n";
+    while (text.size() < size) {
+        text += xml ? "  <item><title>" : "<tr><td>";
+        for (int w = 0; w < 12; ++w) {
+            text += words[random() % 16];
+            text += ' ';
+        }
+        text += xml ? "</title><due><span class=\"DateReplace(" : "</td><td><span class=\"DateReplace(";
+        text += formats[random() % 4];
+        text += ", " + std::to_string(random() % 180) + ")\">Jan 1, 2026</span>";
+        text += xml ? "</due></item>\n" : "</td></tr>\n";
+    }
+    text += xml ? "</items>\n" : "</table></body></html>\n";
+    return text;
+}
+
+/**
+ * @brief Writes a synthetic archive for one benchmark profile.
+ * @param name "pages" (many small pages), "xml" (a few huge XML files) or "media" (mostly binary files).
+ * @param path Where to write the archive.
+ * @param megabytes Approximate uncompressed size of the archive.
+ */
+BenchProfile writeBenchProfile(const std::string& name, const std::filesystem::path& path, size_t megabytes) {
+    std::mt19937 random(42);
+    uint64_t target = static_cast<uint64_t>(megabytes) << 20;
+    BenchProfile profile{name, path};
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) throw std::runtime_error("could not create '" + path.string() + "'");
+    ZipWriter writer(out);
+    auto add = [&](const std::string& entryName, const std::string& content, int level) {
+        ZipEntry entry;
+        entry.name = entryName;
+        entry.modDate = (46 << 9) | (1 << 5) | 12; // 2026-01-12
+        std::string compressed;
+        entry = packEntry(entry, content, level, compressed);
+        writer.addRaw(entry, compressed);
+        profile.entries++;
+        profile.bytes += content.size();
+    };
+
+    if (name == "pages") {
+        for (int n = 0; profile.bytes < target; ++n) {
+            add("wiki_content/page" + std::to_string(n) + ".html",
+                syntheticCourseText(random, 2048 + random() % 8192, false), 6);
+        }
+    } else if (name == "xml") {
+        for (int n = 0; n < 4; ++n) {
+            add("course_settings/export" + std::to_string(n) + ".xml", syntheticCourseText(random, target / 4, true), 6);
+        }
+    } else if (name == "media") {
+        for (int n = 0; n < 16; ++n) {
+            add("wiki_content/page" + std::to_string(n) + ".html", syntheticCourseText(random, 8192, false), 6);
+        }
+        for (int n = 0; profile.bytes < target; ++n) {
+            std::string media(2 << 20, '\0');
+            for (auto& byte : media) byte = static_cast<char>(random());
+            add("web_resources/media/clip" + std::to_string(n) + ".mp4", media, 0);
+        }
+    } else {
+        throw std::runtime_error("unknown profile '" + name + "' (expected pages, xml or media)");
+    }
+    writer.finish();
+    if (!out) throw std::runtime_error("could not write '" + path.string() + "'");
+    return profile;
+}
+
+/**
+ * @brief Sums the busy time of every worker slot by pool, e.g. "inflate-3" counts towards "inflate".
+ * @return Per pool: total busy seconds and number of workers.
+ */
+std::map<std::string, std::pair<double, int>> poolBusyTimes() {
+    std::map<std::string, std::pair<double, int>> pools;
+    std::lock_guard<std::mutex> lock(g_progress.boardMutex);
+    for (auto& slot : g_progress.workers) {
+        std::string pool = slot.name.substr(0, slot.name.rfind('-'));
+        pools[pool].first += slot.busyNs.load() / 1e9;
+        pools[pool].second++;
+    }
+    return pools;
+}
+
+} // namespace
+
+/**
+ * @brief Implements "bench-scaling": sweeps thread counts over synthetic and given archives.
+ *
+ * For every profile and thread count the archive is rewritten several times and
+ * the fastest run is reported with its throughput, speedup over the first
+ * thread count, parallel efficiency, and how busy each worker pool was.
+ * @return 0 on success, 1 on error.
+ */
+int benchScalingCommand(int argc, char* argv[]) {
+    std::vector<unsigned> threadCounts;
+    std::vector<std::string> profileNames;
+    std::vector<std::string> archives;
+    size_t megabytes = 64;
+    int iterations = 3;
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        try {
+            if (arg == "-threads" && i + 1 < argc) {
+                std::stringstream list(argv[++i]);
+                std::string item;
+                while (std::getline(list, item, ',')) threadCounts.push_back(static_cast<unsigned>(std::max(1, std::stoi(item))));
+            } else if (arg == "-profile" && i + 1 < argc) {
+                profileNames.push_back(argv[++i]);
+            } else if (arg == "-mb" && i + 1 < argc) {
+                megabytes = static_cast<size_t>(std::max(1, std::stoi(argv[++i])));
+            } else if (arg == "-iterations" && i + 1 < argc) {
+                iterations = std::max(1, std::stoi(argv[++i]));
+            } else {
+                archives.push_back(arg);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: Invalid number for " << arg << " argument." << std::endl;
+            return 1;
+        }
+    }
+    if (threadCounts.empty()) {
+        for (unsigned t = 1; t < defaultThreadCount(); t *= 2) threadCounts.push_back(t);
+        threadCounts.push_back(defaultThreadCount());
+    }
+    if (profileNames.empty() && archives.empty()) profileNames = {"pages", "xml", "media"};
+
+    std::filesystem::path workDir = std::filesystem::temp_directory_path() /
+                                    ("canvasupdater-bench-" + std::to_string(getpid()));
+    int status = 0;
+    try {
+        std::filesystem::create_directories(workDir);
+        std::vector<BenchProfile> profiles;
+        for (const auto& name : profileNames) {
+            std::cout << "Generating profile '" << name << "'..." << std::endl;
+            profiles.push_back(writeBenchProfile(name, workDir / (name + ".imscc"), megabytes));
+        }
+        for (const auto& archive : archives) {
+            ZipArchive zip(archive);
+            BenchProfile profile{std::filesystem::path(archive).stem().string(), archive, zip.entries().size()};
+            for (const auto& entry : zip.entries()) profile.bytes += entry.uncompressedSize;
+            profiles.push_back(profile);
+        }
+
+        RewriteOptions options;
+        options.startDate.tm_year = 126;
+        options.startDate.tm_mon = 0;
+        options.startDate.tm_mday = 12;
+        std::mktime(&options.startDate);
+        options.ioThreads = cpuBudget().ioThreads;
+
+        std::cout << std::fixed << std::setprecision(2);
+        for (const auto& profile : profiles) {
+            std::cout << "\n" << profile.name << ": " << profile.entries << " entries, "
+                      << profile.bytes / 1e6 << " MB uncompressed\n"
+                      << std::left << std::setw(9) << "threads" << std::setw(10) << "seconds" << std::setw(10)
+                      << "MB/s" << std::setw(9) << "speedup" << std::setw(12) << "efficiency" << "pool busy" << std::endl;
+            double baseSeconds = 0;
+            for (unsigned threads : threadCounts) {
+                options.threads = threads;
+                double best = 0;
+                std::map<std::string, std::pair<double, int>> bestPools;
+                for (int it = 0; it < iterations; ++it) {
+                    resetWorkerBoard();
+                    std::ostringstream quiet;
+                    std::streambuf* saved = std::cout.rdbuf(quiet.rdbuf());
+                    auto start = std::chrono::steady_clock::now();
+                    bool ok = rewriteArchives({ArchiveJob{profile.archive, workDir / "out.imscc"}}, options);
+                    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                    std::cout.rdbuf(saved);
+                    if (!ok) throw std::runtime_error("rewriting '" + profile.archive.string() + "' failed");
+                    if (it == 0 || elapsed.count() < best) {
+                        best = elapsed.count();
+                        bestPools = poolBusyTimes();
+                    }
+                }
+                if (baseSeconds == 0) baseSeconds = best;
+                double speedup = baseSeconds / best;
+                std::cout << std::setw(9) << threads << std::setw(10) << best << std::setw(10)
+                          << profile.bytes / 1e6 / best << std::setw(9) << speedup << std::setw(12)
+                          << std::to_string(static_cast<int>(speedup * threadCounts.front() / threads * 100 + 0.5)) + "%";
+                // Share of the pool's capacity spent on tasks; a pool near 100% is the bottleneck.
+                for (const auto& [pool, busy] : bestPools) {
+                    std::cout << pool << " " << std::setprecision(0) << busy.first / (best * busy.second) * 100
+                              << "% x" << busy.second << "  " << std::setprecision(2);
+                }
+                std::cout << std::endl;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Benchmark failed: " << e.what() << std::endl;
+        status = 1;
+    }
+    std::error_code ignored;
+    std::filesystem::remove_all(workDir, ignored);
+    return status;
+}
+
+namespace {
+
+// What the kernel counted for this process at one point in time.
+struct IoSample {
+    double wallSeconds = 0;
+    double cpuSeconds = 0;        // User and system time of all threads, finished ones included
+    uint64_t storageRead = 0;     // read_bytes: fetched from the device
+    uint64_t storageWritten = 0;  // write_bytes: sent to the device
+    uint64_t calledRead = 0;      // rchar: asked for by read calls, cached or not
+    uint64_t calledWritten = 0;   // wchar
+    uint64_t majorFaults = 0;     // Page faults on the mapped input that had to wait for the disk
+    double blockedSeconds = -1;   // Block I/O delay from delay accounting, -1 if it is off
+};
+
+IoSample sampleIo() {
+    IoSample sample;
+    sample.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#ifndef _WIN32
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    sample.cpuSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec +
+                        usage.ru_stime.tv_usec / 1e6;
+    sample.majorFaults = static_cast<uint64_t>(usage.ru_majflt);
+#endif
+#ifdef __linux__
+    std::ifstream io("/proc/self/io");
+    std::string key;
+    uint64_t value;
+    while (io >> key >> value) {
+        if (key == "read_bytes:") sample.storageRead = value;
+        else if (key == "write_bytes:") sample.storageWritten = value;
+        else if (key == "rchar:") sample.calledRead = value;
+        else if (key == "wchar:") sample.calledWritten = value;
+    }
+    std::ifstream enabled("/proc/sys/kernel/task_delayacct");
+    int delayAccounting = 0;
+    if (enabled >> delayAccounting && delayAccounting) {
+        // Field 42 of /proc/self/stat, after the parenthesised command name.
+        std::string stat;
+        std::getline(std::ifstream("/proc/self/stat"), stat);
+        std::istringstream fields(stat.substr(stat.rfind(')') + 2));
+        std::string field;
+        for (int n = 3; n <= 42 && fields >> field; ++n) {
+            if (n == 42) sample.blockedSeconds = std::stod(field) / sysconf(_SC_CLK_TCK);
+        }
+    }
+#endif
+    return sample;
+}
+
+/**
+ * @brief Writes a file's dirty pages back and drops all of its pages from the page cache.
+ * @return False if the file could not be opened or the advice was refused.
+ */
+bool dropFromPageCache(const std::filesystem::path& path) {
+#if defined(_WIN32) || defined(__APPLE__)
+    (void)path;
+    return false;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    fdatasync(fd); // Dirty pages are not dropped, so write them first
+    bool dropped = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+    close(fd);
+    return dropped;
+#endif
+}
+
+} // namespace
+
+/**
+ * @brief Implements "bench-io": separates cold and warm page-cache throughput.
+ *
+ * Each archive is rewritten several times with its input and output dropped
+ * from the page cache before every run, then several times after a priming
+ * run with both left cached. The output is synced inside the timed region,
+ * so both modes pay for getting it to the device. For each mode the median
+ * run is reported with the bytes the kernel read from and wrote to storage,
+ * major page faults on the mapped input, and CPU time. Time blocked in I/O
+ * comes from the kernel's delay accounting when it is enabled
+ * (kernel.task_delayacct); the difference between the cold and warm medians
+ * is shown either way, as the compute work of both is the same.
+ * @return 0 on success, 1 on error.
+ */
+int benchIoCommand(int argc, char* argv[]) {
+    std::vector<std::string> archives;
+    unsigned threads = defaultThreadCount();
+    int iterations = 3;
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        try {
+            if (arg == "-j" && i + 1 < argc) {
+                threads = static_cast<unsigned>(std::max(1, std::stoi(argv[++i])));
+            } else if (arg == "-iterations" && i + 1 < argc) {
+                iterations = std::max(1, std::stoi(argv[++i]));
+            } else {
+                archives.push_back(arg);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: Invalid number for " << arg << " argument." << std::endl;
+            return 1;
+        }
+    }
+    if (archives.empty()) {
+        std::cerr << "Usage: bench-io [-j <threads>] [-iterations N] <archive.imscc>..." << std::endl;
+        return 1;
+    }
+
+    RewriteOptions options;
+    options.startDate.tm_year = 126;
+    options.startDate.tm_mon = 0;
+    options.startDate.tm_mday = 12;
+    std::mktime(&options.startDate);
+    options.threads = threads;
+    options.ioThreads = cpuBudget().ioThreads;
+
+    int status = 0;
+    std::cout << std::fixed << std::setprecision(2);
+    for (const auto& archive : archives) {
+        if (isS3Path(archive) || isCanvasPath(archive)) {
+            std::cerr << "Error: bench-io measures local archives only, not '" << archive << "'." << std::endl;
+            return 1;
+        }
+        std::filesystem::path input = std::filesystem::absolute(archive);
+        std::filesystem::path output = input;
+        output += ".bench-io-" + std::to_string(getpid()); // Same filesystem as the input
+        try {
+            uint64_t inputBytes = std::filesystem::file_size(input);
+            std::cout << "\n" << input.filename().string() << ": " << inputBytes / 1e6 << " MB, " << threads
+                      << " compute threads\n"
+                      << std::left << std::setw(6) << "cache" << std::setw(10) << "seconds" << std::setw(9) << "MB/s"
+                      << std::setw(11) << "dev read" << std::setw(12) << "dev write" << std::setw(11) << "sys read"
+                      << std::setw(11) << "sys write" << std::setw(9) << "majflt" << std::setw(9) << "cpu s"
+                      << "blocked s" << std::endl;
+
+            double medians[2] = {};
+            for (int mode = 0; mode < 2; ++mode) {
+                bool cold = mode == 0;
+                std::vector<std::pair<double, IoSample>> runs; // Seconds and counter deltas
+                for (int it = cold ? 0 : -1; it < iterations; ++it) { // Warm runs start with a priming run
+                    if (cold) {
+                        if (!dropFromPageCache(input)) {
+                            throw std::runtime_error("could not drop the input from the page cache");
+                        }
+                        if (std::filesystem::exists(output)) dropFromPageCache(output);
+                    }
+                    std::ostringstream quiet;
+                    std::streambuf* saved = std::cout.rdbuf(quiet.rdbuf());
+                    IoSample before = sampleIo();
+                    bool ok = rewriteArchives({ArchiveJob{input, output}}, options);
+#ifndef _WIN32
+                    int fd = ok ? open(output.c_str(), O_RDONLY) : -1;
+                    if (fd >= 0) {
+                        fsync(fd);
+                        close(fd);
+                    }
+#endif
+                    IoSample after = sampleIo();
+                    std::cout.rdbuf(saved);
+                    if (!ok) throw std::runtime_error("rewriting failed");
+                    if (it < 0) continue;
+
+                    IoSample delta;
+                    delta.cpuSeconds = after.cpuSeconds - before.cpuSeconds;
+                    delta.storageRead = after.storageRead - before.storageRead;
+                    delta.storageWritten = after.storageWritten - before.storageWritten;
+                    delta.calledRead = after.calledRead - before.calledRead;
+                    delta.calledWritten = after.calledWritten - before.calledWritten;
+                    delta.majorFaults = after.majorFaults - before.majorFaults;
+                    if (after.blockedSeconds >= 0) delta.blockedSeconds = after.blockedSeconds - before.blockedSeconds;
+                    runs.emplace_back(after.wallSeconds - before.wallSeconds, delta);
+                }
+                std::sort(runs.begin(), runs.end(),
+                          [](const auto& a, const auto& b) { return a.first < b.first; });
+                const auto& [seconds, median] = runs[runs.size() / 2];
+                medians[mode] = seconds;
+                auto megabytes = [](uint64_t bytes) { return std::to_string(bytes / 1000000) + " MB"; };
+                std::cout << std::setw(6) << (cold ? "cold" : "warm") << std::setw(10) << seconds << std::setw(9)
+                          << inputBytes / 1e6 / seconds << std::setw(11) << megabytes(median.storageRead)
+                          << std::setw(12) << megabytes(median.storageWritten) << std::setw(11)
+                          << megabytes(median.calledRead) << std::setw(11) << megabytes(median.calledWritten)
+                          << std::setw(9) << median.majorFaults << std::setw(9) << median.cpuSeconds;
+                if (median.blockedSeconds >= 0) std::cout << median.blockedSeconds;
+                else std::cout << "n/a";
+                std::cout << std::endl;
+            }
+            std::cout << "cold - warm: " << medians[0] - medians[1] << " s spent waiting for storage"
+                      << " (blocked s needs kernel.task_delayacct=1)" << std::endl;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: Benchmark of '" << archive << "' failed: " << e.what() << std::endl;
+            status = 1;
+        }
+        std::error_code ignored;
+        std::filesystem::remove(output, ignored);
+    }
+    return status;
+}
+
+// --- Engine equivalence ---
+
+namespace {
+
+/**
+ * @brief Sends stdout, of this process and of the tools it starts, to /dev/null while alive.
+ */
+class QuietStdout {
+public:
+    QuietStdout() {
+        std::cout.flush();
+        std::fflush(stdout);
+        savedCout_ = std::cout.rdbuf(discard_.rdbuf());
+#ifndef _WIN32
+        savedFd_ = dup(STDOUT_FILENO);
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+#endif
+    }
+
+    ~QuietStdout() {
+        std::cout.rdbuf(savedCout_);
+#ifndef _WIN32
+        std::fflush(stdout);
+        if (savedFd_ >= 0) {
+            dup2(savedFd_, STDOUT_FILENO);
+            close(savedFd_);
+        }
+#endif
+    }
+
+private:
+    std::ostringstream discard_;
+    std::streambuf* savedCout_ = nullptr;
+    int savedFd_ = -1;
+};
+
+/**
+ * @brief Packs copies of a template directory into an archive, as html/... or copyN/html/....
+ * @return The number of entries written.
+ */
+size_t packTemplates(const std::filesystem::path& templateDir, const std::filesystem::path& archivePath, int copies) {
+    std::vector<std::filesystem::path> files;
+    for (const auto& item : std::filesystem::recursive_directory_iterator(templateDir)) {
+        if (item.is_regular_file()) files.push_back(item.path());
+    }
+    std::sort(files.begin(), files.end());
+    std::ofstream out(archivePath, std::ios::binary | std::ios::trunc);
+    if (!out) throw std::runtime_error("could not create '" + archivePath.string() + "'");
+    ZipWriter writer(out);
+    std::string base = templateDir.filename().string();
+    for (int copy = 0; copy < copies; ++copy) {
+        std::string prefix = copies == 1 ? "" : "copy" + std::to_string(copy) + "/";
+        for (const auto& file : files) {
+            std::ifstream in(file, std::ios::binary);
+            std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            ZipEntry entry;
+            entry.name = prefix + base + "/" + std::filesystem::relative(file, templateDir).generic_string();
+            entry.modDate = (46 << 9) | (1 << 5) | 12; // 2026-01-12
+            std::string compressed;
+            entry = packEntry(entry, content, 6, compressed);
+            writer.addRaw(entry, compressed);
+        }
+    }
+    writer.finish();
+    if (!out) throw std::runtime_error("could not write '" + archivePath.string() + "'");
+    return files.size() * static_cast<size_t>(copies);
+}
+
+/**
+ * @brief Rewrites an archive the way -legacy does: unzip, processDirectory(), zip.
+ */
+void rewriteWithTools(const std::filesystem::path& input, const std::filesystem::path& output,
+                      const std::filesystem::path& workDir, const RewriteOptions& options) {
+    std::filesystem::path extracted = workDir / "unzipped_archive";
+    std::error_code ignored;
+    std::filesystem::remove_all(extracted, ignored);
+    std::filesystem::remove(output, ignored); // zip -r would add to an existing archive
+    std::string command = "unzip -o \"" + input.string() + "\" -d \"" + extracted.string() + "\"";
+    if (std::system(command.c_str()) != 0) throw std::runtime_error("unzip failed");
+    processDirectory(extracted, options.startDate, options.startIndex, options.partialsDir);
+    if (!rezipDirectory(extracted.string(), output)) throw std::runtime_error("zip failed");
+}
+
+/**
+ * @brief Compares the decompressed files of two archives, ignoring directory entries and entry order.
+ * @return Names of the files that differ or exist in only one of them.
+ */
+std::vector<std::string> differingEntries(const std::filesystem::path& a, const std::filesystem::path& b) {
+    ZipArchive left(a), right(b);
+    std::map<std::string, const ZipEntry*> leftFiles, rightFiles;
+    for (const auto& entry : left.entries()) {
+        if (entry.name.empty() || entry.name.back() != '/') leftFiles[entry.name] = &entry;
+    }
+    for (const auto& entry : right.entries()) {
+        if (entry.name.empty() || entry.name.back() != '/') rightFiles[entry.name] = &entry;
+    }
+    std::vector<std::string> differing;
+    for (const auto& [name, entry] : leftFiles) {
+        auto match = rightFiles.find(name);
+        if (match == rightFiles.end()) differing.push_back(name + " (only in legacy output)");
+        else if (left.extract(*entry) != right.extract(*match->second)) differing.push_back(name);
+    }
+    for (const auto& [name, entry] : rightFiles) {
+        if (!leftFiles.count(name)) differing.push_back(name + " (only in in-process output)");
+    }
+    return differing;
+}
+
+} // namespace
+
+/**
+ * @brief Implements "compare-engines": checks the in-process engine against the legacy tool path.
+ *
+ * The corpus is the template directory packed into an archive once and as
+ * several copies, plus any archives given. Each is rewritten both ways with
+ * the same options, the decompressed files of the two outputs are compared
+ * byte for byte, and the best time of each path and the speedup are
+ * reported.
+ * @return 0 if every archive matched, 1 otherwise.
+ */
+int compareEnginesCommand(int argc, char* argv[]) {
+    std::string startDateStr = "01/12/2026";
+    std::filesystem::path templateDir = "html";
+    std::vector<std::string> archives;
+    RewriteOptions options;
+    options.threads = defaultThreadCount();
+    options.ioThreads = cpuBudget().ioThreads;
+    int copies = 5;
+    int iterations = 1;
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        try {
+            if (arg == "-start" && i + 1 < argc) {
+                startDateStr = argv[++i];
+            } else if (arg == "-i" && i + 1 < argc) {
+                options.startIndex = std::stoi(argv[++i]);
+            } else if (arg == "-j" && i + 1 < argc) {
+                options.threads = static_cast<unsigned>(std::max(1, std::stoi(argv[++i])));
+            } else if (arg == "-templates" && i + 1 < argc) {
+                templateDir = argv[++i];
+            } else if (arg == "-copies" && i + 1 < argc) {
+                copies = std::max(1, std::stoi(argv[++i]));
+            } else if (arg == "-iterations" && i + 1 < argc) {
+                iterations = std::max(1, std::stoi(argv[++i]));
+            } else {
+                archives.push_back(arg);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: Invalid number for " << arg << " argument." << std::endl;
+            return 1;
+        }
+    }
+    if (!parseStartDate(startDateStr, options.startDate)) {
+        std::cerr << "Error: Invalid start date format. Please use MM/DD/YYYY." << std::endl;
+        return 1;
+    }
+
+    std::filesystem::path workDir = std::filesystem::temp_directory_path() /
+                                    ("canvasupdater-compare-" + std::to_string(getpid()));
+    int status = 0;
+    try {
+        std::filesystem::create_directories(workDir);
+        std::vector<std::filesystem::path> corpus;
+        if (std::filesystem::is_directory(templateDir)) {
+            for (int n : {1, copies}) {
+                std::filesystem::path path = workDir / ("templates" + (n == 1 ? "" : "_x" + std::to_string(n)) + ".imscc");
+                packTemplates(templateDir, path, n);
+                corpus.push_back(path);
+                if (copies == 1) break;
+            }
+        } else if (archives.empty()) {
+            throw std::runtime_error("no template directory at '" + templateDir.string() + "' and no archives given");
+        }
+        for (const auto& archive : archives) corpus.push_back(std::filesystem::absolute(archive));
+
+        std::cout << std::fixed << std::setprecision(3) << std::left << std::setw(28) << "archive" << std::setw(9)
+                  << "entries" << std::setw(11) << "legacy s" << std::setw(13) << "in-process s" << std::setw(9)
+                  << "speedup" << "result" << std::endl;
+        for (const auto& archive : corpus) {
+            std::filesystem::path legacyOut = workDir / "legacy.imscc";
+            std::filesystem::path engineOut = workDir / "engine.imscc";
+            double legacySeconds = 0, engineSeconds = 0;
+            for (int it = 0; it < iterations; ++it) {
+                QuietStdout quiet;
+                auto start = std::chrono::steady_clock::now();
+                rewriteWithTools(archive, legacyOut, workDir, options);
+                std::chrono::duration<double> legacy = std::chrono::steady_clock::now() - start;
+                start = std::chrono::steady_clock::now();
+                if (!rewriteArchives({ArchiveJob{archive, engineOut}}, options)) {
+                    throw std::runtime_error("in-process rewrite of '" + archive.string() + "' failed");
+                }
+                std::chrono::duration<double> engine = std::chrono::steady_clock::now() - start;
+                if (it == 0 || legacy.count() < legacySeconds) legacySeconds = legacy.count();
+                if (it == 0 || engine.count() < engineSeconds) engineSeconds = engine.count();
+            }
+
+            std::vector<std::string> differing = differingEntries(legacyOut, engineOut);
+            std::cout << std::setw(28) << archive.filename().string() << std::setw(9)
+                      << ZipArchive(archive).entries().size() << std::setw(11) << legacySeconds << std::setw(13)
+                      << engineSeconds << std::setw(9) << std::setprecision(1) << legacySeconds / engineSeconds
+                      << std::setprecision(3) << (differing.empty() ? "identical" : "DIFFERENT") << std::endl;
+            for (size_t n = 0; n < differing.size() && n < 10; ++n) std::cout << "    " << differing[n] << std::endl;
+            if (differing.size() > 10) std::cout << "    ... and " << differing.size() - 10 << " more" << std::endl;
+            if (!differing.empty()) status = 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Comparison failed: " << e.what() << std::endl;
+        status = 1;
+    }
+    std::error_code ignored;
+    std::filesystem::remove_all(workDir, ignored);
+    return status;
+}
+
+// --- Distributed work queue ---
+// A queue is a directory on a filesystem shared by every host:
+//   settings        start date, start index, level and partials, written once by "queue init"
+//   pending/N.job   one line, "<input>\t<output>"
+//   leased/N.job@W  claimed by worker W; W keeps the file's mtime fresh while it works
+//   done/N.job      the job line followed by the result
+//   failed/N.job    the job line followed by the error
+// Every state change is a rename, which is atomic on one filesystem, so two
+// workers can never both claim or both complete the same item. A lease whose
+// mtime is older than the lease time is renamed back to pending by whichever
+// worker notices first. Outputs are written under a private name and renamed
+// into place, and a rewrite is deterministic, so if a slow worker and the one
+// that took over its expired lease both finish, they publish the same bytes.
+
+namespace {
+
+const char kQueueSettings[] = "settings";
+
+struct QueueDirs {
+    explicit QueueDirs(const std::filesystem::path& root)
+        : root(root), pending(root / "pending"), leased(root / "leased"), done(root / "done"), failed(root / "failed") {}
+    std::filesystem::path root, pending, leased, done, failed;
+};
+
+/**
+ * @brief Sets a file's modification time to now, as the file server sees it.
+ * @return False if the file does not exist (any more).
+ */
+bool touchFile(const std::filesystem::path& path) {
+#ifndef _WIN32
+    return utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == 0;
+#else
+    std::error_code error;
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+    return !error;
+#endif
+}
+
+/**
+ * @brief The current time on the shared filesystem's clock.
+ *
+ * Lease ages are measured against this rather than the local clock, so hosts
+ * whose clocks disagree still agree on when a lease has expired.
+ */
+std::filesystem::file_time_type sharedNow(const QueueDirs& queue) {
+    std::filesystem::path clock = queue.root / ".clock";
+    if (!touchFile(clock)) {
+        std::ofstream(clock).flush();
+    }
+    return std::filesystem::last_write_time(clock);
+}
+
+/**
+ * @brief Sorted names of the files in one queue state directory.
+ */
+std::vector<std::string> queueItems(const std::filesystem::path& dir) {
+    std::vector<std::string> names;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, error)) {
+        names.push_back(entry.path().filename().string());
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+std::string readSmallFile(const std::filesystem::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream content;
+    content << in.rdbuf();
+    return content.str();
+}
+
+/**
+ * @brief Writes a small file under a temporary name and renames it into place.
+ */
+bool writeSmallFile(const std::filesystem::path& path, const std::string& content) {
+    std::filesystem::path tmpPath = path;
+    tmpPath += ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        out << content;
+        if (!out) return false;
+    }
+    std::error_code error;
+    std::filesystem::rename(tmpPath, path, error);
+    return !error;
+}
+
+/**
+ * @brief Renames expired leases back to pending.
+ * @return Number of leases reclaimed by this call.
+ */
+int reclaimExpiredLeases(const QueueDirs& queue, std::chrono::seconds leaseTime) {
+    int reclaimed = 0;
+    auto now = sharedNow(queue);
+    for (const auto& name : queueItems(queue.leased)) {
+        std::error_code error;
+        auto modified = std::filesystem::last_write_time(queue.leased / name, error);
+        if (error || now - modified < leaseTime) continue;
+        std::string item = name.substr(0, name.find('@'));
+        std::filesystem::rename(queue.leased / name, queue.pending / item, error);
+        if (!error) {
+            std::cerr << "Warning: Lease on " << item << " held by " << name.substr(name.find('@') + 1)
+                      << " expired; returned it to the queue." << std::endl;
+            reclaimed++;
+        }
+    }
+    return reclaimed;
+}
+
+/**
+ * @brief Keeps a lease file fresh from a background thread until stopped.
+ */
+class LeaseRenewer {
+public:
+    LeaseRenewer(std::filesystem::path lease, std::chrono::seconds leaseTime)
+        : lease_(std::move(lease)), thread_([this, leaseTime] {
+              std::unique_lock<std::mutex> lock(mutex_);
+              while (!stop_) {
+                  if (stopped_.wait_for(lock, leaseTime / 3, [this] { return stop_; })) break;
+                  if (!touchFile(lease_)) {
+                      lost_ = true; // Expired and reclaimed by another worker
+                      break;
+                  }
+              }
+          }) {}
+    ~LeaseRenewer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        stopped_.notify_all();
+        thread_.join();
+    }
+    bool lost() const { return lost_; }
+
+private:
+    std::filesystem::path lease_;
+    std::mutex mutex_;
+    std::condition_variable stopped_;
+    bool stop_ = false;
+    std::atomic<bool> lost_{false};
+    std::thread thread_;
+};
+
+/**
+ * @brief Implements "queue init": turns a job list into pending work items.
+ */
+int queueInit(int argc, char* argv[]) {
+    std::string startDateStr, jobsPath, dir;
+    std::filesystem::path partialsDir;
+    int startIndex = 0, level = 6;
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        try {
+            if (arg == "-start" && i + 1 < argc) {
+                startDateStr = argv[++i];
+            } else if (arg == "-i" && i + 1 < argc) {
+                startIndex = std::stoi(argv[++i]);
+            } else if (arg == "-level" && i + 1 < argc) {
+                level = std::max(0, std::min(9, std::stoi(argv[++i])));
+            } else if (arg == "-partials" && i + 1 < argc) {
+                partialsDir = std::filesystem::absolute(argv[++i]);
+            } else if (dir.empty()) {
+                dir = arg;
+            } else {
+                jobsPath = arg;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: Invalid number for " << arg << " argument." << std::endl;
+            return 1;
+        }
+    }
+    std::tm startDate = {};
+    if (dir.empty() || jobsPath.empty() || !parseStartDate(startDateStr, startDate)) {
+        std::cerr << "Usage: queue init <queue-dir> -start MM/DD/YYYY [-i <start_index>] [-level <0-9>]"
+                  << " [-partials <dir>] <jobs.txt>\n"
+                  << "       (one job per line: <input.imscc> or <input.imscc><TAB><output.imscc>)" << std::endl;
+        return 1;
+    }
+
+    QueueDirs queue(dir);
+    if (std::filesystem::exists(queue.root / kQueueSettings)) {
+        std::cerr << "Error: '" << dir << "' already holds a queue." << std::endl;
+        return 1;
+    }
+    std::ifstream jobs(jobsPath);
+    if (!jobs) {
+        std::cerr << "Error: Could not open job list '" << jobsPath << "'." << std::endl;
+        return 1;
+    }
+    try {
+        for (const auto& sub : {queue.pending, queue.leased, queue.done, queue.failed}) {
+            std::filesystem::create_directories(sub);
+        }
+        std::string line;
+        int count = 0;
+        while (std::getline(jobs, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+            size_t tab = line.find('\t');
+            // Local paths are made absolute so workers can run from any directory.
+            auto resolve = [](const std::string& path) {
+                bool remote = isS3Path(path) || isCanvasPath(path);
+                return remote ? std::filesystem::path(path) : std::filesystem::absolute(path);
+            };
+            std::filesystem::path input = resolve(line.substr(0, tab));
+            std::filesystem::path output = resolve(tab != std::string::npos ? line.substr(tab + 1)
+                                                                            : defaultOutputPath(input.string()).string());
+            if (isCanvasPath(output.string())) {
+                throw std::runtime_error("'" + output.string() + "' is a Canvas export; outputs must be local or s3://");
+            }
+            char name[32];
+            std::snprintf(name, sizeof(name), "%06d.job", ++count);
+            if (!writeSmallFile(queue.pending / name, input.string() + "\t" + output.string() + "\n")) {
+                throw std::runtime_error(std::string("could not write work item ") + name);
+            }
+        }
+        // Written last: workers only start on a queue once its settings exist.
+        std::ostringstream settings;
+        settings << "start " << startDateStr << "\nindex " << startIndex << "\nlevel " << level << "\n";
+        if (!partialsDir.empty()) settings << "partials " << partialsDir.string() << "\n";
+        if (!writeSmallFile(queue.root / kQueueSettings, settings.str())) {
+            throw std::runtime_error("could not write queue settings");
+        }
+        std::cout << "Queued " << count << " jobs in '" << dir << "'." << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Could not create queue: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Implements "queue work": claims and rewrites items until the queue is drained.
+ *
+ * While other workers still hold leases this worker keeps polling, so work
+ * left behind by a crashed host is picked up once its lease expires.
+ */
+int queueWork(int argc, char* argv[]) {
+    std::string dir;
+    unsigned threads = defaultThreadCount();
+    std::chrono::seconds leaseTime(60);
+    std::string workerName;
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        try {
+            if (arg == "-j" && i + 1 < argc) {
+                threads = static_cast<unsigned>(std::max(1, std::stoi(argv[++i])));
+            } else if (arg == "-lease" && i + 1 < argc) {
+                leaseTime = std::chrono::seconds(std::max(3, std::stoi(argv[++i])));
+            } else if (arg == "-worker" && i + 1 < argc) {
+                workerName = argv[++i];
+            } else {
+                dir = arg;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: Invalid number for " << arg << " argument." << std::endl;
+            return 1;
+        }
+    }
+    if (dir.empty()) {
+        std::cerr << "Usage: queue work <queue-dir> [-j <threads>] [-lease <seconds>] [-worker <name>]" << std::endl;
+        return 1;
+    }
+    if (workerName.empty()) {
+        char host[256] = "host";
+#ifndef _WIN32
+        gethostname(host, sizeof(host) - 1);
+#endif
+        workerName = std::string(host) + "-" + std::to_string(getpid());
+    }
+    std::replace(workerName.begin(), workerName.end(), '/', '_');
+
+    QueueDirs queue(dir);
+    RewriteOptions options;
+    options.threads = threads;
+    options.ioThreads = cpuBudget().ioThreads;
+    {
+        std::istringstream settings(readSmallFile(queue.root / kQueueSettings));
+        std::string key, value, startDateStr;
+        while (settings >> key && std::getline(settings >> std::ws, value)) {
+            if (key == "start") startDateStr = value;
+            else if (key == "partials") options.partialsDir = value; // May contain spaces
+            else if (key == "index") options.startIndex = std::stoi(value);
+            else if (key == "level") options.level = std::stoi(value);
+        }
+        if (!parseStartDate(startDateStr, options.startDate)) {
+            std::cerr << "Error: '" << dir << "' is not an initialized queue." << std::endl;
+            return 1;
+        }
+    }
+
+    int completed = 0, failed = 0;
+    for (;;) {
+        reclaimExpiredLeases(queue, leaseTime);
+
+        // Claim the first pending item nobody else renames away first.
+        std::string item;
+        for (const auto& name : queueItems(queue.pending)) {
+            if (name.size() < 4 || name.compare(name.size() - 4, 4, ".job") != 0) continue;
+            touchFile(queue.pending / name); // Renaming keeps the mtime, so start the lease fresh
+            std::error_code error;
+            std::filesystem::rename(queue.pending / name, queue.leased / (name + "@" + workerName), error);
+            if (!error) {
+                item = name;
+                break;
+            }
+        }
+        if (item.empty()) {
+            if (queueItems(queue.leased).empty()) break;
+            std::this_thread::sleep_for(std::min<std::chrono::seconds>(leaseTime / 3, std::chrono::seconds(5)));
+            continue;
+        }
+
+        std::filesystem::path lease = queue.leased / (item + "@" + workerName);
+        std::string jobLine = readSmallFile(lease);
+        if (!jobLine.empty() && jobLine.back() == '\n') jobLine.pop_back();
+        size_t tab = jobLine.find('\t');
+        ArchiveJob job{jobLine.substr(0, tab), tab == std::string::npos ? "" : jobLine.substr(tab + 1)};
+        // Local outputs are written beside the target and renamed into place. An S3 object only
+        // appears when its multipart upload completes, so it is written directly.
+        bool remoteOutput = isS3Path(job.output.string());
+        std::filesystem::path partPath = job.output;
+        if (!remoteOutput) partPath += ".part-" + workerName;
+
+        std::cout << "[" << workerName << "] " << item << ": " << job.input.string() << std::endl;
+        auto start = std::chrono::steady_clock::now();
+        bool ok;
+        bool lost;
+        {
+            LeaseRenewer renewer(lease, leaseTime);
+            ok = !job.output.empty() && rewriteArchives({ArchiveJob{job.input, partPath}}, options);
+            lost = renewer.lost();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        std::error_code error;
+        if (lost || !std::filesystem::exists(lease, error)) {
+            // Another worker owns this item now and will publish the same result.
+            if (!remoteOutput) std::filesystem::remove(partPath, error);
+            std::cerr << "Warning: Lost the lease on " << item << "; discarding this worker's result." << std::endl;
+            continue;
+        }
+        std::ostringstream result;
+        result << jobLine << "\nworker " << workerName << "\nseconds " << elapsed.count() << "\n";
+        if (ok && !remoteOutput) {
+            std::filesystem::rename(partPath, job.output, error);
+            if (error) {
+                ok = false;
+                result << "error could not publish output: " << error.message() << "\n";
+            }
+        } else if (!ok) {
+            if (!remoteOutput) std::filesystem::remove(partPath, error); // A failed upload is aborted by S3Upload
+            result << "error rewrite failed (see the worker's log)\n";
+        }
+        // Record the result, then retire the lease; done/failed is what "queue status" counts.
+        const std::filesystem::path& target = ok ? queue.done : queue.failed;
+        if (!writeSmallFile(target / item, result.str())) {
+            std::cerr << "Warning: Could not record the result of " << item << "." << std::endl;
+        }
+        std::filesystem::remove(lease, error);
+        ok ? completed++ : failed++;
+    }
+    std::cout << "[" << workerName << "] Queue drained: " << completed << " completed, " << failed << " failed by this worker."
+              << std::endl;
+    return failed == 0 ? 0 : 1;
+}
+
+/**
+ * @brief Implements "queue status": counts items per state, optionally waiting for the queue to drain.
+ * @return 0 if nothing failed, 1 otherwise.
+ */
+int queueStatus(int argc, char* argv[]) {
+    std::string dir;
+    bool wait = false;
+    std::chrono::seconds leaseTime(60);
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-wait") {
+            wait = true;
+        } else if (arg == "-lease" && i + 1 < argc) {
+            try {
+                leaseTime = std::chrono::seconds(std::max(3, std::stoi(argv[++i])));
+            } catch (const std::exception& e) {
+                std::cerr << "Error: Invalid number for -lease argument." << std::endl;
+                return 1;
+            }
+        } else {
+            dir = arg;
+        }
+    }
+    QueueDirs queue(dir);
+    if (dir.empty() || !std::filesystem::exists(queue.root / kQueueSettings)) {
+        std::cerr << "Usage: queue status <queue-dir> [-wait] [-lease <seconds>]" << std::endl;
+        return 1;
+    }
+
+    for (;;) {
+        if (wait) reclaimExpiredLeases(queue, leaseTime);
+        auto pending = queueItems(queue.pending);
+        auto leased = queueItems(queue.leased);
+        auto done = queueItems(queue.done);
+        auto failed = queueItems(queue.failed);
+        if (!wait || (pending.empty() && leased.empty())) {
+            std::cout << pending.size() << " pending, " << leased.size() << " leased, " << done.size() << " done, "
+                      << failed.size() << " failed" << std::endl;
+            auto now = sharedNow(queue);
+            for (const auto& name : leased) {
+                std::error_code error;
+                auto age = now - std::filesystem::last_write_time(queue.leased / name, error);
+                std::cout << "  leased " << name.substr(0, name.find('@')) << " by " << name.substr(name.find('@') + 1)
+                          << ", renewed " << std::chrono::duration_cast<std::chrono::seconds>(age).count() << "s ago\n";
+            }
+            for (const auto& name : failed) {
+                std::string result = readSmallFile(queue.failed / name);
+                size_t errorPos = result.find("\nerror ");
+                std::string reason = errorPos == std::string::npos ? "" : result.substr(errorPos + 7);
+                std::cout << "  failed " << name << ": " << reason.substr(0, reason.find('\n')) << "\n";
+            }
+            std::cout.flush();
+            return failed.empty() ? 0 : 1;
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+}
+
+} // namespace
+
+/**
+ * @brief Implements "queue": a work queue shared by canvasupdater processes on many hosts.
+ * @return 0 on success, 1 on error.
+ */
+int queueCommand(int argc, char* argv[]) {
+    std::string action = argc > 0 ? argv[0] : "";
+    if (action == "init") return queueInit(argc - 1, argv + 1);
+    if (action == "work") return queueWork(argc - 1, argv + 1);
+    if (action == "status") return queueStatus(argc - 1, argv + 1);
+    std::cerr << "Usage: queue init|work|status <queue-dir> ..." << std::endl;
+    return 1;
+}
+
+// --- S3-compatible object storage ---
+
+/**
+ * @brief Returns the value of a response header, matched case-insensitively.
+ */
+std::string HttpResponse::header(const std::string& name) const {
+    std::istringstream lines(headers);
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t colon = line.find(':');
+        if (colon != name.size()) continue;
+        if (!std::equal(name.begin(), name.end(), line.begin(),
+                        [](char a, char b) { return std::tolower(a) == std::tolower(b); })) continue;
+        std::string value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of(" \t\r") + 1);
+        return value;
+    }
+    return "";
+}
+
+namespace {
+
+/**
+ * @brief Runs curl, feeding it a body on stdin and passing its output to a callback as it arrives.
+ *
+ * Options that carry secrets are passed as a config file on a private pipe
+ * (-K /dev/fd/3) so they never show up in the process list. If the callback
+ * throws, curl is stopped and the exception propagates.
+ * @param args Arguments after "curl -sS -K /dev/fd/3".
+ * @param body Request body, sent on curl's stdin; empty for none.
+ * @param config curl config file contents, may be empty.
+ * @param sink Receives curl's standard output in chunks.
+ */
+void spawnCurl(const std::vector<std::string>& args, std::string_view body, const std::string& config,
+               const std::function<void(std::string_view)>& sink) {
+#ifndef _WIN32
+    static std::once_flag ignorePipe;
+    std::call_once(ignorePipe, [] { std::signal(SIGPIPE, SIG_IGN); }); // A dead curl must not kill us mid-write
+
+    std::vector<std::string> command = {"curl", "-sS", "-K", "/dev/fd/3"};
+    if (!body.empty()) {
+        command.push_back("--data-binary");
+        command.push_back("@-");
+    }
+    command.insert(command.end(), args.begin(), args.end());
+    std::vector<char*> argv;
+    for (auto& arg : command) argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+
+    // Every descriptor is close-on-exec, so concurrent requests never inherit
+    // each other's pipes (which would keep a stdin from ever reaching EOF).
+    int in[2], out[2], conf[2];
+    if (pipe2(in, O_CLOEXEC) != 0 || pipe2(out, O_CLOEXEC) != 0 || pipe2(conf, O_CLOEXEC) != 0) {
+        throw std::runtime_error(std::string("could not create pipes for curl: ") + std::strerror(errno));
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        dup2(conf[0], 3);
+        execvp("curl", argv.data());
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    close(conf[0]);
+    if (pid < 0) {
+        close(in[1]);
+        close(out[0]);
+        close(conf[1]);
+        throw std::runtime_error(std::string("could not start curl: ") + std::strerror(errno));
+    }
+
+    auto writeAll = [](int fd, std::string_view data) {
+        while (!data.empty()) {
+            ssize_t n = write(fd, data.data(), data.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return; // curl exited early; its exit status says why
+            data.remove_prefix(static_cast<size_t>(n));
+        }
+    };
+    writeAll(conf[1], config);
+    close(conf[1]);
+    // Feed stdin from a helper thread so a response that arrives before the
+    // body is fully sent (an early error, say) cannot deadlock us.
+    std::thread feeder([&] {
+        writeAll(in[1], body);
+        close(in[1]);
+    });
+    std::exception_ptr failure;
+    try {
+        char buffer[65536];
+        for (;;) {
+            ssize_t n = read(out[0], buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            sink(std::string_view(buffer, static_cast<size_t>(n)));
+        }
+    } catch (...) {
+        failure = std::current_exception();
+        kill(pid, SIGTERM);
+    }
+    close(out[0]);
+    feeder.join();
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (failure) std::rethrow_exception(failure);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        throw std::runtime_error("curl failed (exit status " +
+                                 std::to_string(WIFEXITED(status) ? WEXITSTATUS(status) : -1) + ")");
+    }
+#else
+    throw std::runtime_error("HTTP requests are not supported on this platform");
+#endif
+}
+
+} // namespace
+
+/**
+ * @brief Runs curl with a request body on stdin and returns the parsed response.
+ * @param args Arguments after "curl", typically the method and the URL.
+ * @param body Request body, sent on curl's stdin; empty for none.
+ * @param config curl config file contents, may be empty.
+ * @return The response; throws if curl itself fails (e.g. cannot connect).
+ */
+HttpResponse runCurl(const std::vector<std::string>& args, std::string_view body, const std::string& config) {
+    std::vector<std::string> command = {"--include"};
+    command.insert(command.end(), args.begin(), args.end());
+    std::string raw;
+    spawnCurl(command, body, config, [&](std::string_view chunk) { raw.append(chunk); });
+
+    // --include puts every header block (e.g. "100 Continue") ahead of the body.
+    HttpResponse response;
+    size_t pos = 0;
+    while (raw.compare(pos, 5, "HTTP/") == 0) {
+        size_t end = raw.find("\r\n\r\n", pos);
+        if (end == std::string::npos) break;
+        response.headers = raw.substr(pos, end + 2 - pos);
+        response.status = std::atoi(response.headers.c_str() + response.headers.find(' ') + 1);
+        pos = end + 4;
+    }
+    response.body = raw.substr(pos);
+    return response;
+}
+
+/**
+ * @brief Runs curl and hands the response body to a callback as it arrives.
+ * @param args Arguments after "curl"; add --fail to turn HTTP errors into an exception.
+ * @param config curl config file contents, may be empty.
+ * @param sink Receives the body in chunks; may throw to abandon the transfer.
+ */
+void streamCurl(const std::vector<std::string>& args, const std::string& config,
+                const std::function<void(std::string_view)>& sink) {
+    spawnCurl(args, "", config, sink);
+}
+
+/**
+ * @brief Checks whether a path names an S3 object (s3://bucket/key).
+ */
+bool isS3Path(const std::string& path) {
+    return path.rfind("s3://", 0) == 0;
+}
+
+/**
+ * @brief Splits s3://bucket/key and picks up the endpoint and region from the environment.
+ */
+S3Location parseS3Path(const std::string& path) {
+    S3Location location;
+    size_t slash = path.find('/', 5);
+    if (!isS3Path(path) || slash == std::string::npos || slash == 5 || slash + 1 == path.size()) {
+        throw std::runtime_error("'" + path + "' is not of the form s3://bucket/key");
+    }
+    location.bucket = path.substr(5, slash - 5);
+    location.key = path.substr(slash + 1);
+    const char* region = std::getenv("AWS_REGION");
+    if (!region) region = std::getenv("AWS_DEFAULT_REGION");
+    location.region = region ? region : "us-east-1";
+    const char* endpoint = std::getenv("S3_ENDPOINT");
+    location.endpoint = endpoint ? endpoint : "https://s3." + location.region + ".amazonaws.com";
+    while (!location.endpoint.empty() && location.endpoint.back() == '/') location.endpoint.pop_back();
+    return location;
+}
+
+/**
+ * @brief The key, percent-encoded as SigV4 expects.
+ */
+std::string S3Location::encodedKey() const {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string encoded;
+    for (unsigned char c : key) {
+        if (std::isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+            encoded += static_cast<char>(c);
+        } else {
+            encoded += '%';
+            encoded += hex[c >> 4];
+            encoded += hex[c & 15];
+        }
+    }
+    return encoded;
+}
+
+/**
+ * @brief Path-style URL of the object.
+ */
+std::string S3Location::url(const std::string& query) const {
+    return endpoint + "/" + bucket + "/" + encodedKey() + (query.empty() ? "" : "?" + query);
+}
+
+/**
+ * @brief Sends one signed request for an object.
+ * @param location The object.
+ * @param method HTTP method.
+ * @param query Query string without the '?', e.g. "uploads".
+ * @param body Request body; empty for none.
+ * @param extraArgs Further curl arguments, e.g. extra headers.
+ * @return The response; S3 error responses are returned, not thrown.
+ */
+HttpResponse s3Request(const S3Location& location, const std::string& method, const std::string& query,
+                       std::string_view body, const std::vector<std::string>& extraArgs) {
+    auto quote = [](const std::string& value) {
+        std::string quoted = "\"";
+        for (char c : value) {
+            if (c == '"' || c == '\\') quoted += '\\';
+            quoted += c;
+        }
+        return quoted + "\"";
+    };
+    const char* keyId = std::getenv("AWS_ACCESS_KEY_ID");
+    const char* secret = std::getenv("AWS_SECRET_ACCESS_KEY");
+    const char* token = std::getenv("AWS_SESSION_TOKEN");
+    std::string config;
+    if (keyId && secret) {
+        config += "user = " + quote(std::string(keyId) + ":" + secret) + "\n";
+        config += "aws-sigv4 = " + quote("aws:amz:" + location.region + ":s3") + "\n";
+        if (token) config += "header = " + quote(std::string("x-amz-security-token: ") + token) + "\n";
+    }
+
+    std::vector<std::string> args = {"-X", method, "-H", "x-amz-content-sha256: UNSIGNED-PAYLOAD",
+                                     "-H", "Content-Type:", "-H", "Expect:"};
+    if (body.empty() && (method == "POST" || method == "PUT")) {
+        args.push_back("-H");
+        args.push_back("Content-Length: 0");
+    }
+    args.insert(args.end(), extraArgs.begin(), extraArgs.end());
+    args.push_back(location.url(query));
+    return runCurl(args, body, config);
+}
+
+namespace {
+
+/**
+ * @brief Returns the text of the first <tag>...</tag> in an XML response.
+ */
+std::string xmlValue(const std::string& xml, const std::string& tag) {
+    size_t start = xml.find("<" + tag + ">");
+    if (start == std::string::npos) return "";
+    start += tag.size() + 2;
+    size_t end = xml.find("</" + tag + ">", start);
+    return end == std::string::npos ? "" : xml.substr(start, end - start);
+}
+
+/**
+ * @brief Describes a failed S3 response, preferring the service's own error code and message.
+ */
+std::string s3Error(const HttpResponse& response) {
+    std::string code = xmlValue(response.body, "Code");
+    std::string message = xmlValue(response.body, "Message");
+    return "HTTP " + std::to_string(response.status) + (code.empty() ? "" : " " + code) +
+           (message.empty() ? "" : ": " + message);
+}
+
+} // namespace
+
+S3Upload::S3Upload(S3Location location, size_t partSize, unsigned maxInFlight)
+    : location_(std::move(location)), partSize_(std::max<size_t>(partSize, 5 << 20)),
+      maxInFlight_(std::max(1u, maxInFlight)) {
+    HttpResponse response = s3Request(location_, "POST", "uploads", "");
+    uploadId_ = xmlValue(response.body, "UploadId");
+    if (response.status != 200 || uploadId_.empty()) {
+        throw std::runtime_error("could not start upload to " + location_.display() + ": " + s3Error(response));
+    }
+    current_.reserve(partSize_);
+    for (unsigned n = 0; n < maxInFlight_; ++n) uploaders_.emplace_back(&S3Upload::uploadLoop, this);
+}
+
+S3Upload::~S3Upload() {
+    if (!finished_) {
+        try {
+            abort();
+        } catch (const std::exception& e) {
+            std::cerr << "Warning: Could not abort upload to " << location_.display() << ": " << e.what() << std::endl;
+        }
+    }
+}
+
+S3Upload::int_type S3Upload::overflow(int_type ch) {
+    if (traits_type::eq_int_type(ch, traits_type::eof())) return traits_type::not_eof(ch);
+    char c = traits_type::to_char_type(ch);
+    return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+}
+
+std::streamsize S3Upload::xsputn(const char* data, std::streamsize size) {
+    std::streamsize done = 0;
+    while (done < size) {
+        size_t take = std::min(static_cast<size_t>(size - done), partSize_ - current_.size());
+        current_.append(data + done, take);
+        done += static_cast<std::streamsize>(take);
+        if (current_.size() == partSize_) {
+            submitPart();
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!error_.empty()) return 0; // Puts the stream into a failed state
+        }
+    }
+    bytes_ += static_cast<uint64_t>(size);
+    return size;
+}
+
+/**
+ * @brief Queues the part being filled, waiting while too many parts are already pending.
+ */
+void S3Upload::submitPart() {
+    Part part;
+    part.data = std::move(current_);
+    current_ = std::string();
+    current_.reserve(partSize_);
+    queuePart(std::move(part));
+}
+
+void S3Upload::queuePart(Part part) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return queued_.size() + inFlight_ < maxInFlight_ || !error_.empty(); });
+    part.number = nextPart_++;
+    queued_.push_back(std::move(part));
+    changed_.notify_all();
+}
+
+/**
+ * @brief Appends a byte range of another object, copying it server-side where S3 allows.
+ *
+ * Every part but the last must be at least 5 MiB, so a range is only copied
+ * (UploadPartCopy) when it is large enough to top up the part being filled to
+ * that size and still leave a full part to copy. Anything smaller is read
+ * with readAt and written like ordinary data.
+ * @param source The object to copy from; it must live on the same service.
+ * @param offset First byte of the range.
+ * @param size Length of the range.
+ * @param readAt Reads bytes of the source when they cannot be copied server-side.
+ */
+void S3Upload::copyFrom(const S3Location& source, uint64_t offset, uint64_t size,
+                        const std::function<std::string(uint64_t offset, size_t size)>& readAt) {
+    const uint64_t minPart = 5 << 20;
+    const uint64_t maxCopy = 5ULL << 30;
+    auto appendRead = [&](uint64_t length) {
+        while (length > 0) {
+            size_t chunk = static_cast<size_t>(std::min<uint64_t>(length, partSize_));
+            std::string bytes = readAt(offset, chunk);
+            xsputn(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+            offset += chunk;
+            length -= chunk;
+        }
+    };
+    if (size < 2 * minPart) {
+        appendRead(size);
+        return;
+    }
+    if (!current_.empty()) {
+        if (current_.size() < minPart) {
+            uint64_t topUp = minPart - current_.size();
+            std::string bytes = readAt(offset, static_cast<size_t>(topUp));
+            current_ += bytes;
+            bytes_ += bytes.size();
+            offset += topUp;
+            size -= topUp;
+        }
+        submitPart();
+    }
+    while (size > 0) {
+        Part part;
+        part.copySource = "/" + source.bucket + "/" + source.encodedKey();
+        part.copyOffset = offset;
+        // Never leave a tail too small to be a part of its own.
+        part.copySize = size > maxCopy ? (size - maxCopy < minPart ? size - minPart : maxCopy) : size;
+        offset += part.copySize;
+        size -= part.copySize;
+        bytes_ += part.copySize;
+        queuePart(std::move(part));
+    }
+}
+
+void S3Upload::uploadLoop() {
+    static std::atomic<unsigned> uploaders{0};
+    WorkerSlot& slot = workerSlot("upload-" + std::to_string(uploaders++));
+    for (;;) {
+        Part part;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            changed_.wait(lock, [this] { return !queued_.empty() || closing_; });
+            if (queued_.empty()) return;
+            part = std::move(queued_.front());
+            queued_.pop_front();
+            inFlight_++;
+        }
+        std::string etag, failure;
+        std::string query = "partNumber=" + std::to_string(part.number) + "&uploadId=" + uploadId_;
+        for (int attempt = 1; attempt <= 3 && etag.empty(); ++attempt) {
+            try {
+                WorkerActivity activity(slot, (part.copySize ? "copy part " : "upload part ") +
+                                                  std::to_string(part.number) + " of " + location_.display());
+                HttpResponse response;
+                if (part.copySize) {
+                    response = s3Request(location_, "PUT", query, "",
+                                         {"-H", "x-amz-copy-source: " + part.copySource, "-H",
+                                          "x-amz-copy-source-range: bytes=" + std::to_string(part.copyOffset) + "-" +
+                                              std::to_string(part.copyOffset + part.copySize - 1)});
+                    etag = xmlValue(response.body, "ETag"); // Returned in the body for copies
+                } else {
+                    response = s3Request(location_, "PUT", query, part.data);
+                    etag = response.header("ETag");
+                }
+                if (response.status != 200 || etag.empty()) failure = s3Error(response);
+            } catch (const std::exception& e) {
+                failure = e.what();
+            }
+            if (etag.empty() && attempt < 3) std::this_thread::sleep_for(std::chrono::milliseconds(500 * attempt));
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        inFlight_--;
+        if (etag.empty()) {
+            if (error_.empty()) error_ = "part " + std::to_string(part.number) + ": " + failure;
+        } else {
+            etags_[part.number] = etag;
+        }
+        changed_.notify_all();
+    }
+}
+
+/**
+ * @brief Uploads the last part, waits for all parts and completes the upload.
+ *
+ * Throws (after aborting the upload) if any part failed.
+ */
+void S3Upload::complete() {
+    if (!current_.empty() || nextPart_ == 1) submitPart(); // S3 needs at least one part
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        closing_ = true;
+        changed_.notify_all();
+        changed_.wait(lock, [this] { return queued_.empty() && inFlight_ == 0; });
+    }
+    for (auto& uploader : uploaders_) uploader.join();
+    uploaders_.clear();
+    if (!error_.empty()) {
+        throw std::runtime_error("upload to " + location_.display() + " failed: " + error_);
+    }
+
+    std::string manifest = "<CompleteMultipartUpload>";
+    for (const auto& [number, etag] : etags_) {
+        manifest += "<Part><PartNumber>" + std::to_string(number) + "</PartNumber><ETag>" + etag + "</ETag></Part>";
+    }
+    manifest += "</CompleteMultipartUpload>";
+    HttpResponse response = s3Request(location_, "POST", "uploadId=" + uploadId_, manifest);
+    // The service can report a failure inside a 200 response.
+    if (response.status != 200 || response.body.find("<Error>") != std::string::npos) {
+        throw std::runtime_error("could not complete upload to " + location_.display() + ": " + s3Error(response));
+    }
+    finished_ = true;
+}
+
+/**
+ * @brief Stops the uploaders and discards every part uploaded so far.
+ */
+void S3Upload::abort() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closing_ = true;
+        queued_.clear();
+        changed_.notify_all();
+    }
+    for (auto& uploader : uploaders_) uploader.join();
+    uploaders_.clear();
+    finished_ = true;
+    s3Request(location_, "DELETE", "uploadId=" + uploadId_, "");
+}
+
+// --- Ranged reads from S3 ---
+// An archive on S3 is rewritten without downloading it: the central directory
+// comes from the tail of the object, only the records of text entries are
+// fetched (neighbours in one request), and everything else is copied into the
+// output as byte ranges of the input, server-side when the output is on S3 too.
+
+namespace {
+
+const uint64_t kCoalesceGap = 256 << 10; // Fetch the gap rather than issue another request
+const uint64_t kMaxFetch = 32 << 20;     // Upper bound on one coalesced request
+
+/**
+ * @brief Reads a byte range of an S3 object, retrying transient failures.
+ */
+std::string s3ReadRange(const S3Location& location, uint64_t offset, size_t size) {
+    if (size == 0) return "";
+    std::string range = "bytes=" + std::to_string(offset) + "-" + std::to_string(offset + size - 1);
+    std::string failure;
+    for (int attempt = 1; attempt <= 3; ++attempt) {
+        try {
+            HttpResponse response = s3Request(location, "GET", "", "", {"-H", "Range: " + range});
+            if (response.status == 206 && response.body.size() == size) {
+                g_stats.bytesIn += size;
+                return std::move(response.body);
+            }
+            failure = s3Error(response);
+        } catch (const std::exception& e) {
+            failure = e.what();
+        }
+        if (attempt < 3) std::this_thread::sleep_for(std::chrono::milliseconds(500 * attempt));
+    }
+    throw std::runtime_error("could not read " + range + " of " + location.display() + ": " + failure);
+}
+
+// A piece of the output archive: new bytes, or a range of the input archive.
+struct OutputSegment {
+    std::string bytes;
+    uint64_t sourceOffset = 0;
+    uint64_t sourceSize = 0;  // Non-zero for input ranges
+};
+
+} // namespace
+
+/**
+ * @brief Rewrites an archive stored on S3, reading only what has to change.
+ *
+ * Each entry's record (local header, data and any data descriptor) runs up to
+ * the next record in the file, so a run of unchanged entries is one range of
+ * the input and keeps its original local headers; only their offsets in the
+ * new central directory change.
+ * @param job Input s3://bucket/key and a local or s3:// output.
+ * @param options Start date, index, level and thread counts.
+ * @return True on success, false otherwise.
+ */
+bool rewriteRemoteArchive(const ArchiveJob& job, const RewriteOptions& options) {
+    try {
+        S3Location source = parseS3Path(job.input.string());
+        auto readSource = [&](uint64_t offset, size_t size) { return s3ReadRange(source, offset, size); };
+
+        // A suffix range returns the end of the object and, in Content-Range, its size.
+        HttpResponse tail = s3Request(source, "GET", "", "", {"-H", "Range: bytes=-65536"});
+        uint64_t archiveSize;
+        if (tail.status == 200) {
+            archiveSize = tail.body.size(); // Smaller than the range, so the whole object came back
+        } else if (tail.status == 206 && tail.header("Content-Range").find('/') != std::string::npos) {
+            std::string contentRange = tail.header("Content-Range");
+            archiveSize = std::stoull(contentRange.substr(contentRange.find('/') + 1));
+        } else {
+            throw std::runtime_error("could not read " + source.display() + ": " + s3Error(tail));
+        }
+        g_stats.bytesIn += tail.body.size();
+        uint64_t tailStart = archiveSize - tail.body.size();
+        ZipArchive archive = ZipArchive::fromTail([&](uint64_t offset, size_t size) {
+            if (offset >= tailStart) return tail.body.substr(static_cast<size_t>(offset - tailStart), size);
+            return readSource(offset, size);
+        }, archiveSize);
+        const std::vector<ZipEntry>& entries = archive.entries();
+
+        // Records in file order; each one ends where the next begins.
+        std::vector<size_t> order(entries.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return entries[a].localHeaderOffset < entries[b].localHeaderOffset;
+        });
+        std::vector<uint64_t> recordEnd(entries.size());
+        for (size_t k = 0; k < order.size(); ++k) {
+            recordEnd[order[k]] = k + 1 < order.size() ? entries[order[k + 1]].localHeaderOffset
+                                                       : archive.centralDirectoryOffset();
+        }
+
+        struct Fetch {
+            uint64_t begin = 0, end = 0;
+            std::vector<size_t> entries;
+            std::string bytes;
+        };
+        std::vector<Fetch> fetches;
+        for (size_t index : order) {
+            const ZipEntry& entry = entries[index];
+            if (!isRewritableEntry(entry, options)) continue;
+            if (!fetches.empty() && entry.localHeaderOffset - fetches.back().end <= kCoalesceGap &&
+                recordEnd[index] - fetches.back().begin <= kMaxFetch) {
+                fetches.back().end = recordEnd[index];
+            } else {
+                Fetch fetch;
+                fetch.begin = entry.localHeaderOffset;
+                fetch.end = recordEnd[index];
+                fetches.push_back(std::move(fetch));
+            }
+            fetches.back().entries.push_back(index);
+        }
+        parallelFor(fetches.size(), options.ioThreads, "fetch", [&](size_t n, WorkerSlot& slot) {
+            Fetch& fetch = fetches[n];
+            WorkerActivity activity(slot, "fetch " + std::to_string(fetch.end - fetch.begin) + " bytes of " +
+                                              source.display());
+            fetch.bytes = readSource(fetch.begin, static_cast<size_t>(fetch.end - fetch.begin));
+        });
+
+        std::vector<std::pair<const Fetch*, size_t>> textEntries;
+        for (const auto& fetch : fetches) {
+            for (size_t index : fetch.entries) textEntries.emplace_back(&fetch, index);
+        }
+        std::vector<std::unique_ptr<PackedEntry>> rewritten(entries.size());
+        {
+            PhaseTimer timer(Phase::Process);
+            parallelFor(textEntries.size(), options.threads, "inflate", [&](size_t n, WorkerSlot& slot) {
+                const Fetch& fetch = *textEntries[n].first;
+                const ZipEntry& entry = entries[textEntries[n].second];
+                WorkerActivity activity(slot, "inflate+scan " + entry.name);
+                std::string_view record(fetch.bytes);
+                record = record.substr(static_cast<size_t>(entry.localHeaderOffset - fetch.begin));
+                size_t headerSize = localHeaderSize(record.substr(0, 30));
+                if (headerSize + entry.compressedSize > record.size()) {
+                    throw std::runtime_error("entry '" + entry.name + "' extends past its record");
+                }
+                std::string_view raw = record.substr(headerSize, static_cast<size_t>(entry.compressedSize));
+                rewritten[textEntries[n].second] = rewriteEntry(entry, decompressEntry(entry, raw),
+                                                                job.input.string() + ":" + entry.name, options);
+            });
+        }
+        fetches.clear();
+
+        // Lay out the new archive, merging runs of unchanged records into single ranges.
+        std::vector<OutputSegment> segments;
+        std::vector<ZipEntry> written;
+        uint64_t offset = 0;
+        for (size_t index : order) {
+            if (rewritten[index]) {
+                PackedEntry& packed = *rewritten[index];
+                OutputSegment segment;
+                segment.bytes = ZipWriter::localHeader(packed.entry, offset, packed.data.size()) + packed.data;
+                offset += segment.bytes.size();
+                written.push_back(packed.entry);
+                segments.push_back(std::move(segment));
+                rewritten[index].reset();
+            } else {
+                ZipEntry entry = entries[index];
+                uint64_t size = recordEnd[index] - entry.localHeaderOffset;
+                if (!segments.empty() && segments.back().sourceSize &&
+                    segments.back().sourceOffset + segments.back().sourceSize == entry.localHeaderOffset) {
+                    segments.back().sourceSize += size;
+                } else {
+                    segments.push_back(OutputSegment{"", entry.localHeaderOffset, size});
+                }
+                entry.localHeaderOffset = offset;
+                offset += size;
+                written.push_back(entry);
+            }
+        }
+        segments.push_back(OutputSegment{ZipWriter::centralDirectory(written, offset)});
+
+        PhaseTimer timer(Phase::Rezip);
+        WorkerActivity activity(workerSlot("main"), "write " + job.output.string());
+        uint64_t total = 0;
+        if (isS3Path(job.output.string())) {
+            S3Upload upload(parseS3Path(job.output.string()), kUploadPartSize, options.ioThreads);
+            std::ostream out(&upload);
+            for (const auto& segment : segments) {
+                if (segment.sourceSize) {
+                    upload.copyFrom(source, segment.sourceOffset, segment.sourceSize, readSource);
+                } else {
+                    out.write(segment.bytes.data(), static_cast<std::streamsize>(segment.bytes.size()));
+                }
+            }
+            out.flush();
+            upload.complete();
+            if (!out) throw std::runtime_error("could not write '" + job.output.string() + "'");
+            total = upload.bytesWritten();
+        } else {
+            // Split input ranges into pieces and fetch a window of them at a time, in parallel.
+            std::vector<OutputSegment> pieces;
+            for (auto& segment : segments) {
+                for (uint64_t done = 0; done < segment.sourceSize; done += kUploadPartSize) {
+                    pieces.push_back(OutputSegment{"", segment.sourceOffset + done,
+                                                   std::min<uint64_t>(kUploadPartSize, segment.sourceSize - done)});
+                }
+                if (!segment.sourceSize) pieces.push_back(std::move(segment));
+            }
+            std::ofstream out(job.output, std::ios::binary | std::ios::trunc);
+            if (!out) throw std::runtime_error("could not create '" + job.output.string() + "'");
+            size_t window = std::max<size_t>(2, options.ioThreads * 2);
+            for (size_t first = 0; first < pieces.size(); first += window) {
+                size_t count = std::min(window, pieces.size() - first);
+                parallelFor(count, options.ioThreads, "fetch", [&](size_t n, WorkerSlot& slot) {
+                    OutputSegment& piece = pieces[first + n];
+                    if (!piece.sourceSize) return;
+                    WorkerActivity activity(slot, "fetch " + std::to_string(piece.sourceSize) + " bytes of " +
+                                                      source.display());
+                    piece.bytes = readSource(piece.sourceOffset, static_cast<size_t>(piece.sourceSize));
+                });
+                for (size_t n = first; n < first + count; ++n) {
+                    out.write(pieces[n].bytes.data(), static_cast<std::streamsize>(pieces[n].bytes.size()));
+                    total += pieces[n].bytes.size();
+                    pieces[n].bytes = std::string();
+                }
+            }
+            if (!out.flush()) throw std::runtime_error("could not write '" + job.output.string() + "'");
+        }
+        g_stats.bytesOut += total;
+        g_stats.archivesProcessed++;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Could not rewrite '" << job.input.string() << "': " << e.what() << std::endl;
+        return false;
+    }
+    std::cout << "Successfully created new archive at '"
+              << (isS3Path(job.output.string()) ? job.output.string() : std::filesystem::absolute(job.output).string())
+              << "'" << std::endl;
+    return true;
+}
+
+// --- Canvas content exports ---
+// An input given as canvas://<course id> is exported with the Canvas Content
+// Exports API and rewritten while it downloads. Entries are parsed from their
+// local headers as bytes arrive; the central directory at the end of the
+// download only contributes the attributes nothing else records.
+
+/**
+ * @brief Checks whether an input names a Canvas course (canvas://<course id>).
+ */
+bool isCanvasPath(const std::string& path) {
+    return path.rfind("canvas://", 0) == 0;
+}
+
+namespace {
+
+const std::chrono::minutes kCanvasExportTimeout(60);
+
+// A course on the Canvas instance named by CANVAS_URL, accessed with CANVAS_TOKEN.
+struct CanvasCourse {
+    std::string baseUrl;
+    std::string token;
+    std::string id;  // Numeric id, or e.g. sis_course_id:ABC-101
+};
+
+/**
+ * @brief Splits canvas://<course id> and picks up the instance and token from the environment.
+ */
+CanvasCourse parseCanvasPath(const std::string& path) {
+    CanvasCourse course;
+    course.id = path.substr(std::strlen("canvas://"));
+    if (course.id.empty() || course.id.find_first_of("/?#") != std::string::npos) {
+        throw std::runtime_error("'" + path + "' is not of the form canvas://<course id>");
+    }
+    const char* url = std::getenv("CANVAS_URL");
+    const char* token = std::getenv("CANVAS_TOKEN");
+    if (!url || !*url) throw std::runtime_error("set CANVAS_URL to the Canvas instance, e.g. https://canvas.example.edu");
+    if (!token || !*token) throw std::runtime_error("set CANVAS_TOKEN to a Canvas API access token");
+    course.baseUrl = url;
+    while (!course.baseUrl.empty() && course.baseUrl.back() == '/') course.baseUrl.pop_back();
+    course.token = token;
+    return course;
+}
+
+/**
+ * @brief curl config that authenticates as the token's owner; kept off the command line.
+ */
+std::string canvasConfig(const CanvasCourse& course) {
+    return "header = \"Authorization: Bearer " + course.token + "\"\n";
+}
+
+/**
+ * @brief Decodes a JSON string literal, quotes included.
+ */
+std::string unescapeJson(std::string_view literal) {
+    std::string value;
+    for (size_t i = 1; i + 1 < literal.size(); ++i) {
+        char c = literal[i];
+        if (c != '\\') {
+            value += c;
+            continue;
+        }
+        c = literal[++i];
+        if (c == 'n') value += '\n';
+        else if (c == 't') value += '\t';
+        else if (c == 'r') value += '\r';
+        else if (c == 'b') value += '\b';
+        else if (c == 'f') value += '\f';
+        else if (c == 'u' && i + 4 < literal.size()) {
+            // Canvas escapes '&' in URLs as \u0026; surrogate pairs never occur in the fields we read.
+            unsigned code = static_cast<unsigned>(std::stoul(std::string(literal.substr(i + 1, 4)), nullptr, 16));
+            i += 4;
+            if (code < 0x80) {
+                value += static_cast<char>(code);
+            } else if (code < 0x800) {
+                value += static_cast<char>(0xC0 | (code >> 6));
+                value += static_cast<char>(0x80 | (code & 0x3F));
+            } else {
+                value += static_cast<char>(0xE0 | (code >> 12));
+                value += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                value += static_cast<char>(0x80 | (code & 0x3F));
+            }
+        } else {
+            value += c; // \" \\ \/
+        }
+    }
+    return value;
+}
+
+/**
+ * @brief Returns the index just past the JSON value that starts at pos.
+ */
+size_t skipJsonValue(const std::string& json, size_t pos) {
+    if (pos >= json.size()) return json.size();
+    if (json[pos] == '"') {
+        for (size_t i = pos + 1; i < json.size(); ++i) {
+            if (json[i] == '\\') ++i;
+            else if (json[i] == '"') return i + 1;
+        }
+        return json.size();
+    }
+    if (json[pos] == '{' || json[pos] == '[') {
+        int depth = 0;
+        for (size_t i = pos; i < json.size(); ++i) {
+            char c = json[i];
+            if (c == '"') i = skipJsonValue(json, i) - 1;
+            else if (c == '{' || c == '[') ++depth;
+            else if ((c == '}' || c == ']') && --depth == 0) return i + 1;
+        }
+        return json.size();
+    }
+    size_t end = json.find_first_of(",}] \t\r\n", pos);
+    return end == std::string::npos ? json.size() : end;
+}
+
+/**
+ * @brief Looks up a dotted path such as "attachment.url" in a JSON object.
+ * @return The unescaped string, the literal text of any other value, or "" if absent or null.
+ */
+std::string jsonValue(const std::string& json, const std::string& path) {
+    const char* space = " \t\r\n";
+    size_t pos = json.find_first_not_of(space);
+    std::string rest = path;
+    while (pos != std::string::npos && json[pos] == '{') {
+        size_t dot = rest.find('.');
+        std::string key = rest.substr(0, dot);
+        // Walk the members of this object until the key turns up.
+        ++pos;
+        for (;;) {
+            pos = json.find_first_not_of(" \t\r\n,", pos);
+            if (pos == std::string::npos || json[pos] != '"') return "";
+            size_t keyEnd = skipJsonValue(json, pos);
+            std::string name = unescapeJson(std::string_view(json).substr(pos, keyEnd - pos));
+            pos = json.find(':', keyEnd);
+            if (pos == std::string::npos) return "";
+            pos = json.find_first_not_of(space, pos + 1);
+            if (pos == std::string::npos) return "";
+            if (name == key) break;
+            pos = skipJsonValue(json, pos);
+        }
+        if (dot == std::string::npos) {
+            std::string_view value = std::string_view(json).substr(pos, skipJsonValue(json, pos) - pos);
+            if (!value.empty() && value[0] == '"') return unescapeJson(value);
+            return value == "null" ? "" : std::string(value);
+        }
+        rest = rest.substr(dot + 1);
+    }
+    return "";
+}
+
+/**
+ * @brief Describes a failed Canvas response, preferring the API's own message.
+ */
+std::string canvasError(const HttpResponse& response) {
+    std::string message = jsonValue(response.body, "message");
+    size_t nested = response.body.find("\"message\""); // {"errors": [{"message": "..."}]}
+    if (message.empty() && nested != std::string::npos) {
+        message = jsonValue("{" + response.body.substr(nested), "message");
+    }
+    return "HTTP " + std::to_string(response.status) + (message.empty() ? "" : ": " + message);
+}
+
+/**
+ * @brief Starts a Common Cartridge export of a course and waits for Canvas to finish it.
+ * @return The URL the export can be downloaded from.
+ */
+std::string exportCanvasCourse(const CanvasCourse& course) {
+    std::string exports = course.baseUrl + "/api/v1/courses/" + course.id + "/content_exports";
+    HttpResponse started = runCurl({"-X", "POST", exports}, "export_type=common_cartridge", canvasConfig(course));
+    std::string exportId = jsonValue(started.body, "id");
+    if (started.status / 100 != 2 || exportId.empty()) {
+        throw std::runtime_error("could not start an export of course " + course.id + ": " + canvasError(started));
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + kCanvasExportTimeout;
+    std::chrono::seconds wait(1);
+    for (;;) {
+        HttpResponse status = runCurl({exports + "/" + exportId}, "", canvasConfig(course));
+        if (status.status / 100 != 2) {
+            throw std::runtime_error("could not check export " + exportId + ": " + canvasError(status));
+        }
+        std::string state = jsonValue(status.body, "workflow_state");
+        if (state == "exported") {
+            std::string url = jsonValue(status.body, "attachment.url");
+            if (url.empty()) throw std::runtime_error("export " + exportId + " finished without a download URL");
+            return url;
+        }
+        if (state == "failed") throw std::runtime_error("Canvas could not export course " + course.id);
+        if (std::chrono::steady_clock::now() + wait > deadline) {
+            throw std::runtime_error("export " + exportId + " did not finish within " +
+                                     std::to_string(kCanvasExportTimeout.count()) + " minutes");
+        }
+        std::this_thread::sleep_for(wait);
+        wait = std::min(wait * 2, std::chrono::seconds(10));
+    }
+}
+
+/**
+ * @brief Parses a zip archive from its local headers as its bytes arrive.
+ *
+ * Entries are reported in archive order. Entries the caller asks to buffer, and
+ * entries whose sizes only follow in a data descriptor, arrive whole; the rest
+ * arrive in chunks as they are read, so large media never sits in memory.
+ * Everything from the central directory on is kept for tail().
+ */
+class ZipStreamReader {
+public:
+    using BufferPredicate = std::function<bool(const ZipEntry& entry)>;
+    using DataHandler = std::function<void(const ZipEntry& entry, std::string_view data, bool last)>;
+    ZipStreamReader(BufferPredicate buffer, DataHandler onData)
+        : buffer_(std::move(buffer)), onData_(std::move(onData)) {}
+    void feed(std::string_view bytes);
+    void finish() const;
+    const std::string& tail() const { return tail_; }
+    uint64_t tailOffset() const { return tailOffset_; }
+private:
+    bool step();
+    void advance(size_t count) {
+        pos_ += count;
+        offset_ += count;
+    }
+    BufferPredicate buffer_;
+    DataHandler onData_;
+    std::string pending_;          // Received bytes; those before pos_ are consumed
+    size_t pos_ = 0;
+    uint64_t offset_ = 0;          // Archive offset of pending_[pos_]
+    ZipEntry streamed_;            // Entry whose data is being passed through
+    uint64_t remaining_ = 0;       // Bytes of it still to come
+    bool streaming_ = false;
+    size_t descriptorScan_ = 0;    // Where to resume looking for a data descriptor
+    bool inDirectory_ = false;
+    std::string tail_;
+    uint64_t tailOffset_ = 0;
+};
+
+void ZipStreamReader::feed(std::string_view bytes) {
+    pending_.append(bytes.data(), bytes.size());
+    while (step()) {
+    }
+    if (pos_ > 0 && pos_ >= pending_.size() / 2) {
+        pending_.erase(0, pos_);
+        pos_ = 0;
+    }
+}
+
+/**
+ * @brief Throws unless the stream ended after the central directory.
+ */
+void ZipStreamReader::finish() const {
+    if (!inDirectory_) throw std::runtime_error("the archive ended before its central directory");
+}
+
+/**
+ * @brief Consumes one header or chunk if enough bytes are available.
+ * @return True if progress was made.
+ */
+bool ZipStreamReader::step() {
+    std::string_view available(pending_.data() + pos_, pending_.size() - pos_);
+    if (inDirectory_) {
+        tail_.append(available.data(), available.size());
+        advance(available.size());
+        return false;
+    }
+    if (streaming_) {
+        size_t count = static_cast<size_t>(std::min<uint64_t>(available.size(), remaining_));
+        if (count == 0) return false;
+        remaining_ -= count;
+        streaming_ = remaining_ > 0;
+        advance(count);
+        onData_(streamed_, available.substr(0, count), !streaming_);
+        return true;
+    }
+
+    if (available.size() < 4) return false;
+    uint32_t signature = readLE32(available.data());
+    if (signature == 0x02014b50 || signature == 0x06064b50 || signature == 0x06054b50) {
+        inDirectory_ = true;
+        tailOffset_ = offset_;
+        return true;
+    }
+    if (signature != 0x04034b50) {
+        throw std::runtime_error("unexpected data at offset " + std::to_string(offset_));
+    }
+    if (available.size() < 30) return false;
+    size_t headerSize = localHeaderSize(available.substr(0, 30));
+    if (available.size() < headerSize) return false;
+
+    const char* header = available.data();
+    ZipEntry entry;
+    entry.flags = readLE16(header + 6);
+    entry.method = readLE16(header + 8);
+    entry.modTime = readLE16(header + 10);
+    entry.modDate = readLE16(header + 12);
+    entry.crc32 = readLE32(header + 14);
+    entry.compressedSize = readLE32(header + 18);
+    entry.uncompressedSize = readLE32(header + 22);
+    uint16_t nameLength = readLE16(header + 26);
+    entry.name.assign(header + 30, nameLength);
+    entry.localHeaderOffset = offset_;
+    for (size_t field = 30 + nameLength; field + 4 <= headerSize;) {
+        uint16_t id = readLE16(header + field);
+        uint16_t length = readLE16(header + field + 2);
+        size_t value = field + 4;
+        if (id == 0x0001) { // Zip64 sizes, present only for the fields that overflowed
+            if (entry.uncompressedSize == 0xFFFFFFFF && value + 8 <= headerSize) {
+                entry.uncompressedSize = readLE64(header + value);
+                value += 8;
+            }
+            if (entry.compressedSize == 0xFFFFFFFF && value + 8 <= headerSize) {
+                entry.compressedSize = readLE64(header + value);
+            }
+        }
+        field += 4 + length;
+    }
+
+    if (entry.flags & 0x0008) {
+        // The sizes follow the data: find the descriptor whose size matches the bytes before it.
+        size_t at = std::max(headerSize, descriptorScan_);
+        while ((at = available.find("PK\x07\x08", at)) != std::string_view::npos) {
+            if (at + 24 > available.size()) break; // Need the whole (possibly Zip64) descriptor
+            uint64_t dataSize = at - headerSize;
+            size_t descriptorSize = 0;
+            if (readLE32(header + at + 8) == static_cast<uint32_t>(dataSize)) {
+                entry.uncompressedSize = readLE32(header + at + 12);
+                descriptorSize = 16;
+            } else if (readLE64(header + at + 8) == dataSize) {
+                entry.uncompressedSize = readLE64(header + at + 16);
+                descriptorSize = 24;
+            }
+            if (descriptorSize) {
+                entry.crc32 = readLE32(header + at + 4);
+                entry.compressedSize = dataSize;
+                descriptorScan_ = 0;
+                onData_(entry, available.substr(headerSize, static_cast<size_t>(dataSize)), true);
+                advance(at + descriptorSize);
+                return true;
+            }
+            ++at;
+        }
+        descriptorScan_ = at != std::string_view::npos ? at : available.size() - 3; // The signature may be split
+        return false;
+    }
+    if (buffer_(entry)) {
+        if (available.size() - headerSize < entry.compressedSize) return false;
+        advance(headerSize + static_cast<size_t>(entry.compressedSize));
+        onData_(entry, available.substr(headerSize, static_cast<size_t>(entry.compressedSize)), true);
+        return true;
+    }
+    streamed_ = std::move(entry);
+    remaining_ = streamed_.compressedSize;
+    streaming_ = remaining_ > 0;
+    advance(headerSize);
+    if (!streaming_) onData_(streamed_, std::string_view(), true);
+    return true;
+}
+
+} // namespace
+
+/**
+ * @brief Exports a course from Canvas and rewrites the export as it downloads.
+ *
+ * Text entries are rewritten by worker threads while later entries are still
+ * arriving; other entries are copied to the output as their bytes come in.
+ * Entries are written in archive order, so at most a few text entries per
+ * worker are held back at a time.
+ * @param job Input canvas://<course id> and a local or s3:// output.
+ * @param options Start date, index, level and thread counts.
+ * @return True on success, false otherwise.
+ */
+bool rewriteCanvasExport(const ArchiveJob& job, const RewriteOptions& options) {
+    try {
+        CanvasCourse course = parseCanvasPath(job.input.string());
+        std::string downloadUrl;
+        {
+            WorkerActivity activity(workerSlot("main"), "export course " + course.id);
+            std::cout << "Exporting course " << course.id << " from " << course.baseUrl << "..." << std::endl;
+            downloadUrl = exportCanvasCourse(course);
+        }
+
+        std::unique_ptr<S3Upload> upload;
+        std::unique_ptr<std::ostream> stream;
+        if (isS3Path(job.output.string())) {
+            upload = std::make_unique<S3Upload>(parseS3Path(job.output.string()), kUploadPartSize, options.ioThreads);
+            stream = std::make_unique<std::ostream>(upload.get());
+        } else {
+            stream = std::make_unique<std::ofstream>(job.output, std::ios::binary | std::ios::trunc);
+        }
+        std::ostream& out = *stream;
+        if (!out) {
+            throw std::runtime_error("could not create '" + job.output.string() + "'");
+        }
+        uint64_t offset = 0;
+        std::vector<ZipEntry> written;
+        std::vector<uint64_t> sourceOffsets; // Where each written entry was in the export
+        auto write = [&](std::string_view bytes) {
+            out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+            offset += bytes.size();
+        };
+        auto writeEntry = [&](ZipEntry entry, std::string_view data, uint64_t sourceOffset) {
+            write(ZipWriter::localHeader(entry, offset, data.size()));
+            write(data);
+            written.push_back(std::move(entry));
+            sourceOffsets.push_back(sourceOffset);
+        };
+
+        // Text entries queue up for the workers, then wait in archive order to be written.
+        struct Pending {
+            ZipEntry entry;
+            std::string raw;
+            std::unique_ptr<PackedEntry> packed;
+            std::exception_ptr error;
+            bool done = false;
+        };
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<std::shared_ptr<Pending>> todo;
+        std::deque<std::shared_ptr<Pending>> ordered;
+        bool closing = false;
+        std::atomic<long long>& depth = queueDepth("inflate");
+        std::vector<std::thread> workers;
+        for (unsigned n = 0; n < std::max(1u, options.threads); ++n) {
+            workers.emplace_back([&, n, course = t_course] {
+                CourseScope scope(course);
+                WorkerSlot& slot = workerSlot("inflate-" + std::to_string(n));
+                for (;;) {
+                    std::shared_ptr<Pending> item;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        changed.wait(lock, [&] { return closing || !todo.empty(); });
+                        if (todo.empty()) return;
+                        item = todo.front();
+                        todo.pop_front();
+                    }
+                    depth--;
+                    try {
+                        WorkerActivity activity(slot, "inflate+scan " + item->entry.name);
+                        item->packed = rewriteEntry(item->entry, decompressEntry(item->entry, item->raw),
+                                                    job.input.string() + ":" + item->entry.name, options);
+                    } catch (...) {
+                        item->error = std::current_exception();
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        item->done = true;
+                    }
+                    changed.notify_all();
+                }
+            });
+        }
+        auto stopWorkers = [&] {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closing = true;
+                depth -= static_cast<long long>(todo.size());
+                todo.clear();
+            }
+            changed.notify_all();
+            for (auto& worker : workers) worker.join();
+        };
+
+        // Writes entries from the front of the queue until at most `keep` remain.
+        auto flush = [&](size_t keep) {
+            for (;;) {
+                std::shared_ptr<Pending> front;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    if (ordered.empty() || (ordered.size() <= keep && !ordered.front()->done)) return;
+                    changed.wait(lock, [&] { return ordered.front()->done; });
+                    front = ordered.front();
+                    ordered.pop_front();
+                }
+                if (front->error) std::rethrow_exception(front->error);
+                if (front->packed) writeEntry(front->packed->entry, front->packed->data, front->entry.localHeaderOffset);
+                else writeEntry(front->entry, front->raw, front->entry.localHeaderOffset);
+            }
+        };
+
+        size_t maxPending = 4 * static_cast<size_t>(std::max(1u, options.threads));
+        bool streaming = false;
+        auto buffered = [&](const ZipEntry& entry) { return isRewritableEntry(entry, options); };
+        ZipStreamReader reader(buffered, [&](const ZipEntry& entry, std::string_view data, bool last) {
+            if (buffered(entry)) {
+                auto item = std::make_shared<Pending>();
+                item->entry = entry;
+                item->raw.assign(data.data(), data.size());
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    todo.push_back(item);
+                    ordered.push_back(item);
+                }
+                depth++;
+                changed.notify_all();
+                flush(maxPending);
+                return;
+            }
+            if (!streaming) {
+                flush(0); // Everything before this entry goes out first
+                ZipEntry copy = entry;
+                write(ZipWriter::localHeader(copy, offset, entry.compressedSize));
+                written.push_back(std::move(copy));
+                sourceOffsets.push_back(entry.localHeaderOffset);
+                streaming = true;
+            }
+            write(data);
+            streaming = !last;
+        });
+
+        try {
+            PhaseTimer timer(Phase::Process);
+            WorkerActivity activity(workerSlot("main"), "download course " + course.id);
+            streamCurl({"--fail", "-L", downloadUrl}, canvasConfig(course), [&](std::string_view chunk) {
+                g_stats.bytesIn += chunk.size();
+                reader.feed(chunk);
+            });
+            reader.finish();
+            flush(0);
+        } catch (...) {
+            stopWorkers();
+            throw;
+        }
+        stopWorkers();
+
+        // Attributes such as Unix permissions are only in the export's central directory.
+        const std::string& tail = reader.tail();
+        ZipArchive source = ZipArchive::fromTail([&](uint64_t at, size_t size) {
+            std::string bytes(size, '\0');
+            if (at + size > reader.tailOffset()) {
+                uint64_t from = std::max(at, reader.tailOffset());
+                tail.copy(&bytes[static_cast<size_t>(from - at)], static_cast<size_t>(at + size - from),
+                          static_cast<size_t>(from - reader.tailOffset()));
+            }
+            return bytes;
+        }, reader.tailOffset() + tail.size());
+        std::unordered_map<uint64_t, const ZipEntry*> byOffset;
+        for (const auto& entry : source.entries()) byOffset[entry.localHeaderOffset] = &entry;
+        for (size_t i = 0; i < written.size(); ++i) {
+            auto it = byOffset.find(sourceOffsets[i]);
+            if (it == byOffset.end()) continue;
+            written[i].versionMadeBy = it->second->versionMadeBy;
+            written[i].externalAttributes = it->second->externalAttributes;
+        }
+
+        PhaseTimer timer(Phase::Rezip);
+        write(ZipWriter::centralDirectory(written, offset));
+        out.flush();
+        if (upload) upload->complete();
+        if (!out) {
+            throw std::runtime_error("could not write '" + job.output.string() + "'");
+        }
+        g_stats.bytesOut += offset;
+        g_stats.archivesProcessed++;
+    } catch (const std::exception& e) {
+        std::cerr << "Error: Could not rewrite '" << job.input.string() << "': " << e.what() << std::endl;
+        return false;
+    }
+    std::cout << "Successfully created new archive at '"
+              << (isS3Path(job.output.string()) ? job.output.string() : std::filesystem::absolute(job.output).string())
+              << "'" << std::endl;
+    return true;
+}
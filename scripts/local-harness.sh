@@ -0,0 +1,159 @@
+#!/usr/bin/env bash
+# Runs the distributed modes of canvasupdater on one box against local stand-ins
+# (scripts/mock_services.py) and checks what they publish:
+#   - multipart uploads to S3 that complete, and one that fails and is aborted
+#   - a Canvas export that is rewritten while it downloads
+#   - a queue drained by several workers, with local, s3:// and canvas:// jobs
+#   - a lease that expires while its worker is stopped and is finished by another
+#
+# Usage: scripts/local-harness.sh [path/to/canvasupdater]
+# Without a path the tool is built from canvasupdater.cpp first. Needs python3,
+# curl and g++. The scratch directory is removed on success and kept on failure.
+set -euo pipefail
+
+repo=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/canvasupdater-harness.XXXXXX")
+start=01/06/2025
+pids=()
+
+cleanup() {
+    status=$?
+    for pid in "${pids[@]}"; do
+        kill -CONT "$pid" 2>/dev/null || true
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    if [ "$status" -eq 0 ]; then
+        rm -rf "$work"
+    else
+        echo "FAILED; logs and outputs are in $work" >&2
+    fi
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+ok() {
+    echo "ok: $*"
+}
+
+stat_of() {
+    curl -s "$S3_ENDPOINT/_stats" | python3 -c "import json, sys; print(eval(sys.argv[1], json.load(sys.stdin)))" "$1"
+}
+
+wait_for() { # <seconds> <command...>
+    local deadline=$((SECONDS + $1))
+    shift
+    until "$@"; do
+        [ "$SECONDS" -lt "$deadline" ] || return 1
+        sleep 0.2
+    done
+}
+
+bin=${1:-}
+if [ -z "$bin" ]; then
+    echo "Building canvasupdater..."
+    g++ -std=c++20 -O2 -pthread "$repo/canvasupdater.cpp" -o "$work/canvasupdater" -lz -ldl
+    bin=$work/canvasupdater
+fi
+bin=$(cd "$(dirname "$bin")" && pwd)/$(basename "$bin")
+
+# --- Fixture: the repo's templates plus 20 MB of media, so outputs span several 8 MB parts ---
+python3 - "$repo/html" "$work/course.imscc" <<'EOF'
+import os, random, sys, zipfile
+html, archive = sys.argv[1], sys.argv[2]
+with zipfile.ZipFile(archive, "w", zipfile.ZIP_DEFLATED) as out:
+    for folder, _, files in sorted(os.walk(html)):
+        for name in sorted(files):
+            path = os.path.join(folder, name)
+            out.write(path, os.path.relpath(path, os.path.dirname(html)))
+    media = random.Random(1).getrandbits(8 * (20 << 20)).to_bytes(20 << 20, "little")
+    out.writestr(zipfile.ZipInfo("web_resources/media/lecture.bin"), media, zipfile.ZIP_STORED)
+EOF
+"$bin" -start "$start" -o "$work/reference.imscc" "$work/course.imscc" >"$work/reference.log"
+ok "rewrote the fixture locally for reference"
+
+# --- Stand-ins ---
+store=$work/store
+mkdir -p "$store/bucket/in" "$store/canvas" "$work/out"
+cp "$work/course.imscc" "$store/bucket/in/course.imscc"
+cp "$work/course.imscc" "$store/canvas/101.imscc"
+cp "$work/course.imscc" "$store/canvas/102.imscc"
+echo 8 >"$store/canvas/102.delay" # Exports slowly enough to stop its worker mid-job
+
+export CANVAS_TOKEN=harness-token AWS_ACCESS_KEY_ID=harness AWS_SECRET_ACCESS_KEY=harness-secret
+python3 "$repo/scripts/mock_services.py" "$work/port" "$store" &
+pids+=($!)
+wait_for 10 test -s "$work/port" || fail "the mock services did not start"
+export S3_ENDPOINT=http://127.0.0.1:$(cat "$work/port")
+export CANVAS_URL=$S3_ENDPOINT
+
+# --- Multipart upload: completes, and aborts when a part keeps failing ---
+"$bin" -start "$start" -o s3://bucket/out/direct.imscc "$work/course.imscc" >"$work/direct.log"
+cmp -s "$store/bucket/out/direct.imscc" "$work/reference.imscc" || fail "the uploaded archive differs"
+[ "$(stat_of completed)" -ge 1 ] || fail "no multipart upload was completed"
+ok "streamed an output to s3:// as a multipart upload"
+
+if "$bin" -start "$start" -o s3://fail/direct.imscc "$work/course.imscc" >"$work/abort.log" 2>&1; then
+    fail "an upload whose parts all failed reported success"
+fi
+[ ! -e "$store/fail/direct.imscc" ] || fail "a failed upload left an object behind"
+[ "$(stat_of aborted)" -ge 1 ] || fail "the failed upload was not aborted"
+[ "$(stat_of open_uploads)" -eq 0 ] || fail "a multipart upload was left open"
+ok "aborted the multipart upload after its parts failed"
+
+# --- Canvas export, rewritten while it downloads ---
+"$bin" -start "$start" -o s3://bucket/out/streamed.imscc canvas://101 >"$work/canvas.log"
+cmp -s "$store/bucket/out/streamed.imscc" "$work/reference.imscc" || fail "the rewritten Canvas export differs"
+[ "$(stat_of "first_part['bucket/out/streamed.imscc'] < download_done['101.imscc']")" = True ] ||
+    fail "no part of the output was uploaded before the export finished downloading"
+ok "rewrote a Canvas export as it downloaded, uploading parts before the download ended"
+
+# --- Queue: three workers, local, s3:// and canvas:// jobs ---
+printf '%s\t%s\n' \
+    "$work/course.imscc" "$work/out/local.imscc" \
+    "$work/course.imscc" "s3://bucket/out/queued-local.imscc" \
+    "s3://bucket/in/course.imscc" "$work/out/from-s3.imscc" \
+    "canvas://101" "$work/out/from-canvas.imscc" \
+    "canvas://101" "s3://bucket/out/queued-canvas.imscc" >"$work/jobs.txt"
+"$bin" queue init "$work/queue" -start "$start" "$work/jobs.txt" >"$work/queue-init.log"
+workers=()
+for n in 1 2 3; do
+    "$bin" queue work "$work/queue" -j 2 -lease 5 -worker "w$n" >"$work/worker-$n.log" 2>&1 &
+    workers+=($!)
+    pids+=($!)
+done
+for pid in "${workers[@]}"; do
+    wait "$pid" || fail "a queue worker failed; see $work/worker-*.log"
+done
+"$bin" queue status "$work/queue" >"$work/queue-status.log" || fail "$(cat "$work/queue-status.log")"
+grep -q "^0 pending, 0 leased, 5 done, 0 failed" "$work/queue-status.log" || fail "$(cat "$work/queue-status.log")"
+for output in "$work/out/local.imscc" "$store/bucket/out/queued-local.imscc" "$work/out/from-s3.imscc" \
+    "$work/out/from-canvas.imscc" "$store/bucket/out/queued-canvas.imscc"; do
+    cmp -s "$output" "$work/reference.imscc" || fail "queued output $output differs"
+done
+! ls "$work/out" | grep -q '\.part-' || fail "a worker left a partial output behind"
+ok "three workers drained a queue of local, s3:// and canvas:// jobs: $(cat "$work/queue-status.log")"
+
+# --- Lease expiry: a stopped worker's item is reclaimed and finished by another ---
+printf '%s\t%s\n' "canvas://102" "$work/out/leased.imscc" >"$work/lease-jobs.txt"
+"$bin" queue init "$work/lease-queue" -start "$start" "$work/lease-jobs.txt" >/dev/null
+"$bin" queue work "$work/lease-queue" -lease 3 -worker stalled >"$work/stalled.log" 2>&1 &
+stalled=$!
+pids+=($stalled)
+wait_for 10 compgen -G "$work/lease-queue/leased/*@stalled" >/dev/null || fail "the first worker never leased the item"
+kill -STOP "$stalled"
+"$bin" queue work "$work/lease-queue" -lease 3 -worker rescuer >"$work/rescuer.log" 2>&1 ||
+    fail "the second worker failed; see $work/rescuer.log"
+kill -CONT "$stalled"
+wait "$stalled" || fail "the stalled worker failed after resuming; see $work/stalled.log"
+grep -q "^worker rescuer$" "$work/lease-queue/done/"* || fail "the item was not finished by the second worker"
+grep -q "Lost the lease" "$work/stalled.log" || fail "the stalled worker did not notice it lost its lease"
+cmp -s "$work/out/leased.imscc" "$work/reference.imscc" || fail "the reclaimed item's output differs"
+! ls "$work/out" | grep -q '\.part-' || fail "the stalled worker left its partial output behind"
+ok "a lease expired while its worker was stopped; another worker finished the item and the first discarded its result"
+
+echo "All checks passed."
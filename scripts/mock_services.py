@@ -0,0 +1,247 @@
+#!/usr/bin/env python3
+"""Local stand-ins for the services canvasupdater talks to, for scripts/local-harness.sh.
+
+One HTTP server answers both:
+  S3 (path-style, as with S3_ENDPOINT=http://127.0.0.1:PORT)
+      objects live under ROOT/<bucket>/<key>; PUT/GET (with Range)/HEAD/DELETE,
+      multipart create/upload/copy/complete/abort. Every part uploaded to the
+      bucket named "fail" is answered with a 500, so the upload gets aborted.
+  Canvas (CANVAS_URL=http://127.0.0.1:PORT)
+      POST /api/v1/courses/<id>/content_exports starts an export of
+      ROOT/canvas/<id>.imscc; it stays "exporting" for the number of seconds in
+      ROOT/canvas/<id>.delay (0 if absent). The download is sent in small chunks
+      so the client has to process it as it arrives.
+GET /_stats returns counters as JSON.
+
+Usage: mock_services.py <port-file> <root>
+Listens on a free port and writes it to <port-file> once it is accepting.
+"""
+import hashlib
+import http.server
+import json
+import os
+import re
+import socketserver
+import sys
+import threading
+import time
+import urllib.parse
+import uuid
+
+ROOT = sys.argv[2]
+CHUNK = 64 << 10         # Download chunk size
+CHUNK_PAUSE = 0.005      # Seconds between chunks
+
+lock = threading.Lock()
+uploads = {}             # upload id -> {"key": ..., "parts": {number: bytes}}
+exports = {}             # export id -> {"course": ..., "ready": time}
+stats = {"parts": 0, "part_failures": 0, "completed": 0, "aborted": 0, "exports": 0, "downloads": 0,
+         "first_part": {}, "download_done": {}}
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    def split(self):
+        url = urllib.parse.urlsplit(self.path)
+        return urllib.parse.unquote(url.path).lstrip("/"), urllib.parse.parse_qs(url.query, keep_blank_values=True)
+
+    def body(self):
+        length = int(self.headers.get("Content-Length", 0))
+        return self.rfile.read(length) if length else b""
+
+    def send(self, code, data=b"", headers=None):
+        self.send_response(code)
+        for name, value in (headers or {}).items():
+            self.send_header(name, value)
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        if self.command != "HEAD":
+            self.wfile.write(data)
+
+    def send_json(self, code, value):
+        self.send(code, json.dumps(value).encode(), {"Content-Type": "application/json"})
+
+    def s3_error(self, code, name, message):
+        self.send(code, f"<Error><Code>{name}</Code><Message>{message}</Message></Error>".encode())
+
+    def signed(self):
+        if "AWS4-HMAC-SHA256" in self.headers.get("Authorization", ""):
+            return True
+        self.s3_error(403, "AccessDenied", "request is not signed")
+        return False
+
+    def object_path(self, key):
+        return os.path.join(ROOT, key)
+
+    # --- Canvas ---
+
+    def canvas(self, path):
+        if self.headers.get("Authorization", "") != "Bearer " + os.environ.get("CANVAS_TOKEN", ""):
+            return self.send_json(401, {"errors": [{"message": "Invalid access token."}]})
+        match = re.fullmatch(r"api/v1/courses/([^/]+)/content_exports(?:/(\d+))?", path)
+        if not match:
+            return self.send_json(404, {"errors": [{"message": "The specified resource does not exist."}]})
+        course, export_id = match.groups()
+        archive = os.path.join(ROOT, "canvas", course + ".imscc")
+        if not os.path.exists(archive):
+            return self.send_json(404, {"errors": [{"message": "The specified resource does not exist."}]})
+        if self.command == "POST":
+            delay = 0.0
+            if os.path.exists(archive[:-len(".imscc")] + ".delay"):
+                delay = float(open(archive[:-len(".imscc")] + ".delay").read())
+            with lock:
+                export_id = str(len(exports) + 1)
+                exports[export_id] = {"course": course, "ready": time.time() + delay}
+                stats["exports"] += 1
+            return self.send_json(200, {"id": int(export_id), "workflow_state": "created"})
+        export = exports.get(export_id)
+        if not export or export["course"] != course:
+            return self.send_json(404, {"errors": [{"message": "The specified resource does not exist."}]})
+        if time.time() < export["ready"]:
+            return self.send_json(200, {"id": int(export_id), "workflow_state": "exporting"})
+        host = self.headers.get("Host")
+        return self.send_json(200, {"id": int(export_id), "workflow_state": "exported",
+                                    "attachment": {"url": f"http://{host}/files/{course}.imscc"}})
+
+    def download(self, name):
+        path = os.path.join(ROOT, "canvas", name)
+        if not os.path.exists(path):
+            return self.send(404)
+        data = open(path, "rb").read()
+        self.send_response(200)
+        self.send_header("Content-Length", str(len(data)))
+        self.end_headers()
+        for at in range(0, len(data), CHUNK):
+            self.wfile.write(data[at:at + CHUNK])
+            self.wfile.flush()
+            time.sleep(CHUNK_PAUSE)
+        with lock:
+            stats["downloads"] += 1
+            stats["download_done"][name] = time.time()
+
+    # --- S3 ---
+
+    def do_POST(self):
+        path, query = self.split()
+        if path.startswith("api/"):
+            self.body()
+            return self.canvas(path)
+        data = self.body()
+        if not self.signed():
+            return
+        if "uploads" in query:
+            upload_id = uuid.uuid4().hex
+            with lock:
+                uploads[upload_id] = {"key": path, "parts": {}}
+            body = f"<InitiateMultipartUploadResult><UploadId>{upload_id}</UploadId></InitiateMultipartUploadResult>"
+            return self.send(200, body.encode())
+        with lock:
+            upload = uploads.pop(query["uploadId"][0], None)
+        if upload is None:
+            return self.s3_error(404, "NoSuchUpload", "unknown upload")
+        numbers = [int(n) for n in re.findall(rb"<PartNumber>(\d+)</PartNumber>", data)]
+        if any(n not in upload["parts"] for n in numbers):
+            return self.s3_error(400, "InvalidPart", "a listed part was never uploaded")
+        os.makedirs(os.path.dirname(self.object_path(path)), exist_ok=True)
+        with open(self.object_path(path), "wb") as out:
+            for n in numbers:
+                out.write(upload["parts"][n])
+        with lock:
+            stats["completed"] += 1
+        self.send(200, b'<CompleteMultipartUploadResult><ETag>"done"</ETag></CompleteMultipartUploadResult>')
+
+    def do_PUT(self):
+        path, query = self.split()
+        data = self.body()
+        if not self.signed():
+            return
+        if "uploadId" not in query:
+            os.makedirs(os.path.dirname(self.object_path(path)), exist_ok=True)
+            with open(self.object_path(path), "wb") as out:
+                out.write(data)
+            return self.send(200, headers={"ETag": '"%s"' % hashlib.md5(data).hexdigest()})
+        upload = uploads.get(query["uploadId"][0])
+        if upload is None:
+            return self.s3_error(404, "NoSuchUpload", "unknown upload")
+        if path.startswith("fail/"):
+            with lock:
+                stats["part_failures"] += 1
+            return self.s3_error(500, "InternalError", "injected part failure")
+        source = self.headers.get("x-amz-copy-source")
+        if source:
+            data = open(self.object_path(urllib.parse.unquote(source).lstrip("/")), "rb").read()
+            byte_range = self.headers.get("x-amz-copy-source-range")
+            if byte_range:
+                first, last = map(int, byte_range.split("=")[1].split("-"))
+                data = data[first:last + 1]
+        with lock:
+            upload["parts"][int(query["partNumber"][0])] = data
+            stats["parts"] += 1
+            stats["first_part"].setdefault(path, time.time())
+        etag = '"%s"' % hashlib.md5(data).hexdigest()
+        if source:
+            return self.send(200, f"<CopyPartResult><ETag>{etag}</ETag></CopyPartResult>".encode())
+        self.send(200, headers={"ETag": etag})
+
+    def do_DELETE(self):
+        path, query = self.split()
+        self.body()
+        if not self.signed():
+            return
+        if "uploadId" in query:
+            with lock:
+                if uploads.pop(query["uploadId"][0], None) is not None:
+                    stats["aborted"] += 1
+        elif os.path.exists(self.object_path(path)):
+            os.remove(self.object_path(path))
+        self.send(204)
+
+    def do_GET(self):
+        path, query = self.split()
+        self.body()
+        if path == "_stats":
+            with lock:
+                return self.send_json(200, dict(stats, open_uploads=len(uploads)))
+        if path.startswith("api/"):
+            return self.canvas(path)
+        if path.startswith("files/"):
+            return self.download(path[len("files/"):])
+        if not self.signed():
+            return
+        if not os.path.isfile(self.object_path(path)):
+            return self.s3_error(404, "NoSuchKey", "no such key")
+        data = open(self.object_path(path), "rb").read()
+        byte_range = self.headers.get("Range")
+        if not byte_range:
+            return self.send(200, data)
+        first, last = re.fullmatch(r"bytes=(\d*)-(\d*)", byte_range).groups()
+        if first == "":
+            first, last = len(data) - int(last), len(data) - 1
+        else:
+            first, last = int(first), min(int(last) if last else len(data) - 1, len(data) - 1)
+        self.send(206, data[first:last + 1], {"Content-Range": f"bytes {first}-{last}/{len(data)}"})
+
+    def do_HEAD(self):
+        path, _ = self.split()
+        if not self.signed():
+            return
+        if not os.path.isfile(self.object_path(path)):
+            return self.send(404)
+        self.send_response(200)
+        self.send_header("Content-Length", str(os.path.getsize(self.object_path(path))))
+        self.end_headers()
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+
+server = Server(("127.0.0.1", 0), Handler)
+with open(sys.argv[1] + ".tmp", "w") as port_file:
+    port_file.write(str(server.server_address[1]))
+os.rename(sys.argv[1] + ".tmp", sys.argv[1])
+server.serve_forever()